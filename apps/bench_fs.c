@@ -0,0 +1,486 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Benchmark parameters, set from the command line */
+struct bench_config {
+	const char *diskname;
+	size_t data_blocks;
+	size_t file_size;
+	size_t ops;
+	const char *only;
+	int checksums;
+	int ram;
+	int io_threads;
+	/* Emulated storage, all 0 for none */
+	struct block_emulation emu;
+};
+
+/* Measurements of one workload */
+struct bench_result {
+	const char *name;
+	size_t io_size;
+	size_t ops;
+	size_t bytes;
+	uint64_t start;
+	uint64_t *lat;
+	size_t lat_cap;
+};
+
+static const size_t io_sizes[] = { 512, 4096, 65536, 1048576 };
+
+static char *data;
+static int first_result = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int wanted(struct bench_config *cfg, const char *name)
+{
+	return !cfg->only || strstr(name, cfg->only);
+}
+
+static void result_start(struct bench_result *res, const char *name,
+			 size_t io_size, size_t max_ops)
+{
+	res->name = name;
+	res->io_size = io_size;
+	res->ops = 0;
+	res->bytes = 0;
+	res->lat_cap = max_ops;
+	res->lat = malloc(max_ops * sizeof(uint64_t));
+	if (!res->lat)
+		die("Out of memory");
+	res->start = now_ns();
+}
+
+/* Record one operation that started at @start and moved @bytes bytes */
+static void result_op(struct bench_result *res, uint64_t start, size_t bytes)
+{
+	if (res->ops < res->lat_cap)
+		res->lat[res->ops] = now_ns() - start;
+	res->ops++;
+	res->bytes += bytes;
+}
+
+/* Print the result as one JSON object of the "results" array */
+static void result_end(struct bench_result *res)
+{
+	double seconds = (now_ns() - res->start) / 1e9;
+	size_t n = res->ops < res->lat_cap ? res->ops : res->lat_cap;
+	double p50 = 0, p99 = 0;
+
+	if (n) {
+		qsort(res->lat, n, sizeof(uint64_t), cmp_u64);
+		p50 = res->lat[n / 2] / 1e3;
+		p99 = res->lat[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / 1e3;
+	}
+
+	printf("%s\n\t\t{ \"name\": \"%s\", \"io_size\": %zu, \"ops\": %zu, "
+	       "\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+	       "\"ops_per_s\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f }",
+	       first_result ? "" : ",", res->name, res->io_size, res->ops,
+	       res->bytes, seconds,
+	       seconds > 0 ? res->bytes / seconds / (1024 * 1024) : 0,
+	       seconds > 0 ? res->ops / seconds : 0, p50, p99);
+	fflush(stdout);
+	first_result = 0;
+
+	free(res->lat);
+}
+
+static int open_new(const char *filename)
+{
+	int fd;
+
+	if (fs_create(filename))
+		die("Cannot create file %s", filename);
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file %s", filename);
+	return fd;
+}
+
+static void close_delete(int fd, const char *filename)
+{
+	if (fs_close(fd) || fs_delete(filename))
+		die("Cannot close and delete file %s", filename);
+}
+
+static void bench_seq_rand(struct bench_config *cfg, size_t io_size)
+{
+	struct bench_result res;
+	size_t count = cfg->file_size / io_size;
+	size_t i;
+	int fd;
+
+	if (count == 0)
+		return;
+
+	fd = open_new("bench_seq");
+
+	/* Sequential writes build the file that the other workloads use */
+	result_start(&res, "seq_write", io_size, count);
+	for (i = 0; i < count; i++) {
+		uint64_t start = now_ns();
+		if (fs_write(fd, data, io_size) != (int)io_size)
+			die("Short write, disk too small?");
+		result_op(&res, start, io_size);
+	}
+	if (wanted(cfg, "seq_write"))
+		result_end(&res);
+	else
+		free(res.lat);
+
+	if (wanted(cfg, "seq_read")) {
+		fs_lseek(fd, 0);
+		result_start(&res, "seq_read", io_size, count);
+		for (i = 0; i < count; i++) {
+			uint64_t start = now_ns();
+			if (fs_read(fd, data, io_size) != (int)io_size)
+				die("Short read");
+			result_op(&res, start, io_size);
+		}
+		result_end(&res);
+	}
+
+	size_t ops = count < cfg->ops ? count : cfg->ops;
+
+	if (wanted(cfg, "rand_write")) {
+		result_start(&res, "rand_write", io_size, ops);
+		for (i = 0; i < ops; i++) {
+			uint64_t start = now_ns();
+			fs_lseek(fd, (rand() % count) * io_size);
+			if (fs_write(fd, data, io_size) != (int)io_size)
+				die("Short write");
+			result_op(&res, start, io_size);
+		}
+		result_end(&res);
+	}
+
+	if (wanted(cfg, "rand_read")) {
+		result_start(&res, "rand_read", io_size, ops);
+		for (i = 0; i < ops; i++) {
+			uint64_t start = now_ns();
+			fs_lseek(fd, (rand() % count) * io_size);
+			if (fs_read(fd, data, io_size) != (int)io_size)
+				die("Short read");
+			result_op(&res, start, io_size);
+		}
+		result_end(&res);
+	}
+
+	close_delete(fd, "bench_seq");
+}
+
+static void bench_append(struct bench_config *cfg)
+{
+	struct bench_result res;
+	size_t i;
+	int fd;
+
+	if (!wanted(cfg, "small_append"))
+		return;
+
+	fd = open_new("bench_append");
+	result_start(&res, "small_append", 64, cfg->ops);
+	for (i = 0; i < cfg->ops; i++) {
+		uint64_t start = now_ns();
+		if (fs_write(fd, data, 64) != 64)
+			die("Short write");
+		result_op(&res, start, 64);
+	}
+	result_end(&res);
+	close_delete(fd, "bench_append");
+}
+
+static void bench_churn(struct bench_config *cfg)
+{
+	struct bench_result res;
+	char filename[FS_FILENAME_LEN];
+	size_t i;
+
+	if (!wanted(cfg, "create_delete"))
+		return;
+
+	result_start(&res, "create_delete", 0, cfg->ops);
+	for (i = 0; i < cfg->ops; i++) {
+		uint64_t start = now_ns();
+		snprintf(filename, sizeof(filename), "churn%zu", i % 64);
+		if (fs_create(filename) || fs_delete(filename))
+			die("Cannot create and delete %s", filename);
+		result_op(&res, start, 0);
+	}
+	result_end(&res);
+}
+
+static void bench_open_close(struct bench_config *cfg)
+{
+	struct bench_result res;
+	size_t i;
+	int fd;
+
+	if (!wanted(cfg, "open_close"))
+		return;
+
+	fd = open_new("bench_open");
+	result_start(&res, "open_close", 0, cfg->ops);
+	for (i = 0; i < cfg->ops; i++) {
+		uint64_t start = now_ns();
+		int fd2 = fs_open("bench_open");
+		if (fd2 < 0 || fs_close(fd2))
+			die("Cannot open and close file");
+		result_op(&res, start, 0);
+	}
+	result_end(&res);
+	close_delete(fd, "bench_open");
+}
+
+/* Sequential reads kept ASYNC_DEPTH deep, collected through the eventfd */
+#define ASYNC_DEPTH 16
+
+static void bench_async(struct bench_config *cfg)
+{
+	struct bench_result res;
+	struct fs_async_completion done[ASYNC_DEPTH];
+	struct pollfd pfd;
+	size_t io_size = 65536, count = cfg->file_size / io_size;
+	size_t i, submitted = 0, in_flight = 0, slot;
+	uint64_t starts[ASYNC_DEPTH], events;
+	char *bufs;
+	int fd, n;
+
+	if (!wanted(cfg, "async_read") || count == 0)
+		return;
+
+	fd = open_new("bench_async");
+	for (i = 0; i < count; i++)
+		if (fs_write(fd, data, io_size) != (int)io_size)
+			die("Short write, disk too small?");
+	fs_lseek(fd, 0);
+
+	pfd.fd = fs_async_eventfd();
+	pfd.events = POLLIN;
+	bufs = malloc(ASYNC_DEPTH * io_size);
+	if (pfd.fd < 0 || !bufs)
+		die("Cannot set up asynchronous reads");
+
+	/* Requests complete in order, so slots are reused in order too */
+	result_start(&res, "async_read", io_size, count);
+	while (res.ops < count) {
+		while (in_flight < ASYNC_DEPTH && submitted < count) {
+			slot = submitted % ASYNC_DEPTH;
+			starts[slot] = now_ns();
+			if (fs_read_async(fd, bufs + slot * io_size, io_size, NULL,
+					  (void *)slot))
+				die("Cannot submit read");
+			submitted++;
+			in_flight++;
+		}
+
+		if (poll(&pfd, 1, -1) < 0 ||
+		    read(pfd.fd, &events, sizeof(events)) < 0)
+			continue;
+
+		n = fs_async_reap(done, ASYNC_DEPTH);
+		for (i = 0; i < (size_t)n; i++) {
+			if (done[i].result != (int)io_size)
+				die("Short read");
+			result_op(&res, starts[(size_t)done[i].arg], io_size);
+			in_flight--;
+		}
+	}
+	result_end(&res);
+
+	free(bufs);
+	close_delete(fd, "bench_async");
+}
+
+static void bench_fill(struct bench_config *cfg)
+{
+	struct bench_result res;
+	size_t max_ops = cfg->data_blocks * 4096 / 1048576 + 2;
+	int fd, written;
+
+	if (!wanted(cfg, "fill"))
+		return;
+
+	fd = open_new("bench_fill");
+	result_start(&res, "fill", 1048576, max_ops);
+	do {
+		uint64_t start = now_ns();
+		written = fs_write(fd, data, 1048576);
+		result_op(&res, start, written > 0 ? written : 0);
+	} while (written == 1048576);
+	result_end(&res);
+	close_delete(fd, "bench_fill");
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-d <diskname>] [-b <data blocks>] "
+		"[-s <file size>] [-n <ops>] [-w <workload>] "
+		"[-c none|meta|data] [-r] [-t <I/O threads>] "
+		"[-l <latency us>] [-k <seek ns per block>] [-K <max seek us>] "
+		"[-B <MB/s>] [-y <sync us>]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg = {
+		.diskname = "bench.fs",
+		.data_blocks = 16384,
+		.file_size = 16 * 1048576,
+		.ops = 10000,
+		.only = NULL,
+		.checksums = 0,
+		.ram = 0,
+		.io_threads = -1,
+	};
+	struct fs_format_options options = { 0 };
+	size_t i;
+	int opt, emulated;
+
+	while ((opt = getopt(argc, argv, "d:b:s:n:w:c:rt:l:k:K:B:y:")) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.diskname = optarg;
+			break;
+		case 'b':
+			cfg.data_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.file_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.only = optarg;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "meta"))
+				cfg.checksums = FS_CSUM_METADATA;
+			else if (!strcmp(optarg, "data"))
+				cfg.checksums = FS_CSUM_DATA;
+			else if (strcmp(optarg, "none"))
+				usage(argv[0]);
+			break;
+		case 'r':
+			cfg.ram = 1;
+			break;
+		case 't':
+			cfg.io_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			cfg.emu.latency_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'k':
+			cfg.emu.seek_ns = strtoull(optarg, NULL, 0);
+			break;
+		case 'K':
+			cfg.emu.seek_max_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'B':
+			cfg.emu.bandwidth = strtoull(optarg, NULL, 0) * 1048576;
+			break;
+		case 'y':
+			cfg.emu.sync_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (cfg.ops == 0)
+		usage(argv[0]);
+
+	data = malloc(1048576);
+	if (!data)
+		die("Out of memory");
+	for (i = 0; i < 1048576; i++)
+		data[i] = rand();
+	srand(1);
+
+	/* Every run starts from a fresh image, kept in memory with -r so that
+	 * the host file system doesn't weigh on the results */
+	if (cfg.ram && block_ram_create(cfg.diskname, 0, NULL))
+		die("Cannot create RAM disk %s", cfg.diskname);
+	fs_set_io_threads(cfg.io_threads);
+	options.checksums = cfg.checksums;
+	if (fs_format(cfg.diskname, cfg.data_blocks, &options))
+		die("Cannot create disk %s", cfg.diskname);
+	if (fs_mount(cfg.diskname))
+		die("Cannot mount disk %s", cfg.diskname);
+
+	/* Only the workloads run on the emulated storage, not the setup */
+	emulated = cfg.emu.latency_ns || cfg.emu.seek_ns || cfg.emu.bandwidth ||
+		cfg.emu.sync_ns;
+	if (emulated)
+		block_set_emulation(&cfg.emu);
+
+	printf("{\n\t\"data_blocks\": %zu,\n\t\"file_size\": %zu,\n"
+	       "\t\"checksums\": %d,\n\t\"ram\": %d,\n"
+	       "\t\"emulation\": { \"latency_ns\": %" PRIu64
+	       ", \"seek_ns\": %" PRIu64 ", \"seek_max_ns\": %" PRIu64
+	       ", \"bandwidth\": %" PRIu64 ", \"sync_ns\": %" PRIu64 " },\n"
+	       "\t\"results\": [",
+	       cfg.data_blocks, cfg.file_size, cfg.checksums, cfg.ram,
+	       cfg.emu.latency_ns, cfg.emu.seek_ns, cfg.emu.seek_max_ns,
+	       cfg.emu.bandwidth, cfg.emu.sync_ns);
+
+	for (i = 0; i < ARRAY_SIZE(io_sizes); i++)
+		bench_seq_rand(&cfg, io_sizes[i]);
+	bench_append(&cfg);
+	bench_churn(&cfg);
+	bench_open_close(&cfg);
+	bench_async(&cfg);
+	bench_fill(&cfg);
+
+	printf("\n\t]\n}\n");
+
+	if (emulated)
+		block_set_emulation(NULL);
+
+	if (fs_umount())
+		die("Cannot unmount disk");
+	if (cfg.ram)
+		block_ram_destroy(cfg.diskname);
+	else
+		unlink(cfg.diskname);
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/* Exit codes, as for fsck */
+#define CHECK_CLEAN	0
+#define CHECK_REPAIRED	1
+#define CHECK_ERRORS	4
+#define CHECK_FAILED	8
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-r] [-v] [-j <threads>] <diskname>...\n",
+		program);
+	exit(CHECK_FAILED);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_check_report report;
+	int flags = 0, status = 0;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rvj:")) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= FS_CHECK_REPAIR;
+			break;
+		case 'v':
+			flags |= FS_CHECK_VERBOSE;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || threads < 1)
+		usage(argv[0]);
+
+	for (; optind < argc; optind++) {
+		const char *diskname = argv[optind];
+
+		if (fs_check(diskname, flags, threads, &report)) {
+			fprintf(stderr, "%s: cannot check disk\n", diskname);
+			status |= CHECK_FAILED;
+			continue;
+		}
+
+		printf("%s: %" PRIu64 " files, %" PRIu64 " directories, "
+		       "%" PRIu64 " blocks used, %" PRIu64 " errors, "
+		       "%" PRIu64 " repaired\n", diskname, report.files,
+		       report.dirs, report.blocks_used, report.errors,
+		       report.repaired);
+
+		if (report.repaired)
+			status |= CHECK_REPAIRED;
+		if (report.errors > report.repaired)
+			status |= CHECK_ERRORS;
+	}
+
+	return status;
+}
@@ -0,0 +1,5 @@
+#!/bin/sh
+# Runs every workload of the benchmark on a small disk. bench_fs.x fails on
+# any short read or write
+set -e
+./bench_fs.x -d test.fs -b 2048 -s 1048576 -n 200 > /dev/null
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Corrupts the FAT of a disk holding one file of 3 blocks, then checks that
+# fs_check.x finds the errors, repairs them and leaves a clean disk
+set -e
+cat > test.script <<'END'
+FORMAT	100
+MOUNT
+CREATE	file
+OPEN	file
+WRITE	FILL	12288	a
+CLOSE
+UMOUNT
+CHECK	3
+END
+./test_fs.x script test.fs test.script > /dev/null
+rm test.script
+
+# Set 16-bit FAT entries to FAT_EOC: the second block of the file, cutting its
+# chain short, and free block 50
+fat_eoc() {
+	printf '\377\377' | dd of=test.fs bs=1 seek=$((4096 + 2 * $1)) \
+		conv=notrunc 2> /dev/null
+}
+fat_eoc 2
+fat_eoc 50
+
+status=0
+./fs_check.x test.fs > /dev/null || status=$?
+test $status -eq 4
+./fs_check.x -r test.fs | grep -q ' 3 errors, 3 repaired$'
+./fs_check.x test.fs | grep -q ' 2 blocks used, 0 errors, 0 repaired$'
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Corrupts the first block of a file on a disk with data checksums, then
+# checks that reading the block fails while reading the second one doesn't,
+# and that fs_check.x reports the block
+set -e
+cat > test.script <<'END'
+FORMAT	100	16	data
+MOUNT
+CREATE	file
+OPEN	file
+WRITE	FILL	8192	a
+CLOSE
+UMOUNT
+CHECK	2
+END
+./test_fs.x script test.fs test.script
+
+# The file starts at data block 1, after the superblock, FAT and root directory
+printf 'b' | dd of=test.fs bs=1 seek=$((4 * 4096 + 10)) conv=notrunc \
+	2> /dev/null
+
+cat > test.script <<'END'
+RESET
+MOUNT
+OPEN	file
+READ	4096	ERROR
+STATS	csum_errors	1
+SEEK	4096
+READ	4096	FILL	a
+CLOSE
+UMOUNT
+END
+./test_fs.x script test.fs test.script
+rm test.script
+
+./fs_check.x test.fs | grep -q ' 1 errors, 0 repaired$'
@@ -0,0 +1,8 @@
+#!/bin/sh
+# Formats the largest 16-bit FAT disk, and checks that it has the size of its
+# 65034 blocks but that the data blocks take no space on the host
+set -e
+./test_fs.x format test.fs 65000 > /dev/null
+test $(stat -c %s test.fs) -eq $((65034 * 4096))
+test $(du -k test.fs | cut -f 1) -lt 1024
+./fs_check.x test.fs | grep -q ' 0 blocks used, 0 errors,'
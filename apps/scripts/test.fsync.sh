@@ -0,0 +1,34 @@
+#!/bin/sh
+# Writes two files in a batch and syncs one of them before stopping without
+# unmounting. Only the synced file must be found afterwards, on a clean disk
+set -e
+cat > test.script <<'END'
+FORMAT	100
+MOUNT
+CREATE	a
+CREATE	b
+BATCH	BEGIN
+OPEN	a
+WRITE	FILL	8192	a
+FSYNC
+CLOSE
+OPEN	b
+WRITE	FILL	8192	b
+CLOSE
+CRASH
+END
+./test_fs.x script test.fs test.script
+
+cat > test.script <<'END'
+CHECK	2
+MOUNT
+OPEN	a
+SIZE	8192
+READ	8192	FILL	a
+CLOSE
+OPEN	b
+SIZE	0
+CLOSE
+END
+./test_fs.x script test.fs test.script
+rm test.script
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Imports a host directory of files of many sizes, exports it to another one,
+# and checks that both hold the same files
+set -e
+rm -rf test.in test.out
+mkdir test.in test.out
+for i in $(seq 0 39); do
+	head -c $((i * i * 97)) /dev/urandom > test.in/file$i
+done
+./test_fs.x format test.fs 2000 > /dev/null
+./test_fs.x import test.fs test.in 4 > /dev/null
+./test_fs.x export test.fs test.out 4 > /dev/null
+diff -r test.in test.out
+./fs_check.x test.fs | grep -q ' 40 files, 0 directories, .* 0 errors,'
+rm -r test.in test.out
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Writes a random host file of 260 blocks to a disk in single calls, both
+# shifted in its blocks and aligned on them, with I/O threads, and checks
+# that reading it back in single calls gives the same bytes
+set -e
+head -c $((260 * 4096)) /dev/urandom > test.host
+cat > test.script <<END
+THREADS	4
+FORMAT	1000
+MOUNT
+CREATE	shifted
+OPEN	shifted
+WRITE	DATA	abc
+WRITE	FILE	test.host
+RESET
+SEEK	3
+READ	$((260 * 4096))	FILE	test.host
+STATS	direct_reads	259
+CLOSE
+CREATE	aligned
+OPEN	aligned
+WRITE	FILE	test.host
+STATS	direct_writes	260
+SEEK	0
+READ	$((260 * 4096))	FILE	test.host
+CLOSE
+UMOUNT
+CHECK	521
+END
+./test_fs.x script test.fs test.script
+rm test.host test.script
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Writes a file on a RAM disk and saves it, then loads the image into another
+# RAM disk to append to the file. The disk named on the command line is never
+# created on the host
+set -e
+rm -f test.fs
+cat > test.script <<'END'
+RAM
+FORMAT	100
+MOUNT
+CREATE	file
+OPEN	file
+WRITE	FILL	8192	a
+CLOSE
+UMOUNT
+CHECK	2
+SAVE	test.img
+END
+./test_fs.x script test.fs test.script
+test ! -e test.fs
+
+cat > test.script <<'END'
+RAM	test.img
+MOUNT
+OPEN	file
+READ	8192	FILL	a
+WRITE	FILL	4096	b
+CLOSE
+UMOUNT
+CHECK	3
+SAVE	test.img
+END
+./test_fs.x script test.fs test.script
+test ! -e test.fs
+rm test.script
+
+./fs_check.x test.img | grep -q ' 1 files, 0 directories, 3 blocks used, 0 errors,'
+rm test.img
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Records the defragmentation test script, replays it on a fresh disk, and
+# checks that every call succeeds and leaves the same files
+set -e
+./test_fs.x record test.fs scripts/test.defrag test.rec
+./test_fs.x format test.fs 100 > /dev/null
+./test_fs.x replay test.fs test.rec | grep -qx 'errors=0'
+./fs_check.x test.fs | grep -q ' 2 files, 0 directories, 5 blocks used, 0 errors,'
+rm test.rec
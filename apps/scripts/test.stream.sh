@@ -0,0 +1,9 @@
+#!/bin/sh
+# Adds a host file with chunks that straddle blocks, and checks that reading
+# it back with another chunk size gives the same bytes
+set -e
+./test_fs.x format test.fs 200 > /dev/null
+head -c 300001 /dev/urandom > test.host
+./test_fs.x add test.fs test.host 1000 > /dev/null
+./test_fs.x cat test.fs test.host 777 | tail -n +3 | cmp - test.host
+rm test.host
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Traces the latency test script, and checks that the trace holds each of its
+# writes, with their file descriptor, offset and length
+set -e
+./test_fs.x trace test.fs scripts/test.latency test.csv
+head -n 1 test.csv | grep -qx 'start_ns,op,fd,offset,length,duration_ns'
+grep -q '^[0-9]*,write,0,0,8192,[0-9]*$' test.csv
+grep -q '^[0-9]*,write,0,8192,100,[0-9]*$' test.csv
+rm test.csv
@@ -1,14 +1,21 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,6 +41,250 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Default size of the chunks that cat and add copy at a time */
+#define STREAM_CHUNK_SIZE (256 * 1024)
+
+/* Reads or writes up to @len bytes, returns how many or -1 on error */
+typedef ssize_t (*stream_io)(void *ctx, char *buf, size_t len);
+
+/*
+ * Copy from a source to a sink through two chunks: a thread reads the next
+ * chunk from the source while the calling thread writes the previous one to
+ * the sink, so memory use is bounded whatever the size of the copy
+ */
+struct stream {
+	stream_io read;
+	void *read_ctx;
+	size_t chunk_size;
+
+	char *buf[2];
+	ssize_t len[2];
+	int full[2];
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *stream_reader(void *arg)
+{
+	struct stream *s = arg;
+	int i = 0;
+	ssize_t len;
+
+	do {
+		pthread_mutex_lock(&s->lock);
+		while (s->full[i] && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->stop) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		/* An empty chunk marks the end, a negative length an error */
+		len = s->read(s->read_ctx, s->buf[i], s->chunk_size);
+
+		pthread_mutex_lock(&s->lock);
+		s->len[i] = len;
+		s->full[i] = 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		i = !i;
+	} while (len > 0);
+
+	return NULL;
+}
+
+/* Return the number of bytes copied, or -1 if reading failed */
+ssize_t stream_copy(stream_io read, void *read_ctx, stream_io write,
+		    void *write_ctx, size_t chunk_size)
+{
+	struct stream s = {
+		.read = read,
+		.read_ctx = read_ctx,
+		.chunk_size = chunk_size,
+	};
+	pthread_t reader;
+	ssize_t total = 0, len, written;
+	int i = 0;
+
+	s.buf[0] = malloc(chunk_size);
+	s.buf[1] = malloc(chunk_size);
+	if (!s.buf[0] || !s.buf[1])
+		die("Cannot allocate chunks");
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+	if (pthread_create(&reader, NULL, stream_reader, &s))
+		die("Cannot start reader thread");
+
+	for (;;) {
+		pthread_mutex_lock(&s.lock);
+		while (!s.full[i])
+			pthread_cond_wait(&s.cond, &s.lock);
+		len = s.len[i];
+		pthread_mutex_unlock(&s.lock);
+
+		if (len <= 0) {
+			if (len < 0)
+				total = -1;
+			break;
+		}
+
+		/* A short write (such as a full disk) ends the copy */
+		written = write(write_ctx, s.buf[i], len);
+		if (written > 0)
+			total += written;
+		if (written != len)
+			break;
+
+		pthread_mutex_lock(&s.lock);
+		s.full[i] = 0;
+		pthread_cond_broadcast(&s.cond);
+		pthread_mutex_unlock(&s.lock);
+		i = !i;
+	}
+
+	pthread_mutex_lock(&s.lock);
+	s.stop = 1;
+	pthread_cond_broadcast(&s.cond);
+	pthread_mutex_unlock(&s.lock);
+	pthread_join(reader, NULL);
+
+	pthread_mutex_destroy(&s.lock);
+	pthread_cond_destroy(&s.cond);
+	free(s.buf[0]);
+	free(s.buf[1]);
+
+	return total;
+}
+
+static ssize_t stream_fs_read(void *ctx, char *buf, size_t len)
+{
+	return fs_read(*(int *)ctx, buf, len);
+}
+
+static ssize_t stream_fs_write(void *ctx, char *buf, size_t len)
+{
+	return fs_write(*(int *)ctx, buf, len);
+}
+
+static ssize_t stream_host_read(void *ctx, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	/* Fill the whole chunk so that fs_write() sees full blocks */
+	while (done < len) {
+		ret = read(*(int *)ctx, buf + done, len - done);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static ssize_t stream_host_write(void *ctx, char *buf, size_t len)
+{
+	return fwrite(buf, 1, len, ctx);
+}
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX)
+		die_perror("strtol");
+	return (size_t)ret;
+}
+
+/* Counters of struct fs_stats, under the names that stats prints */
+#define STAT_FIELD(name) { #name, offsetof(struct fs_stats, name) }
+
+static const struct {
+	const char *name;
+	size_t offset;
+} stat_fields[] = {
+	STAT_FIELD(block_reads),
+	STAT_FIELD(block_read_bytes),
+	STAT_FIELD(block_writes),
+	STAT_FIELD(block_write_bytes),
+	STAT_FIELD(direct_reads),
+	STAT_FIELD(bounce_reads),
+	STAT_FIELD(direct_writes),
+	STAT_FIELD(bounce_writes),
+	STAT_FIELD(fat_hops),
+	STAT_FIELD(alloc_scans),
+	STAT_FIELD(alloc_scan_entries),
+	STAT_FIELD(backups),
+	STAT_FIELD(backup_blocks),
+	STAT_FIELD(fat_loads),
+	STAT_FIELD(csum_errors),
+	STAT_FIELD(dedup_blocks),
+};
+
+static uint64_t stat_field(struct fs_stats *stats, size_t i)
+{
+	return *(uint64_t *)((char *)stats + stat_fields[i].offset);
+}
+
+/* Parse the checksums argument of format, none, meta or data */
+int get_checksums(char *argv)
+{
+	if (!strcmp(argv, "meta"))
+		return FS_CSUM_METADATA;
+	if (!strcmp(argv, "data"))
+		return FS_CSUM_DATA;
+	if (strcmp(argv, "none"))
+		die("Invalid checksums '%s'", argv);
+	return 0;
+}
+
+/* Allocate @len bytes of @c, plus a terminating zero byte */
+char *fill_data(size_t len, char *c)
+{
+	char *data = malloc(len + 1);
+
+	if (!data)
+		die_perror("malloc");
+	memset(data, c ? c[0] : 0, len);
+	data[len] = '\0';
+	return data;
+}
+
+/* Asynchronous request of a script, checked once it completes */
+struct script_async {
+	int read;
+	size_t len;
+	char *buf;
+	char *expected;
+};
+
+/* Wait for the asynchronous requests of a script, and check that each read or
+ * wrote all its bytes, and that reads got the expected data */
+static int script_async_wait(int pending)
+{
+	struct fs_async_completion done;
+	struct script_async *req;
+	int failed = 0;
+
+	fs_async_wait();
+	while (pending--) {
+		if (fs_async_reap(&done, 1) != 1)
+			return -1;
+		req = done.arg;
+		if (done.result < 0 || (size_t)done.result != req->len ||
+		    (req->read && memcmp(req->buf, req->expected, req->len)))
+			failed = 1;
+		free(req->buf);
+		free(req->expected);
+		free(req);
+	}
+	return failed ? -1 : 0;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -43,7 +294,8 @@ void thread_fs_script(void *arg)
 	char *command, *data_source, *data_description, *data, *fs_filename;
 	const int total_command_parts = 4;
 	char *command_args[total_command_parts];
-	int offset;
+	size_t offset;
+	int async_pending = 0;
 	char mounted = 0;
 
 	char line_buffer[1024];
@@ -60,6 +312,9 @@ void thread_fs_script(void *arg)
 	if (!fd_script)
 		die_perror("fopen");
 
+	/* Files opened and not closed yet, the commands use the last one */
+	int *fs_fds = NULL;
+	size_t num_fds = 0;
 	int fs_fd = -1;
 
 	/* Loop through the script and execute the specified commands */
@@ -86,7 +341,137 @@ void thread_fs_script(void *arg)
 		if (!command)
 			break;
 
-		if (strcmp(command, "MOUNT") == 0) {
+		if (strcmp(command, "FORMAT") == 0) {
+			struct fs_format_options options = { 0 };
+
+			if (command_args[2])
+				options.fat_bits = get_argv(command_args[2]);
+			if (command_args[2] && command_args[3])
+				options.checksums = get_checksums(command_args[3]);
+
+			if (fs_format(diskname, get_argv(command_args[1]), &options))
+				die("Cannot format disk");
+
+			printf("FORMAT successful.\n");
+
+		} else if (strcmp(command, "RAM") == 0) {
+			if (block_ram_create(diskname, 0, command_args[1]))
+				die("Cannot create RAM disk");
+
+			printf("RAM successful.\n");
+
+		} else if (strcmp(command, "SAVE") == 0) {
+			if (block_ram_save(diskname, command_args[1]))
+				die("Cannot save RAM disk");
+
+			printf("SAVE successful.\n");
+
+		} else if (strcmp(command, "CHECK") == 0) {
+			struct fs_check_report report;
+
+			if (fs_check(diskname, 0, 1, &report))
+				die("Cannot check disk");
+			if (report.errors)
+				die("Found %" PRIu64 " errors", report.errors);
+			if (command_args[1] &&
+			    report.blocks_used != get_argv(command_args[1]))
+				die("%" PRIu64 " blocks used, expected %zu",
+				    report.blocks_used, get_argv(command_args[1]));
+
+			printf("CHECK successful.\n");
+
+		} else if (strcmp(command, "RESET") == 0) {
+			fs_reset_stats();
+
+			printf("RESET successful.\n");
+
+		} else if (strcmp(command, "STATS") == 0) {
+			struct fs_stats stats;
+			size_t i;
+
+			fs_get_stats(&stats);
+			for (i = 0; i < ARRAY_SIZE(stat_fields); i++)
+				if (!strcmp(stat_fields[i].name, command_args[1]))
+					break;
+			if (i == ARRAY_SIZE(stat_fields))
+				die("Invalid counter '%s'", command_args[1]);
+			if (stat_field(&stats, i) != get_argv(command_args[2]))
+				die("%s=%" PRIu64 ", expected %zu", command_args[1],
+				    stat_field(&stats, i), get_argv(command_args[2]));
+
+			printf("STATS successful.\n");
+
+		} else if (strcmp(command, "LATENCY") == 0) {
+			struct fs_latency latency;
+			int op;
+
+			for (op = 0; op < FS_OP_COUNT; op++)
+				if (!strcmp(fs_op_name(op), command_args[1]))
+					break;
+			if (op == FS_OP_COUNT)
+				die("Invalid operation '%s'", command_args[1]);
+			fs_get_latency(op, &latency);
+			if (latency.count != get_argv(command_args[2]))
+				die("%s called %" PRIu64 " times, expected %zu",
+				    command_args[1], latency.count,
+				    get_argv(command_args[2]));
+			if (command_args[3] &&
+			    latency.p50_ns < get_argv(command_args[3]))
+				die("%s took %" PRIu64 " ns, expected %zu at least",
+				    command_args[1], latency.p50_ns,
+				    get_argv(command_args[3]));
+
+			printf("LATENCY successful.\n");
+
+		} else if (strcmp(command, "DEFRAG") == 0) {
+			struct fs_defrag_options options = { 0 };
+			struct fs_defrag_report report;
+			int ret;
+
+			if (command_args[2])
+				options.max_blocks = get_argv(command_args[2]);
+			do {
+				ret = fs_defrag(&options, &report);
+				if (ret < 0) {
+					fs_umount();
+					die("Cannot defragment");
+				}
+			} while (ret == 1);
+			if (report.extents != get_argv(command_args[1])) {
+				fs_umount();
+				die("%" PRIu64 " extents, expected %zu",
+				    report.extents, get_argv(command_args[1]));
+			}
+
+			printf("DEFRAG successful.\n");
+
+		} else if (strcmp(command, "EMULATE") == 0) {
+			struct block_emulation emu = { 0 };
+
+			emu.latency_ns = get_argv(command_args[1]) * 1000;
+			if (command_args[2])
+				emu.bandwidth = get_argv(command_args[2]) * 1048576;
+			block_set_emulation(emu.latency_ns || emu.bandwidth ?
+					    &emu : NULL);
+
+			printf("EMULATE successful.\n");
+
+		} else if (strcmp(command, "DEDUP") == 0) {
+			fs_set_dedup(atoi(command_args[1]));
+
+			printf("DEDUP successful.\n");
+
+		} else if (strcmp(command, "THREADS") == 0) {
+			fs_set_io_threads(atoi(command_args[1]));
+
+			printf("THREADS successful.\n");
+
+		} else if (strcmp(command, "PREFETCH") == 0) {
+			fs_set_fat_prefetch(atoi(command_args[1]));
+
+			printf("PREFETCH successful.\n");
+
+		} else if (strcmp(command, "MOUNT") == 0) {
 			if (fs_mount(diskname))
 				die("Cannot mount disk");
 			else {
@@ -102,6 +487,72 @@ void thread_fs_script(void *arg)
 				mounted = 0;
 			}
 
+		} else if (strcmp(command, "CRASH") == 0) {
+			/* Stop without unmounting, leaving what a batch didn't
+			 * write back unwritten */
+			printf("CRASH successful.\n");
+			fflush(stdout);
+			_exit(0);
+
+		} else if (strcmp(command, "BATCH") == 0) {
+			if (strcmp(command_args[1], "BEGIN") == 0)
+				count = fs_batch_begin();
+			else if (strcmp(command_args[1], "END") == 0)
+				count = fs_batch_end();
+			else
+				die("Invalid batch command '%s'", command_args[1]);
+			if (count) {
+				fs_umount();
+				die("Cannot %s batch", command_args[1]);
+			}
+
+			printf("BATCH successful.\n");
+
+		} else if (strcmp(command, "FSYNC") == 0) {
+			if (fs_fsync(fs_fd)) {
+				fs_umount();
+				die("Cannot sync file");
+			}
+
+			printf("FSYNC successful.\n");
+
+		} else if (strcmp(command, "ASYNC") == 0) {
+			struct script_async *req = calloc(1, sizeof(*req));
+
+			if (!req)
+				die_perror("calloc");
+			req->read = strcmp(command_args[1], "READ") == 0;
+			req->len = get_argv(command_args[2]);
+			req->expected = fill_data(req->len, command_args[3]);
+			if (req->read) {
+				req->buf = malloc(req->len);
+				if (!req->buf)
+					die_perror("malloc");
+				count = fs_read_async(fs_fd, req->buf, req->len,
+						      NULL, req);
+			} else {
+				req->buf = req->expected;
+				req->expected = NULL;
+				count = fs_write_async(fs_fd, req->buf, req->len,
+						       NULL, req);
+			}
+			if (count) {
+				fs_umount();
+				die("Cannot submit request");
+			}
+			async_pending++;
+
+			printf("ASYNC successful.\n");
+
+		} else if (strcmp(command, "WAIT") == 0) {
+			if (script_async_wait(async_pending)) {
+				fs_umount();
+				die("Asynchronous request failed");
+			}
+			async_pending = 0;
+
+			printf("WAIT successful.\n");
+
 		} else if (strcmp(command, "CREATE") == 0) {
 			fs_filename = command_args[1];
 
@@ -112,6 +563,36 @@ void thread_fs_script(void *arg)
 
 			printf("CREATE successful.\n");
 
+		} else if (strcmp(command, "MKDIR") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_mkdir(fs_filename)) {
+				fs_umount();
+				die("Cannot create directory");
+			}
+
+			printf("MKDIR successful.\n");
+
+		} else if (strcmp(command, "CLONE") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_clone(fs_filename, command_args[2])) {
+				fs_umount();
+				die("Cannot clone file");
+			}
+
+			printf("CLONE successful.\n");
+
+		} else if (strcmp(command, "COMPRESS") == 0) {
+			fs_filename = command_args[1];
+
+			if(fs_compress(fs_filename)) {
+				fs_umount();
+				die("Cannot compress file");
+			}
+
+			printf("COMPRESS successful.\n");
+
 		} else if (strcmp(command, "DELETE") == 0) {
 			fs_filename = command_args[1];
 
@@ -132,18 +613,45 @@ void thread_fs_script(void *arg)
 				die("Cannot open file");
 			}
 
+			fs_fds = realloc(fs_fds, (num_fds + 1) * sizeof(int));
+			if (!fs_fds)
+				die_perror("realloc");
+			fs_fds[num_fds++] = fs_fd;
+
 			printf("OPEN successful.\n");
 
+		} else if (strcmp(command, "OPENMAX") == 0) {
+			if (fs_set_open_max(get_argv(command_args[1]))) {
+				fs_umount();
+				die("Cannot set maximum open files");
+			}
+
+			printf("OPENMAX successful.\n");
+
 		} else if (strcmp(command, "CLOSE") == 0) {
 			if (fs_close(fs_fd)) {
 				fs_umount();
 				die("Cannot close file");
 			}
 
+			if (num_fds)
+				num_fds--;
+			fs_fd = num_fds ? fs_fds[num_fds - 1] : -1;
+
 			printf("CLOSE successful.\n");
 
+		} else if (strcmp(command, "SIZE") == 0) {
+			uint64_t size;
+
+			if (fs_stat64(fs_fd, &size) || size != get_argv(command_args[1])) {
+				fs_umount();
+				die("Unexpected file size");
+			}
+
+			printf("SIZE successful.\n");
+
 		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+			offset = get_argv(command_args[1]);
 
 			if (fs_lseek(fs_fd, offset)) {
 				fs_umount();
@@ -152,13 +660,19 @@ void thread_fs_script(void *arg)
 				printf("SEEK successful.\n");
 			}
 
-		} else if (strcmp(command, "WRITE") == 0) {
+		} else if (strcmp(command, "WRITE") == 0 ||
+			   strcmp(command, "APPEND") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
 
+			char *fill = NULL;
+
 			if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
 				data_size = strlen(data);
+			} else if (strcmp(data_source, "FILL") == 0) {
+				data_size = get_argv(data_description);
+				data = fill = fill_data(data_size, command_args[3]);
 			} else if (strcmp(data_source, "FILE") == 0) {
 				data_fd = open(data_description, O_RDONLY);
 				if (data_fd < 0) {
@@ -185,13 +699,30 @@ void thread_fs_script(void *arg)
 				die_perror("Could not find data to write");
 			}
 
-			count = fs_write(fs_fd, data, data_size);
+			if (strcmp(command, "APPEND") == 0)
+				count = fs_append(fs_fd, data, data_size);
+			else
+				count = fs_write(fs_fd, data, data_size);
+			free(fill);
 			if (count < 0) {
 				fs_umount();
 				die("write error");
 			}
 			printf("Wrote %d bytes to file.\n", count);
 
+		} else if (strcmp(command, "READ") == 0 &&
+			   strcmp(command_args[2], "ERROR") == 0) {
+			read_buf = malloc(get_argv(command_args[1]));
+			count = fs_read(fs_fd, read_buf, get_argv(command_args[1]));
+			free(read_buf);
+
+			if (count >= 0) {
+				fs_umount();
+				die("Read %d bytes, expected an error", count);
+			}
+
+			printf("Read failed as expected.\n");
+
 		} else if (strcmp(command, "READ") == 0) {
 			int read_req_length = atoi(command_args[1]);
 			data_source = command_args[2];
@@ -202,6 +733,10 @@ void thread_fs_script(void *arg)
 			if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
 				data_size = strlen(data);
+			} else if (strcmp(data_source, "FILL") == 0) {
+				data_size = read_req_length;
+				data = fill_data(data_size, data_description);
+				file_loaded = 1;
 			} else if (strcmp(data_source, "FILE") == 0) {
 				data_fd = open(data_description, O_RDONLY);
 				if (data_fd < 0) {
@@ -266,6 +801,7 @@ void thread_fs_script(void *arg)
 	if (mounted && fs_umount())
 		die("Cannot unmount diskname");
 
+	free(fs_fds);
 	fclose(fd_script);
 }
 
@@ -274,7 +810,7 @@ void thread_fs_stat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
 	int fs_fd;
-	int stat;
+	uint64_t stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -291,8 +827,7 @@ void thread_fs_stat(void *arg)
 		die("Cannot open file");
 	}
 
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
+	if (fs_stat64(fs_fd, &stat)) {
 		fs_close(fs_fd);
 		fs_umount();
 		die("Cannot stat file");
@@ -313,21 +848,27 @@ void thread_fs_stat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	printf("Size of file '%s' is %" PRIu64 " bytes\n", filename, stat);
 }
 
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
+	size_t chunk_size = STREAM_CHUNK_SIZE;
 	int fs_fd;
-	int stat, read;
+	uint64_t stat;
+	ssize_t read;
 
 	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+		die("need <diskname> <filename> [<chunk size>]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		chunk_size = get_argv(t_arg->argv[2]);
+	if (!chunk_size)
+		die("Invalid chunk size");
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
@@ -338,8 +879,7 @@ void thread_fs_cat(void *arg)
 		die("Cannot open file");
 	}
 
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
+	if (fs_stat64(fs_fd, &stat)) {
 		fs_umount();
 		die("Cannot stat file");
 	}
@@ -348,14 +888,15 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
 
-	read = fs_read(fs_fd, buf, stat);
+	/* The content is streamed out as it is read, so the header can only
+	 * announce the whole file */
+	printf("Read file '%s' (%" PRIu64 "/%" PRIu64 " bytes)\n", filename,
+	       stat, stat);
+	printf("Content of the file:\n");
+	read = stream_copy(stream_fs_read, &fs_fd, stream_host_write, stdout,
+			   chunk_size);
+	fflush(stdout);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -365,12 +906,8 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
+	if (read < 0 || (uint64_t)read != stat)
+		die("Short read (%zd/%" PRIu64 " bytes)", read, stat);
 }
 
 void thread_fs_rm(void *arg)
@@ -398,19 +935,75 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <clone filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
+	size_t chunk_size = STREAM_CHUNK_SIZE;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	ssize_t written;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host filename> [<chunk size>]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		chunk_size = get_argv(t_arg->argv[2]);
+	if (!chunk_size)
+		die("Invalid chunk size");
 
 	/* Open file on host computer */
 	fd = open(filename, O_RDONLY);
@@ -421,14 +1014,9 @@ void thread_fs_add(void *arg)
 	if (!S_ISREG(st.st_mode))
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
 	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
+	 * - mount, create a new file, stream the content of the host file into
+	 *   this new file, close the new file, and umount
 	 */
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
@@ -444,7 +1032,13 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	written = stream_copy(stream_host_read, &fd, stream_fs_write, &fs_fd,
+			      chunk_size);
+	if (written < 0) {
+		fs_close(fs_fd);
+		fs_umount();
+		die_perror("read");
+	}
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -454,27 +1048,566 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	printf("Wrote file '%s' (%zd/%zu bytes)\n", filename, written,
 		   st.st_size);
 
-	munmap(buf, st.st_size);
 	close(fd);
 }
 
+/* Default number of threads that import and export use for host I/O */
+#define BULK_THREADS 4
+
+/* Files are copied in chunks of at most this size */
+#define BULK_CHUNK (1 << 20)
+
+/* A file copied between a host directory and the disk */
+struct bulk_file {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	size_t copied;
+	int fs_fd;
+	int host_fd;
+	/* Export: chunks handed to the pool and not written yet */
+	size_t pending;
+	int issued;
+	int error;
+};
+
+enum { BULK_FREE, BULK_BUSY, BULK_READY };
+
+/* A piece of a file, in one of the buffers of the ring */
+struct bulk_chunk {
+	struct bulk_file *file;
+	char *data;
+	size_t offset;
+	size_t len;
+	int state;
+	int error;
+};
+
+/*
+ * import and export mount the disk once and copy every file of a directory.
+ * The file system is only accessed by the calling thread, while a pool of
+ * threads reads or writes the host files. Files are copied in chunks through
+ * a ring of @window buffers, so that memory use stays bounded whatever the
+ * size of the files.
+ */
+struct bulk {
+	const char *hostdir;
+	struct bulk_file *files;
+	size_t count;
+	struct bulk_chunk *chunks;
+	size_t window;
+	/* Next chunk to fill, and next one to empty */
+	size_t head;
+	size_t tail;
+	/* Import: the file and offset of the next chunk to read */
+	size_t file;
+	size_t offset;
+	/* Export: no more chunks will be filled */
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static int bulk_add(struct bulk *b, const char *name, size_t size)
+{
+	struct bulk_file *files;
+
+	if (strlen(name) >= FS_FILENAME_LEN) {
+		test_fs_error("Skipping '%s', name too long", name);
+		return -1;
+	}
+
+	files = realloc(b->files, (b->count + 1) * sizeof(*files));
+	if (!files)
+		die("Out of memory");
+	b->files = files;
+	memset(files + b->count, 0, sizeof(*files));
+	strcpy(files[b->count].name, name);
+	files[b->count].size = size;
+	files[b->count].fs_fd = -1;
+	files[b->count].host_fd = -1;
+	b->count++;
+
+	return 0;
+}
+
+static void bulk_path(struct bulk *b, struct bulk_file *file, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s", b->hostdir, file->name);
+}
+
+/* Whether @chunk is the last one of its file */
+static int bulk_last(struct bulk_chunk *chunk)
+{
+	return chunk->offset + BULK_CHUNK >= chunk->file->size;
+}
+
+/* Read a chunk of a host file, a short read means the file shrank */
+static void bulk_host_read(struct bulk *b, struct bulk_chunk *chunk)
+{
+	char path[PATH_MAX];
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	if (!chunk->len)
+		return;
+
+	bulk_path(b, chunk->file, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		chunk->error = errno;
+		return;
+	}
+
+	while (done < chunk->len) {
+		ret = pread(fd, chunk->data + done, chunk->len - done,
+			    chunk->offset + done);
+		if (ret < 0) {
+			chunk->error = errno;
+			break;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	chunk->len = done;
+
+	close(fd);
+}
+
+/* Write a chunk to its host file, which the calling thread opened */
+static void bulk_host_write(struct bulk_chunk *chunk)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < chunk->len) {
+		ret = pwrite(chunk->file->host_fd, chunk->data + done,
+			     chunk->len - done, chunk->offset + done);
+		if (ret < 0) {
+			chunk->error = errno;
+			break;
+		}
+		done += ret;
+	}
+}
+
+/* Import: the pool reads chunks of the host files ahead of the caller */
+static void *bulk_import_worker(void *arg)
+{
+	struct bulk *b = arg;
+	struct bulk_chunk *chunk;
+	struct bulk_file *file;
+
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		while (b->file < b->count &&
+		       b->chunks[b->head % b->window].state != BULK_FREE)
+			pthread_cond_wait(&b->cond, &b->lock);
+		if (b->file == b->count)
+			break;
+
+		/* Every file has at least one chunk, even when empty */
+		file = b->files + b->file;
+		chunk = b->chunks + b->head++ % b->window;
+		chunk->state = BULK_BUSY;
+		chunk->file = file;
+		chunk->offset = b->offset;
+		chunk->len = file->size - b->offset;
+		if (chunk->len > BULK_CHUNK)
+			chunk->len = BULK_CHUNK;
+		chunk->error = 0;
+		b->offset += BULK_CHUNK;
+		if (b->offset >= file->size) {
+			b->file++;
+			b->offset = 0;
+		}
+		pthread_mutex_unlock(&b->lock);
+
+		bulk_host_read(b, chunk);
+
+		pthread_mutex_lock(&b->lock);
+		chunk->state = BULK_READY;
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+/* Close the host file once its last chunk is written, with b->lock held */
+static void bulk_file_put(struct bulk_file *file)
+{
+	if (!file->issued || file->pending || file->host_fd < 0)
+		return;
+
+	if (close(file->host_fd) && !file->error)
+		file->error = errno;
+	file->host_fd = -1;
+}
+
+/* Export: the pool writes the chunks the calling thread has read */
+static void *bulk_export_worker(void *arg)
+{
+	struct bulk *b = arg;
+	struct bulk_chunk *chunk;
+
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		while (b->tail == b->head && !b->done)
+			pthread_cond_wait(&b->cond, &b->lock);
+		if (b->tail == b->head)
+			break;
+
+		chunk = b->chunks + b->tail++ % b->window;
+		chunk->state = BULK_BUSY;
+		pthread_mutex_unlock(&b->lock);
+
+		chunk->error = 0;
+		if (!chunk->file->error)
+			bulk_host_write(chunk);
+
+		pthread_mutex_lock(&b->lock);
+		if (chunk->error && !chunk->file->error)
+			chunk->file->error = chunk->error;
+		chunk->file->pending--;
+		bulk_file_put(chunk->file);
+		chunk->state = BULK_FREE;
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+static void bulk_init(struct bulk *b, struct thread_arg *t_arg)
+{
+	memset(b, 0, sizeof(*b));
+	b->hostdir = t_arg->argv[1];
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+}
+
+static pthread_t *bulk_start(struct bulk *b, struct thread_arg *t_arg,
+			     void *(*worker)(void *), size_t *threads)
+{
+	pthread_t *pool;
+	size_t i;
+
+	*threads = BULK_THREADS;
+	if (t_arg->argc > 2)
+		*threads = get_argv(t_arg->argv[2]);
+	if (*threads == 0)
+		die("Invalid number of threads");
+
+	b->window = 2 * *threads;
+	b->chunks = calloc(b->window, sizeof(*b->chunks));
+	if (!b->chunks)
+		die("Out of memory");
+	for (i = 0; i < b->window; i++) {
+		b->chunks[i].data = malloc(BULK_CHUNK);
+		if (!b->chunks[i].data)
+			die("Out of memory");
+	}
+
+	pool = malloc(*threads * sizeof(pthread_t));
+	if (!pool)
+		die("Out of memory");
+	for (i = 0; i < *threads; i++)
+		if (pthread_create(pool + i, NULL, worker, b))
+			die("Cannot start thread");
+
+	return pool;
+}
+
+static void bulk_finish(struct bulk *b, pthread_t *pool, size_t threads)
+{
+	size_t i;
+
+	for (i = 0; i < threads; i++)
+		pthread_join(pool[i], NULL);
+	free(pool);
+
+	for (i = 0; i < b->window; i++)
+		free(b->chunks[i].data);
+	free(b->chunks);
+
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->cond);
+	free(b->files);
+}
+
+/* Write one chunk of an imported file to the disk, returns -1 on failure */
+static int import_chunk(struct bulk_chunk *chunk)
+{
+	struct bulk_file *file = chunk->file;
+	int written;
+
+	if (chunk->error && !file->error) {
+		test_fs_error("Cannot read '%s': %s", file->name,
+			      strerror(chunk->error));
+		file->error = chunk->error;
+	}
+
+	if (chunk->offset == 0 && !file->error) {
+		if (fs_create(file->name)) {
+			test_fs_error("Cannot create file '%s'", file->name);
+			file->error = EEXIST;
+		} else {
+			file->fs_fd = fs_open(file->name);
+			if (file->fs_fd < 0) {
+				test_fs_error("Cannot open file '%s'",
+					      file->name);
+				file->error = ENOENT;
+			}
+		}
+	}
+
+	/* A short write (such as a full disk) skips the rest of the file */
+	if (!file->error && chunk->len) {
+		written = fs_write(file->fs_fd, chunk->data, chunk->len);
+		if (written > 0)
+			file->copied += written;
+		if ((size_t)written != chunk->len)
+			file->error = ENOSPC;
+	}
+
+	if (!bulk_last(chunk))
+		return 0;
+
+	if (file->fs_fd < 0)
+		return -1;
+	if (fs_close(file->fs_fd))
+		test_fs_error("Cannot close file '%s'", file->name);
+	printf("Wrote file '%s' (%zu/%zu bytes)\n", file->name, file->copied,
+	       file->size);
+
+	return file->error ? -1 : 0;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct bulk b;
+	struct bulk_chunk *chunk;
+	struct dirent *entry;
+	struct stat st;
+	char path[PATH_MAX];
+	pthread_t *pool;
+	size_t threads, i;
+	int failed = 0;
+	DIR *dir;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host dirname> [<threads>]");
+
+	bulk_init(&b, t_arg);
+
+	/* Regular files only, subdirectories are not imported */
+	dir = opendir(b.hostdir);
+	if (!dir)
+		die_perror("opendir");
+	while ((entry = readdir(dir))) {
+		snprintf(path, sizeof(path), "%s/%s", b.hostdir, entry->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		if (bulk_add(&b, entry->d_name, st.st_size))
+			failed = 1;
+	}
+	closedir(dir);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	/* The metadata is written back once, after the last file */
+	fs_batch_begin();
+
+	pool = bulk_start(&b, t_arg, bulk_import_worker, &threads);
+	for (i = 0; i < b.count; ) {
+		chunk = b.chunks + b.tail % b.window;
+
+		pthread_mutex_lock(&b.lock);
+		while (chunk->state != BULK_READY)
+			pthread_cond_wait(&b.cond, &b.lock);
+		pthread_mutex_unlock(&b.lock);
+
+		if (import_chunk(chunk))
+			failed = 1;
+		if (bulk_last(chunk))
+			i++;
+
+		pthread_mutex_lock(&b.lock);
+		chunk->state = BULK_FREE;
+		b.tail++;
+		pthread_cond_broadcast(&b.cond);
+		pthread_mutex_unlock(&b.lock);
+	}
+	bulk_finish(&b, pool, threads);
+
+	fs_batch_end();
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (failed)
+		exit(1);
+}
+
+static void export_add(const char *name, int is_dir, void *arg)
+{
+	if (!is_dir)
+		bulk_add(arg, name, 0);
+}
+
+/* Open one file of the disk and its host copy to export it */
+static void export_open(struct bulk *b, struct bulk_file *file)
+{
+	char path[PATH_MAX];
+	uint64_t size;
+
+	file->fs_fd = fs_open(file->name);
+	if (file->fs_fd < 0) {
+		file->error = ENOENT;
+		return;
+	}
+
+	if (fs_stat64(file->fs_fd, &size)) {
+		file->error = EIO;
+		return;
+	}
+	file->size = size;
+
+	bulk_path(b, file, path);
+	file->host_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file->host_fd < 0)
+		file->error = errno;
+}
+
+/* Read the chunks of one file of the disk and hand them to the pool */
+static void export_file(struct bulk *b, struct bulk_file *file)
+{
+	struct bulk_chunk *chunk;
+	size_t offset;
+	int len;
+
+	export_open(b, file);
+
+	for (offset = 0; !file->error && offset < file->size;
+	     offset += BULK_CHUNK) {
+		chunk = b->chunks + b->head % b->window;
+
+		pthread_mutex_lock(&b->lock);
+		while (chunk->state != BULK_FREE)
+			pthread_cond_wait(&b->cond, &b->lock);
+		pthread_mutex_unlock(&b->lock);
+
+		chunk->file = file;
+		chunk->offset = offset;
+		chunk->len = file->size - offset;
+		if (chunk->len > BULK_CHUNK)
+			chunk->len = BULK_CHUNK;
+		len = fs_read(file->fs_fd, chunk->data, chunk->len);
+
+		pthread_mutex_lock(&b->lock);
+		if (len < 0 || (size_t)len != chunk->len) {
+			if (!file->error)
+				file->error = EIO;
+		} else {
+			chunk->state = BULK_READY;
+			file->pending++;
+			b->head++;
+			pthread_cond_broadcast(&b->cond);
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	if (file->fs_fd >= 0)
+		fs_close(file->fs_fd);
+
+	pthread_mutex_lock(&b->lock);
+	file->issued = 1;
+	bulk_file_put(file);
+	pthread_mutex_unlock(&b->lock);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct bulk b;
+	pthread_t *pool;
+	size_t threads, i;
+	int failed = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host dirname> [<threads>]");
+
+	bulk_init(&b, t_arg);
+	if (mkdir(b.hostdir, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	if (fs_readdir("/", export_add, &b)) {
+		fs_umount();
+		die("Cannot list files");
+	}
+
+	pool = bulk_start(&b, t_arg, bulk_export_worker, &threads);
+	for (i = 0; i < b.count; i++)
+		export_file(&b, b.files + i);
+
+	/* Wait for the pool before looking at the errors */
+	pthread_mutex_lock(&b.lock);
+	b.done = 1;
+	pthread_cond_broadcast(&b.cond);
+	for (i = 0; i < b.window; i++)
+		while (b.chunks[i].state != BULK_FREE)
+			pthread_cond_wait(&b.cond, &b.lock);
+	pthread_mutex_unlock(&b.lock);
+
+	for (i = 0; i < b.count; i++) {
+		struct bulk_file *file = b.files + i;
+
+		if (file->error) {
+			test_fs_error("Cannot export '%s': %s", file->name,
+				      strerror(file->error));
+			failed = 1;
+		} else {
+			printf("Exported file '%s' (%zu bytes)\n", file->name,
+			       file->size);
+		}
+	}
+	bulk_finish(&b, pool, threads);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (failed)
+		exit(1);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [<dirname>]");
 
 	diskname = t_arg->argv[0];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (t_arg->argc > 1 && fs_ls_dir(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot list directory");
+	} else if (t_arg->argc == 1) {
+		fs_ls();
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -499,24 +1632,416 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
-size_t get_argv(char *argv)
+static void print_latency(void)
 {
-	long int ret = strtol(argv, NULL, 0);
-	if (ret == LONG_MIN || ret == LONG_MAX)
-		die_perror("strtol");
-	return (size_t)ret;
+	struct fs_latency latency;
+	int op;
+
+	printf("FS Latency:\n");
+	for (op = 0; op < FS_OP_COUNT; op++) {
+		if (fs_get_latency(op, &latency) || !latency.count)
+			continue;
+		printf("%s: count=%" PRIu64 ", total_ns=%" PRIu64 ", p50_ns=%" PRIu64
+		       ", p99_ns=%" PRIu64 ", max_ns=%" PRIu64 "\n", fs_op_name(op),
+		       latency.count, latency.total_ns, latency.p50_ns,
+		       latency.p99_ns, latency.max_ns);
+	}
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_stats stats;
+	size_t i;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<script filename>]");
+
+	/* Count what a script does, or else what mounting the disk costs */
+	fs_reset_stats();
+	if (t_arg->argc > 1) {
+		thread_fs_script(arg);
+	} else {
+		if (fs_mount(t_arg->argv[0]))
+			die("Cannot mount diskname");
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+	fs_get_stats(&stats);
+
+	printf("FS Stats:\n");
+	for (i = 0; i < ARRAY_SIZE(stat_fields); i++)
+		printf("%s=%" PRIu64 "\n", stat_fields[i].name,
+		       stat_field(&stats, i));
+
+	print_latency();
+}
+
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <script filename> <trace filename>");
+
+	if (fs_trace_start(1 << 20))
+		die("Cannot start trace");
+	thread_fs_script(arg);
+	fs_trace_stop();
+
+	if (fs_trace_dump(t_arg->argv[2]))
+		die("Cannot write trace to %s", t_arg->argv[2]);
+}
+
+void thread_fs_record(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <script filename> <recording filename>");
+
+	if (fs_record_start(t_arg->argv[2]))
+		die("Cannot record to %s", t_arg->argv[2]);
+	thread_fs_script(arg);
+	if (fs_record_stop())
+		die("Cannot write recording to %s", t_arg->argv[2]);
+}
+
+/* Descriptor of the replay standing for a recorded one, and its offset */
+struct replay_fd {
+	int fd;
+	size_t offset;
+};
+
+struct replay {
+	struct replay_fd *fds;
+	size_t fds_len;
+	char *buf;
+	size_t buf_len;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t errors;
+};
+
+static struct replay_fd *replay_fd(struct replay *r, int recorded)
+{
+	struct replay_fd *fds;
+	size_t len;
+
+	if (recorded < 0)
+		return NULL;
+
+	if ((size_t)recorded >= r->fds_len) {
+		len = 2 * recorded + 16;
+		fds = realloc(r->fds, len * sizeof(*fds));
+		if (!fds)
+			die("Out of memory");
+		memset(fds + r->fds_len, 0xff,
+		       (len - r->fds_len) * sizeof(*fds));
+		r->fds = fds;
+		r->fds_len = len;
+	}
+
+	return r->fds + recorded;
+}
+
+static char *replay_buf(struct replay *r, size_t len)
+{
+	if (len > r->buf_len) {
+		free(r->buf);
+		r->buf = malloc(len);
+		if (!r->buf)
+			die("Out of memory");
+		/* Data isn't recorded, what is written is made up */
+		memset(r->buf, 0x5a, len);
+		r->buf_len = len;
+	}
+
+	return r->buf;
+}
+
+static void replay_ls(const char *name, int is_dir, void *arg)
+{
+	(void)name;
+	(void)is_dir;
+	(void)arg;
+}
+
+/* Run one recorded call, returns -1 if it failed */
+static int replay_call(struct replay *r, struct fs_record *rec, char *name,
+		       char *name2)
+{
+	struct fs_defrag_options options = {
+		.max_blocks = rec->offset,
+		.max_ns = rec->length,
+	};
+	struct fs_defrag_report report;
+	struct replay_fd *fd = replay_fd(r, rec->fd);
+	uint64_t size;
+	int ret;
+
+	switch (rec->op) {
+	case FS_OP_CREATE:
+		return fs_create(name);
+	case FS_OP_MKDIR:
+		return fs_mkdir(name);
+	case FS_OP_DELETE:
+		return fs_delete(name);
+	case FS_OP_CLONE:
+		return fs_clone(name, name2);
+	case FS_OP_COMPRESS:
+		return fs_compress(name);
+	case FS_OP_LS:
+		/* The same walk as fs_ls_dir(), without the output */
+		return fs_readdir(*name ? name : "/", replay_ls, NULL);
+	case FS_OP_DEFRAG:
+		return fs_defrag(&options, &report) < 0 ? -1 : 0;
+	case FS_OP_BATCH_BEGIN:
+		return fs_batch_begin();
+	case FS_OP_BATCH_END:
+		return fs_batch_end();
+	case FS_OP_OPEN:
+		if (!fd)
+			return fs_open(name) < 0 ? -1 : 0;
+		fd->fd = fs_open(name);
+		fd->offset = 0;
+		return fd->fd < 0 ? -1 : 0;
+	}
+
+	/* The rest work on a descriptor */
+	if (!fd || fd->fd < 0)
+		return -1;
+
+	switch (rec->op) {
+	case FS_OP_CLOSE:
+		ret = fs_close(fd->fd);
+		fd->fd = -1;
+		return ret;
+	case FS_OP_STAT:
+		return fs_stat64(fd->fd, &size);
+	case FS_OP_FSYNC:
+		return fs_fsync(fd->fd);
+	case FS_OP_FDATASYNC:
+		return fs_fdatasync(fd->fd);
+	case FS_OP_LSEEK:
+		fd->offset = rec->offset;
+		return fs_lseek(fd->fd, rec->offset);
+	case FS_OP_READ:
+	case FS_OP_WRITE:
+		/* Stay at the recorded offset even if an earlier call of the
+		 * replay moved by a different amount */
+		if (fd->offset != rec->offset && fs_lseek(fd->fd, rec->offset))
+			return -1;
+		if (rec->op == FS_OP_READ)
+			ret = fs_read(fd->fd, replay_buf(r, rec->length),
+				      rec->length);
+		else
+			ret = fs_write(fd->fd, replay_buf(r, rec->length),
+				       rec->length);
+		if (ret < 0)
+			return -1;
+		fd->offset = rec->offset + ret;
+		if (rec->op == FS_OP_READ)
+			r->bytes_read += ret;
+		else
+			r->bytes_written += ret;
+		return 0;
+	}
+
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct replay r = { 0 };
+	struct fs_record rec;
+	struct timespec ts;
+	char magic[8], *name, *name2;
+	uint64_t start, target, calls = 0;
+	double seconds;
+	int paced = 0, mounted = 0;
+	size_t i;
+	FILE *file;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <recording filename> [paced]");
+	if (t_arg->argc > 2) {
+		if (strcmp(t_arg->argv[2], "paced"))
+			die("Usage: <diskname> <recording filename> [paced]");
+		paced = 1;
+	}
+
+	file = fopen(t_arg->argv[1], "rb");
+	if (!file)
+		die_perror("fopen");
+	if (fread(magic, 1, 8, file) != 8 || memcmp(magic, FS_RECORD_MAGIC, 8))
+		die("Not a recording: %s", t_arg->argv[1]);
+
+	name = malloc(UINT16_MAX + 1);
+	name2 = malloc(UINT16_MAX + 1);
+	if (!name || !name2)
+		die("Out of memory");
+
+	/* Recordings may hold more open files than the default allows */
+	fs_set_open_max(1 << 16);
+
+	fs_reset_stats();
+	start = now_ns();
+	while (fread(&rec, sizeof(rec), 1, file) == 1) {
+		if (fread(name, 1, rec.name_len, file) != rec.name_len ||
+		    fread(name2, 1, rec.name2_len, file) != rec.name2_len)
+			die("Truncated recording");
+		name[rec.name_len] = '\0';
+		name2[rec.name2_len] = '\0';
+
+		if (paced) {
+			target = start + rec.start_ns;
+			ts.tv_sec = target / 1000000000;
+			ts.tv_nsec = target % 1000000000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR)
+				;
+		}
+		calls++;
+
+		/* The replay has its own fresh disk, whatever was recorded */
+		if (rec.op == FS_OP_FORMAT || rec.op == FS_OP_INFO)
+			continue;
+		if (rec.op == FS_OP_UMOUNT) {
+			if (!mounted || fs_umount())
+				r.errors++;
+			else
+				mounted = 0;
+			continue;
+		}
+		if (!mounted) {
+			if (fs_mount(t_arg->argv[0]))
+				die("Cannot mount diskname");
+			mounted = 1;
+		}
+		if (rec.op == FS_OP_MOUNT)
+			continue;
+
+		if (replay_call(&r, &rec, name, name2))
+			r.errors++;
+	}
+	seconds = (now_ns() - start) / 1e9;
+
+	if (mounted) {
+		for (i = 0; i < r.fds_len; i++)
+			if (r.fds[i].fd >= 0)
+				fs_close(r.fds[i].fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+	fclose(file);
+
+	printf("FS Replay:\n");
+	printf("calls=%" PRIu64 "\n", calls);
+	printf("errors=%" PRIu64 "\n", r.errors);
+	printf("seconds=%.6f\n", seconds);
+	printf("calls_per_s=%.1f\n", seconds > 0 ? calls / seconds : 0);
+	printf("read_mb_per_s=%.2f\n",
+	       seconds > 0 ? r.bytes_read / seconds / (1024 * 1024) : 0);
+	printf("write_mb_per_s=%.2f\n",
+	       seconds > 0 ? r.bytes_written / seconds / (1024 * 1024) : 0);
+	print_latency();
+
+	free(name);
+	free(name2);
+	free(r.fds);
+	free(r.buf);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_defrag_options options = { 0 };
+	struct fs_defrag_report report;
+	char *diskname;
+	int pass = 0, ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<blocks per pass>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		options.max_blocks = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* With a budget, defragment in as many passes as it takes */
+	do {
+		ret = fs_defrag(&options, &report);
+		if (ret < 0) {
+			fs_umount();
+			die("Cannot defragment diskname");
+		}
+		printf("pass %d: files=%" PRIu64 ", fragmented=%" PRIu64
+		       ", extents=%" PRIu64 ", blocks_moved=%" PRIu64 "\n",
+		       ++pass, report.files, report.fragmented, report.extents,
+		       report.blocks_moved);
+	} while (ret == 1);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_format_options options = { 0 };
+	char *diskname;
+	size_t data_blocks;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [<FAT bits>] "
+		    "[none|meta|data]");
+
+	diskname = t_arg->argv[0];
+	data_blocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		options.fat_bits = get_argv(t_arg->argv[2]);
+	if (t_arg->argc > 3)
+		options.checksums = get_checksums(t_arg->argv[3]);
+
+	if (fs_format(diskname, data_blocks, &options))
+		die("Cannot format diskname");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+		   data_blocks);
 }
 
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
+	{ "format",	thread_fs_format },
 	{ "info",	thread_fs_info },
+	{ "defrag",	thread_fs_defrag },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "rm",		thread_fs_rm },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "clone",	thread_fs_clone },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "stats",	thread_fs_stats },
+	{ "trace",	thread_fs_trace },
+	{ "record",	thread_fs_record },
+	{ "replay",	thread_fs_replay },
 	{ "script",	thread_fs_script }
 };
 
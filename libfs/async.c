@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "async.h"
+#include "fs.h"
+
+#define async_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+enum async_op {
+	ASYNC_READ,
+	ASYNC_WRITE,
+};
+
+/* One submitted call, and once done, its completion if it has no callback */
+struct async_req {
+	enum async_op op;
+	int fd;
+	void *buf;
+	size_t count;
+	fs_async_cb cb;
+	void *arg;
+	int result;
+	struct async_req *next;
+};
+
+/* Requests waiting for the I/O thread, oldest first */
+static struct async_req *queue_head, *queue_tail;
+/* Completions without a callback, waiting for fs_async_reap() */
+static struct async_req *done_head, *done_tail;
+/* Requests submitted and not yet completed */
+static size_t pending;
+/* Request whose call the I/O thread is making, NULL between calls */
+static struct async_req *running;
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_idle = PTHREAD_COND_INITIALIZER;
+static pthread_t async_thread;
+static bool async_running;
+static int async_efd = -1;
+
+static void async_run(struct async_req *req)
+{
+	if (req->op == ASYNC_READ)
+		req->result = fs_read(req->fd, req->buf, req->count);
+	else
+		req->result = fs_write(req->fd, req->buf, req->count);
+}
+
+/*
+ * A single thread runs the requests, in the order they were submitted, which
+ * keeps the requests on each file in order. Each call takes the lock of the
+ * file system like calls from any other thread, and callbacks run without it.
+ * Since that lock lets only one call in at a time, more threads would only
+ * queue on it, and the large reads and writes already spread their blocks over
+ * the I/O pool of fs.c.
+ */
+static void *async_worker(void *arg)
+{
+	struct async_req *req;
+	uint64_t one = 1;
+	bool queued;
+
+	(void)arg;
+
+	pthread_mutex_lock(&async_lock);
+	for (;;) {
+		while (!queue_head)
+			pthread_cond_wait(&async_work, &async_lock);
+
+		req = queue_head;
+		queue_head = req->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		running = req;
+		pthread_mutex_unlock(&async_lock);
+
+		async_run(req);
+
+		/* The call is over, the callback may close the descriptor */
+		pthread_mutex_lock(&async_lock);
+		running = NULL;
+		pthread_mutex_unlock(&async_lock);
+
+		queued = !req->cb;
+		if (!queued) {
+			req->cb(req->result, req->arg);
+			free(req);
+		}
+
+		pthread_mutex_lock(&async_lock);
+		if (queued) {
+			req->next = NULL;
+			if (done_tail)
+				done_tail->next = req;
+			else
+				done_head = req;
+			done_tail = req;
+			if (async_efd >= 0 &&
+			    write(async_efd, &one, sizeof(one)) != sizeof(one))
+				async_error("cannot signal eventfd");
+		}
+		if (--pending == 0)
+			pthread_cond_broadcast(&async_idle);
+	}
+
+	return NULL;
+}
+
+static int async_submit(enum async_op op, int fd, void *buf, size_t count,
+			fs_async_cb cb, void *arg)
+{
+	struct async_req *req = malloc(sizeof(*req));
+
+	if (!req)
+		return -1;
+
+	req->op = op;
+	req->fd = fd;
+	req->buf = buf;
+	req->count = count;
+	req->cb = cb;
+	req->arg = arg;
+	req->result = -1;
+	req->next = NULL;
+
+	pthread_mutex_lock(&async_lock);
+	if (!async_running) {
+		if (pthread_create(&async_thread, NULL, async_worker, NULL)) {
+			pthread_mutex_unlock(&async_lock);
+			free(req);
+			return -1;
+		}
+		pthread_detach(async_thread);
+		async_running = true;
+	}
+
+	if (queue_tail)
+		queue_tail->next = req;
+	else
+		queue_head = req;
+	queue_tail = req;
+	pending++;
+	pthread_cond_signal(&async_work);
+	pthread_mutex_unlock(&async_lock);
+
+	return 0;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, fs_async_cb cb, void *arg)
+{
+	return async_submit(ASYNC_READ, fd, buf, count, cb, arg);
+}
+
+int fs_write_async(int fd, void *buf, size_t count, fs_async_cb cb, void *arg)
+{
+	return async_submit(ASYNC_WRITE, fd, buf, count, cb, arg);
+}
+
+int fs_async_eventfd(void)
+{
+	pthread_mutex_lock(&async_lock);
+	if (async_efd < 0) {
+		async_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (async_efd < 0)
+			perror("eventfd");
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return async_efd;
+}
+
+int fs_async_reap(struct fs_async_completion *completions, int max)
+{
+	struct async_req *req;
+	int n = 0;
+
+	if (!completions || max < 0)
+		return -1;
+
+	pthread_mutex_lock(&async_lock);
+	while (n < max && done_head) {
+		req = done_head;
+		done_head = req->next;
+		if (!done_head)
+			done_tail = NULL;
+
+		completions[n].result = req->result;
+		completions[n].arg = req->arg;
+		n++;
+		free(req);
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return n;
+}
+
+size_t async_pending(void)
+{
+	size_t n;
+
+	pthread_mutex_lock(&async_lock);
+	n = pending;
+	pthread_mutex_unlock(&async_lock);
+
+	return n;
+}
+
+size_t async_pending_fd(int fd)
+{
+	struct async_req *req;
+	size_t n = 0;
+
+	pthread_mutex_lock(&async_lock);
+	if (running && running->fd == fd)
+		n++;
+	for (req = queue_head; req; req = req->next)
+		if (req->fd == fd)
+			n++;
+	pthread_mutex_unlock(&async_lock);
+
+	return n;
+}
+
+void fs_async_wait(void)
+{
+	pthread_mutex_lock(&async_lock);
+	while (pending)
+		pthread_cond_wait(&async_idle, &async_lock);
+	pthread_mutex_unlock(&async_lock);
+}
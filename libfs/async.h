@@ -0,0 +1,24 @@
+#ifndef _ASYNC_H
+#define _ASYNC_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * async_pending - Count the pending asynchronous requests
+ *
+ * Return: the number of requests submitted with fs_read_async() or
+ * fs_write_async() whose callback has not returned yet.
+ */
+size_t async_pending(void);
+
+/**
+ * async_pending_fd - Count the pending calls on a file descriptor
+ * @fd: File descriptor
+ *
+ * Return: the number of requests on @fd that are queued or whose call to
+ * fs_read() or fs_write() is being made. Requests whose call has returned are
+ * not counted, even if their callback is still running.
+ */
+size_t async_pending_fd(int fd);
+
+#endif /* _ASYNC_H */
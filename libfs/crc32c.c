@@ -0,0 +1,207 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#include "crc32c.h"
+
+/* Castagnoli polynomial, bit-reversed */
+#define CRC32C_POLY 0x82F63B78
+
+/* Hardware CRCs have a latency of 3 cycles but a throughput of 1 per cycle,
+ * so large buffers are split into 3 streams computed side by side and then
+ * combined. Smaller buffers aren't worth the combining */
+#define CRC32C_STREAMS 3
+#define CRC32C_STREAM_MIN 256
+
+static uint32_t crc32c_table[8][256];
+/* x2n_table[k] is x^(2^k) modulo the polynomial */
+static uint32_t x2n_table[32];
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *buf, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Multiplication modulo the polynomial, bit-reversed like the CRCs */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+/* x^(8 * len) modulo the polynomial, to shift a CRC past len bytes */
+static uint32_t x8nmodp(size_t len)
+{
+	uint32_t p = (uint32_t)1 << 31;
+	unsigned int k = 3;
+
+	while (len) {
+		if (len & 1)
+			p = multmodp(x2n_table[k & 31], p);
+		len >>= 1;
+		k++;
+	}
+
+	return p;
+}
+
+/* CRC of A followed by B, from the CRC of A, the CRC of B and its shift */
+static inline uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b,
+				      uint32_t shift_b)
+{
+	return multmodp(shift_b, crc_a) ^ crc_b;
+}
+
+/* Slicing-by-8 over the tables, 8 bytes per step */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	crc = ~crc;
+
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy(&word, buf, 8);
+		word ^= crc;
+		crc = crc32c_table[7][word & 0xFF] ^
+		      crc32c_table[6][(word >> 8) & 0xFF] ^
+		      crc32c_table[5][(word >> 16) & 0xFF] ^
+		      crc32c_table[4][(word >> 24) & 0xFF] ^
+		      crc32c_table[3][(word >> 32) & 0xFF] ^
+		      crc32c_table[2][(word >> 40) & 0xFF] ^
+		      crc32c_table[1][(word >> 48) & 0xFF] ^
+		      crc32c_table[0][word >> 56];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xFF];
+
+	return ~crc;
+}
+
+/*
+ * Body of the hardware implementations, given the instructions that add 8
+ * bytes and 1 byte to a CRC. The shift of the last stream length is cached
+ * per thread since buffers are nearly always blocks of the same size
+ */
+#define CRC32C_HW_BODY(crc_u64, crc_u8)					\
+	static __thread size_t shift_len;				\
+	static __thread uint32_t shift;					\
+	uint64_t c0 = (uint32_t)~crc;					\
+	size_t stream = len / (CRC32C_STREAMS * 8) * 8;			\
+									\
+	if (stream >= CRC32C_STREAM_MIN) {				\
+		const uint8_t *end = buf + stream;			\
+		uint64_t c1 = 0xFFFFFFFF, c2 = 0xFFFFFFFF;		\
+		uint64_t w0, w1, w2;					\
+									\
+		for (; buf < end; buf += 8) {				\
+			memcpy(&w0, buf, 8);				\
+			memcpy(&w1, buf + stream, 8);			\
+			memcpy(&w2, buf + 2 * stream, 8);		\
+			c0 = crc_u64(c0, w0);				\
+			c1 = crc_u64(c1, w1);				\
+			c2 = crc_u64(c2, w2);				\
+		}							\
+		if (shift_len != stream) {				\
+			shift = x8nmodp(stream);			\
+			shift_len = stream;				\
+		}							\
+		crc = crc32c_combine(~(uint32_t)c0, ~(uint32_t)c1, shift); \
+		crc = crc32c_combine(crc, ~(uint32_t)c2, shift);	\
+		c0 = (uint32_t)~crc;					\
+		buf += 2 * stream;					\
+		len -= CRC32C_STREAMS * stream;				\
+	}								\
+									\
+	for (; len >= 8; buf += 8, len -= 8) {				\
+		uint64_t word;						\
+		memcpy(&word, buf, 8);					\
+		c0 = crc_u64(c0, word);					\
+	}								\
+	while (len--)							\
+		c0 = crc_u8(c0, *buf++);				\
+									\
+	return ~(uint32_t)c0;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+#define crc_u64(c, w) _mm_crc32_u64((c), (w))
+#define crc_u8(c, b) _mm_crc32_u8((uint32_t)(c), (b))
+	CRC32C_HW_BODY(crc_u64, crc_u8)
+#undef crc_u64
+#undef crc_u8
+}
+
+static bool crc32c_hw_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+#define crc_u64(c, w) __crc32cd((uint32_t)(c), (w))
+#define crc_u8(c, b) __crc32cb((uint32_t)(c), (b))
+	CRC32C_HW_BODY(crc_u64, crc_u8)
+#undef crc_u64
+#undef crc_u8
+}
+
+static bool crc32c_hw_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+
+	x2n_table[0] = (uint32_t)1 << 30;
+	for (i = 1; i < 32; i++)
+		x2n_table[i] = multmodp(x2n_table[i - 1], x2n_table[i - 1]);
+
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__) || defined(__aarch64__)
+	if (crc32c_hw_supported())
+		crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl(crc, buf, len);
+}
@@ -0,0 +1,20 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the data preceding @buf, 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Number of bytes in @buf
+ *
+ * Use the CRC32 instructions of SSE4.2 or ARMv8 when the CPU has them, and
+ * tables otherwise.
+ *
+ * Return: The checksum of the data preceding @buf followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
@@ -1,11 +1,17 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -15,17 +21,466 @@
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Backend, NULL when no disk is open */
+	const struct block_ops *ops;
+	/* Backend's own state */
+	void *dev;
 	/* Block count */
 	size_t bcount;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk;
+
+/* RAM disk, found by name before the host file of that name */
+struct ram_disk {
+	char *name;
+	/* Anonymous mapping of the blocks, NULL if there are none */
+	char *blocks;
+	size_t bcount;
+	/* Whether it is the currently open disk */
+	int open;
+	struct ram_disk *next;
+};
+
+static struct ram_disk *ram_disks;
+
+/* Emulated timings, and the emulated device's state */
+static struct block_emulation emu;
+static int emu_enabled;
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Time at which the device is done with the I/Os so far */
+static uint64_t emu_busy_until;
+/* Block following the last one read or written */
+static size_t emu_next_block;
+
+static int file_read(void *dev, size_t block, void *buf)
+{
+	int fd = (intptr_t)dev;
+
+	/* Perform the actual read from the disk image, at the specified block
+	 * number */
+	if (pread(fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_write(void *dev, size_t block, const void *buf)
+{
+	int fd = (intptr_t)dev;
+
+	/* Perform the actual write into the disk image, at the specified block
+	 * number. Positioned writes let several threads share the disk */
+	if (pwrite(fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_sync(void *dev)
+{
+	if (fdatasync((intptr_t)dev)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_close(void *dev)
+{
+	return close((intptr_t)dev);
+}
+
+static const struct block_ops file_ops = {
+	.read = file_read,
+	.write = file_write,
+	.sync = file_sync,
+	.close = file_close,
+};
+
+static int ram_read(void *dev, size_t block, void *buf)
+{
+	struct ram_disk *ram = dev;
+
+	memcpy(buf, ram->blocks + block * BLOCK_SIZE, BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_write(void *dev, size_t block, const void *buf)
+{
+	struct ram_disk *ram = dev;
+
+	memcpy(ram->blocks + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_close(void *dev)
+{
+	struct ram_disk *ram = dev;
+
+	/* The blocks stay around for the next time the disk is opened */
+	ram->open = 0;
+	return 0;
+}
+
+static const struct block_ops ram_ops = {
+	.read = ram_read,
+	.write = ram_write,
+	.close = ram_close,
+};
+
+static struct ram_disk *ram_find(const char *diskname)
+{
+	struct ram_disk *ram;
+
+	for (ram = ram_disks; ram; ram = ram->next)
+		if (!strcmp(ram->name, diskname))
+			return ram;
+
+	return NULL;
+}
+
+/* Replace the blocks of @ram by @bcount zeroed blocks */
+static int ram_resize(struct ram_disk *ram, size_t bcount, int preallocate)
+{
+	char *blocks = NULL;
+
+	/* Pages of an anonymous mapping are zero and take no memory until they
+	 * are first written, like the holes of a sparse file */
+	if (bcount) {
+		blocks = mmap(NULL, bcount * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS |
+			      (preallocate ? MAP_POPULATE : 0), -1, 0);
+		if (blocks == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+	}
+
+	if (ram->blocks)
+		munmap(ram->blocks, ram->bcount * BLOCK_SIZE);
+	ram->blocks = blocks;
+	ram->bcount = bcount;
+
+	return 0;
+}
+
+static int block_is_zero(const char *block)
+{
+	size_t i;
+
+	for (i = 0; i < BLOCK_SIZE; i++)
+		if (block[i])
+			return 0;
+
+	return 1;
+}
+
+/* Copy the image open as @fd into @ram, leaving its zero blocks untouched */
+static int ram_load(struct ram_disk *ram, int fd)
+{
+	char block[BLOCK_SIZE];
+	size_t i;
+
+	for (i = 0; i < ram->bcount; i++) {
+		if (pread(fd, block, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE) {
+			perror("pread");
+			return -1;
+		}
+		if (!block_is_zero(block))
+			memcpy(ram->blocks + i * BLOCK_SIZE, block, BLOCK_SIZE);
+	}
+
+	return 0;
+}
+
+int block_ram_create(const char *diskname, size_t bcount, const char *image)
+{
+	struct ram_disk *ram;
+	struct stat st;
+	int fd = INVALID_FD;
+
+	if (!diskname) {
+		block_error("invalid diskname");
+		return -1;
+	}
+
+	if (ram_find(diskname)) {
+		block_error("RAM disk '%s' already exists", diskname);
+		return -1;
+	}
+
+	if (image) {
+		if ((fd = open(image, O_RDONLY)) < 0) {
+			perror("open");
+			return -1;
+		}
+		if (fstat(fd, &st)) {
+			perror("fstat");
+			close(fd);
+			return -1;
+		}
+		if (st.st_size % BLOCK_SIZE != 0 ||
+		    (bcount && (size_t)st.st_size / BLOCK_SIZE > bcount)) {
+			block_error("image size '%zu' doesn't fit the disk",
+				    st.st_size);
+			close(fd);
+			return -1;
+		}
+		if (!bcount)
+			bcount = st.st_size / BLOCK_SIZE;
+	}
+
+	ram = calloc(1, sizeof(*ram));
+	if (!ram || !(ram->name = strdup(diskname))) {
+		block_error("out of memory");
+		free(ram);
+		if (fd != INVALID_FD)
+			close(fd);
+		return -1;
+	}
+
+	if (ram_resize(ram, bcount, 0) ||
+	    (fd != INVALID_FD && ram_load(ram, fd))) {
+		ram_resize(ram, 0, 0);
+		free(ram->name);
+		free(ram);
+		if (fd != INVALID_FD)
+			close(fd);
+		return -1;
+	}
+	if (fd != INVALID_FD)
+		close(fd);
+
+	ram->next = ram_disks;
+	ram_disks = ram;
+
+	return 0;
+}
+
+int block_ram_save(const char *diskname, const char *image)
+{
+	struct ram_disk *ram;
+	size_t i;
+	int fd;
+
+	if (!diskname || !image || !(ram = ram_find(diskname))) {
+		block_error("no RAM disk '%s'", diskname ? diskname : "");
+		return -1;
+	}
+
+	if ((fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Zero blocks are left as holes, as block_disk_create() would */
+	if (ftruncate(fd, (off_t)ram->bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < ram->bcount; i++) {
+		if (block_is_zero(ram->blocks + i * BLOCK_SIZE))
+			continue;
+		if (pwrite(fd, ram->blocks + i * BLOCK_SIZE, BLOCK_SIZE,
+			   i * BLOCK_SIZE) != BLOCK_SIZE) {
+			perror("pwrite");
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (close(fd)) {
+		perror("close");
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_ram_destroy(const char *diskname)
+{
+	struct ram_disk **link, *ram;
+
+	if (!diskname)
+		return -1;
+
+	for (link = &ram_disks; *link; link = &(*link)->next)
+		if (!strcmp((*link)->name, diskname))
+			break;
+
+	ram = *link;
+	if (!ram) {
+		block_error("no RAM disk '%s'", diskname);
+		return -1;
+	}
+	if (ram->open) {
+		block_error("RAM disk '%s' is open", diskname);
+		return -1;
+	}
+
+	*link = ram->next;
+	ram_resize(ram, 0, 0);
+	free(ram->name);
+	free(ram);
+
+	return 0;
+}
+
+static uint64_t emu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void emu_sleep_until(uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / 1000000000,
+		.tv_nsec = deadline % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+/*
+ * Waits for an I/O of block @block to be done on the emulated device: queued
+ * behind the I/Os before it, it seeks and transfers, then takes the latency
+ * that is not spent on the device.
+ */
+static void emu_io(size_t block)
+{
+	uint64_t now, done, latency, seek = 0;
+	size_t distance;
+
+	if (!__atomic_load_n(&emu_enabled, __ATOMIC_RELAXED))
+		return;
+
+	now = emu_now();
+	pthread_mutex_lock(&emu_lock);
+	if (block != emu_next_block) {
+		distance = block > emu_next_block ? block - emu_next_block :
+			emu_next_block - block;
+		seek = emu.seek_ns * distance;
+		if (emu.seek_max_ns && seek > emu.seek_max_ns)
+			seek = emu.seek_max_ns;
+	}
+	done = emu_busy_until > now ? emu_busy_until : now;
+	done += seek;
+	if (emu.bandwidth)
+		done += (uint64_t)BLOCK_SIZE * 1000000000 / emu.bandwidth;
+	emu_busy_until = done;
+	emu_next_block = block + 1;
+	latency = emu.latency_ns;
+	pthread_mutex_unlock(&emu_lock);
+
+	emu_sleep_until(done + latency);
+}
+
+/* Waits for the I/Os so far to be done, and for the flush */
+static void emu_sync(void)
+{
+	uint64_t now, done;
+
+	if (!__atomic_load_n(&emu_enabled, __ATOMIC_RELAXED))
+		return;
+
+	now = emu_now();
+	pthread_mutex_lock(&emu_lock);
+	done = (emu_busy_until > now ? emu_busy_until : now) + emu.sync_ns;
+	pthread_mutex_unlock(&emu_lock);
+
+	emu_sleep_until(done);
+}
+
+void block_set_emulation(const struct block_emulation *timings)
+{
+	pthread_mutex_lock(&emu_lock);
+	if (timings)
+		emu = *timings;
+	emu_busy_until = 0;
+	emu_next_block = 0;
+	__atomic_store_n(&emu_enabled, timings != NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&emu_lock);
+}
+
+int block_disk_attach(const struct block_ops *ops, void *dev, size_t bcount)
+{
+	if (!ops || !ops->read || !ops->write) {
+		block_error("invalid backend");
+		return -1;
+	}
+
+	if (disk.ops) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	disk.ops = ops;
+	disk.dev = dev;
+	disk.bcount = bcount;
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t bcount, int preallocate)
+{
+	struct ram_disk *ram;
+	int fd, err;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	ram = ram_find(diskname);
+	if (ram) {
+		if (ram->open) {
+			block_error("RAM disk '%s' is open", diskname);
+			return -1;
+		}
+		return ram_resize(ram, bcount, preallocate);
+	}
+
+	if ((fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Blocks that were never written read as zeros */
+	if (ftruncate(fd, (off_t)bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	if (preallocate && bcount) {
+		err = posix_fallocate(fd, 0, (off_t)bcount * BLOCK_SIZE);
+		if (err) {
+			block_error("posix_fallocate: %s", strerror(err));
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+
+	return 0;
+}
 
 int block_disk_open(const char *diskname)
 {
+	struct ram_disk *ram;
 	int fd;
 	struct stat st;
 
@@ -34,11 +489,19 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk.ops) {
 		block_error("disk already open");
 		return -1;
 	}
 
+	ram = ram_find(diskname);
+	if (ram) {
+		if (block_disk_attach(&ram_ops, ram, ram->bcount))
+			return -1;
+		ram->open = 1;
+		return 0;
+	}
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
 		return -1;
@@ -46,6 +509,7 @@ int block_disk_open(const char *diskname)
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
@@ -53,32 +517,33 @@ int block_disk_open(const char *diskname)
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
-
-	return 0;
+	return block_disk_attach(&file_ops, (void *)(intptr_t)fd,
+				 st.st_size / BLOCK_SIZE);
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk.ops->close)
+		disk.ops->close(disk.dev);
 
-	disk.fd = INVALID_FD;
+	disk.ops = NULL;
+	disk.dev = NULL;
 
 	return 0;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -86,9 +551,22 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+int block_disk_sync(void)
+{
+	if (!disk.ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	emu_sync();
+	return disk.ops->sync ? disk.ops->sync(disk.dev) : 0;
+}
+
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	STAT_TIMED(FS_OP_BLOCK_WRITE, -1, (uint64_t)block * BLOCK_SIZE, BLOCK_SIZE);
+
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -99,24 +577,21 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	emu_io(block);
+	if (disk.ops->write(disk.dev, block, buf))
 		return -1;
-	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
-	}
+	stat_add(STAT_BLOCK_WRITES, 1);
+	stat_add(STAT_BLOCK_WRITE_BYTES, BLOCK_SIZE);
 
 	return 0;
 }
 
 int block_read(size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	STAT_TIMED(FS_OP_BLOCK_READ, -1, (uint64_t)block * BLOCK_SIZE, BLOCK_SIZE);
+
+	if (!disk.ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -127,17 +602,12 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	emu_io(block);
+	if (disk.ops->read(disk.dev, block, buf))
 		return -1;
-	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
-		return -1;
-	}
+	stat_add(STAT_BLOCK_READS, 1);
+	stat_add(STAT_BLOCK_READ_BYTES, BLOCK_SIZE);
 
 	return 0;
 }
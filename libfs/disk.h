@@ -2,10 +2,135 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/**
+ * struct block_ops - Block device backend
+ * @read: Read block @block of device @dev into @buf
+ * @write: Write @buf into block @block of device @dev
+ * @sync: Make the blocks written to device @dev durable, may be NULL if
+ *        they always are
+ * @close: Release device @dev when the disk is closed, may be NULL
+ *
+ * The block_*() functions below check the disk is open and the block index is
+ * in bounds, and account for the I/O, before calling into the backend. @read
+ * and @write return -1 on failure and 0 otherwise. They may be called from
+ * several threads at once.
+ */
+struct block_ops {
+	int (*read)(void *dev, size_t block, void *buf);
+	int (*write)(void *dev, size_t block, const void *buf);
+	int (*sync)(void *dev);
+	int (*close)(void *dev);
+};
+
+/**
+ * block_disk_attach - Open a disk on a backend
+ * @ops: Backend functions
+ * @dev: Backend's device, passed to each of @ops
+ * @bcount: Number of blocks of the device
+ *
+ * Make @dev the open disk, as block_disk_open() does for virtual disk files.
+ * block_disk_close() detaches it and calls @ops->close.
+ *
+ * Return: -1 if @ops is invalid or if a disk is already open. 0 otherwise.
+ */
+int block_disk_attach(const struct block_ops *ops, void *dev, size_t bcount);
+
+/**
+ * block_ram_create - Create RAM disk
+ * @diskname: Name of the RAM disk
+ * @bcount: Number of blocks of the RAM disk, or 0 to size it after @image
+ * @image: Virtual disk file to load the RAM disk from, may be NULL
+ *
+ * Create a RAM disk named @diskname, holding @bcount blocks of anonymous
+ * memory filled with zeros or with the content of @image. Until it is
+ * destroyed, @diskname refers to the RAM disk rather than to a virtual disk
+ * file of the same name: block_disk_create() resizes and zeroes it and
+ * block_disk_open() opens it. Its blocks survive block_disk_close(), but not
+ * the process unless saved with block_ram_save().
+ *
+ * Return: -1 if @diskname is invalid or already a RAM disk, if @image cannot
+ * be read or is larger than @bcount blocks, or if memory cannot be allocated.
+ * 0 otherwise.
+ */
+int block_ram_create(const char *diskname, size_t bcount, const char *image);
+
+/**
+ * block_ram_save - Save RAM disk to a virtual disk file
+ * @diskname: Name of the RAM disk
+ * @image: Virtual disk file to write
+ *
+ * Write the blocks of RAM disk @diskname to @image, replacing any existing
+ * file. Zero blocks are left as holes of a sparse file.
+ *
+ * Return: -1 if @diskname is not a RAM disk or if @image cannot be written. 0
+ * otherwise.
+ */
+int block_ram_save(const char *diskname, const char *image);
+
+/**
+ * block_ram_destroy - Destroy RAM disk
+ * @diskname: Name of the RAM disk
+ *
+ * Return: -1 if @diskname is not a RAM disk or if it is currently open. 0
+ * otherwise.
+ */
+int block_ram_destroy(const char *diskname);
+
+/**
+ * struct block_emulation - Emulated storage timings
+ * @latency_ns: Time taken by each block read or write
+ * @seek_ns: Time taken per block between the previous block read or written
+ *           and the next one, unless it directly follows
+ * @seek_max_ns: Cap on the seek time, 0 for none
+ * @bandwidth: Bytes transferred per second, 0 for no limit
+ * @sync_ns: Time taken by block_disk_sync(), once the I/Os before it are done
+ *
+ * Seeks and transfers are counted on a single timeline, one I/O after the
+ * other, as they would be on one device. The latency of I/Os made by several
+ * threads at once overlaps, as it would on a network volume with several
+ * requests in flight.
+ */
+struct block_emulation {
+	uint64_t latency_ns;
+	uint64_t seek_ns;
+	uint64_t seek_max_ns;
+	uint64_t bandwidth;
+	uint64_t sync_ns;
+};
+
+/**
+ * block_set_emulation - Emulate slower storage
+ * @emu: Timings to emulate, or NULL to stop emulating
+ *
+ * Make block_read(), block_write() and block_disk_sync() wait as if the disk
+ * had the timings of @emu, on top of the time they really take, whichever the
+ * backend. The waits are measured with the host's monotonic clock and need no
+ * special hardware. Emulation applies to every disk until stopped.
+ */
+void block_set_emulation(const struct block_emulation *emu);
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the virtual disk
+ * @preallocate: Whether to allocate host storage for the blocks
+ *
+ * Create virtual disk file @diskname holding @bcount blocks filled with zeros,
+ * replacing any existing file of that name. The new virtual disk is not opened.
+ * The file is sized without writing the blocks, so that it is sparse and takes
+ * no host storage until blocks are written, unless @preallocate is set. If
+ * @diskname is a RAM disk, it is resized to @bcount zeroed blocks instead.
+ *
+ * Return: -1 if @diskname is invalid or if the virtual disk file cannot be
+ * created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount, int preallocate);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -34,6 +159,17 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_sync - Flush disk to stable storage
+ *
+ * Wait until every block written to the currently open disk so far is durable.
+ * For a virtual disk file, the file's data is flushed to the host's storage.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush failed.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -1,16 +1,79 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <unistd.h>
 
+#include "async.h"
+#include "crc32c.h"
 #include "disk.h"
 #include "fs.h"
-
-#define FAT_EOC 0xFFFF
-#define FAT_SIZE 2048
+#include "lz.h"
+#include "stats.h"
+
+// Block indices are handled as 32-bit values whatever the on-disk format, the
+// 16-bit end of chain marker is translated when reading and writing the FAT
+#define FAT_EOC 0xFFFFFFFF
+#define FAT16_EOC 0xFFFF
+
+// Flags of a file_entry
+#define FILE_COMPRESSED 0x01
+#define FILE_PACKED 0x02
+#define FILE_DIR 0x04
+#define FILE_SPARSE 0x08
+// Marks a deleted slot of a subdirectory, lookups have to probe past it
+#define FILE_DELETED 0x80
+
+// Subdirectories are files holding a hash table of dir_entry slots, with
+// linear probing. Slot 0 of the first block holds the dir_header
+#define DIR_SLOTS (BLOCK_SIZE / sizeof(struct dir_entry))
+
+// Small files are packed into slots of shared fragment blocks. Slot 0 of every
+// fragment block holds the frag_header
+#define FRAG_SLOT_SIZE 128
+#define FRAG_SLOTS (BLOCK_SIZE / FRAG_SLOT_SIZE)
+#define FRAG_MAX ((FRAG_SLOTS - 1) * FRAG_SLOT_SIZE)
+
+// Compressed files are split into chunks of CHUNK_SIZE bytes, each compressed
+// on its own into a separate FAT chain
+#define CHUNK_BLOCKS 16
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_MAP_SIZE (BLOCK_SIZE / sizeof(struct chunk_entry))
+
+// Set in the clen of a chunk_entry if the chunk is stored uncompressed
+#define CHUNK_RAW 0x80000000
+
+// Sparse files keep a hole map in their chain instead of their data. Entry i
+// is the data block holding block i of the file, a chain of its own, or 0 for
+// a hole that reads as zeros and takes no space
+#define HOLE_MAP_SIZE (BLOCK_SIZE / sizeof(uint32_t))
+
+// Set in an entry of a hole map whose block may be shared with other sparse
+// files by deduplication, its users then being counted in hole_refs
+#define HOLE_SHARED 0x80000000
+
+// Marks a superblock whose file system keeps checksums, in a region of blocks
+// after the data blocks holding one CRC32C per block, indexed by block number
+#define CSUM_MAGIC 0x4D555343
+#define CSUM_ENTRIES (BLOCK_SIZE / sizeof(uint32_t))
+// Bits of the pending map of the superblock, each one standing for a group of
+// consecutive region blocks
+#define CSUM_PENDING_BITS 4096
+
+// Reads and writes of at least IO_PARALLEL_MIN whole blocks are split into
+// ranges of IO_RANGE_BLOCKS blocks, shared out among a pool of threads
+#define IO_PARALLEL_MIN 64
+#define IO_RANGE_BLOCKS 16
+#define IO_THREADS_MAX 16
+
+// Shared blocks are indexed by a key mixing the CRC32C of their content
+#define DEDUP_SEED 0x9E3779B97F4A7C15ull
+#define DEDUP_TABLE_MIN 1024
 
 
 #if 0
@@ -48,54 +111,413 @@ struct __attribute__((__packed__)) superblock {
 	uint16_t data_i;
 	uint16_t num_data;
 	uint8_t num_fat;
-	uint8_t padding[4079];
-};
-
-struct __attribute__((__packed__)) fat_block {
-	uint16_t entries[FAT_SIZE];
+	// Used instead of the fields above by the 32-bit FAT format
+	uint32_t num_blocks_disk32;
+	uint32_t root_i32;
+	uint32_t data_i32;
+	uint32_t num_data32;
+	uint32_t num_fat32;
+	// Checksums, if csum_magic is CSUM_MAGIC. csum_sb is the checksum of the
+	// superblock itself, computed with csum_sb set to 0
+	uint32_t csum_magic;
+	uint32_t csum_flags;
+	uint32_t csum_i;
+	uint32_t num_csum;
+	uint32_t csum_sb;
+	// Groups of region blocks changed since the file system was last
+	// unmounted. Set before the first block they cover is written, so that
+	// after a crash their checksums may be stale and are computed again
+	uint8_t csum_pending[CSUM_PENDING_BITS / 8];
+	// Set by the first clone sharing blocks with another file, from then on
+	// the chains have reference counts, see fat_refs
+	uint8_t clones;
+	uint8_t padding[4038 - CSUM_PENDING_BITS / 8];
 };
 
-struct __attribute__((__packed__)) file_entry {
+// Root directory entry as stored on disk. The high halves of first_block_i and
+// fsize are only used by the 32-bit FAT format
+struct __attribute__((__packed__)) dir_entry {
 	uint8_t fname[FS_FILENAME_LEN];
 	uint32_t fsize;
 	uint16_t first_block_i;
-	uint8_t padding[10];
+	uint8_t flags;
+	uint8_t frag_slot;
+	uint8_t frag_count;
+	uint16_t first_block_hi;
+	uint32_t fsize_hi;
+	uint8_t padding[1];
+};
+
+struct __attribute__((__packed__)) dir_block {
+	struct dir_entry entries[FS_FILE_MAX_COUNT];
+};
+
+// File entry as kept in memory, the same for both formats
+struct file_entry {
+	uint8_t fname[FS_FILENAME_LEN];
+	uint64_t fsize;
+	uint32_t first_block_i;
+	uint8_t flags;
+	// Slots of a packed file in its fragment block
+	uint8_t frag_slot;
+	uint8_t frag_count;
 };
 
-struct __attribute__((__packed__)) root_dir {
+struct root_dir {
 	struct file_entry entries[FS_FILE_MAX_COUNT];
 };
 
+struct __attribute__((__packed__)) dir_header {
+	// Overlaps the name of a dir_entry and stays zeroed, so that the header
+	// never looks like an entry in use
+	uint8_t empty[FS_FILENAME_LEN];
+	// Entries in use, and deleted entries still sitting in probe sequences
+	uint32_t count;
+	uint32_t tombstones;
+	uint8_t padding[8];
+};
+
+// A file entry along with where it is stored: a slot of the root directory
+// when dir_i is FAT_EOC, or else a slot of the subdirectory whose first block
+// is dir_i. The root directory itself has slot -1
+struct file_ref {
+	struct file_entry entry;
+	uint32_t dir_i;
+	int slot;
+};
+
+// Files opened by at least one file descriptor. Each keeps its entry in memory
+// and stores it back whenever it changes
+struct open_file {
+	struct file_ref ref;
+	int open_count;
+	// Last block of the chain and its position in it, FAT_EOC if unknown.
+	// Only set once every block of the chain belongs to this file alone, so
+	// that appends can start there instead of walking the chain
+	uint32_t tail_i;
+	size_t tail_block;
+	// Set when a chunk written to couldn't be stored, reported by the next
+	// fs_fsync() or fs_close()
+	bool write_error;
+	// Neighbours in the list of open files, and next file of the same
+	// bucket of the table of open files
+	struct open_file *prev;
+	struct open_file *next;
+	struct open_file *hash_next;
+};
+
+// Geometry of the mounted file system, from either superblock format
+struct layout {
+	bool fat32;
+	int num_blocks_disk;
+	int num_fat;
+	int root_i;
+	int data_i;
+	int num_data;
+	// FS_CSUM_* flags, and the checksum region
+	int csum_flags;
+	int csum_i;
+	int num_csum;
+};
+
+struct __attribute__((__packed__)) frag_header {
+	// Bit i is set if slot i is in use, bit 0 being the header itself
+	uint32_t used;
+};
+
+// Fragment blocks seen during this mount and their slots in use
+struct frag_info {
+	uint32_t data_index;
+	uint32_t used;
+};
+
+// The chain of a compressed file holds its chunk map, an array of these
+struct __attribute__((__packed__)) chunk_entry {
+	uint32_t first_block_i;
+	uint32_t clen;
+};
+
+struct __attribute__((__packed__)) chunk_map_block {
+	struct chunk_entry entries[CHUNK_MAP_SIZE];
+};
+
+struct hole_map_block {
+	uint32_t blocks[HOLE_MAP_SIZE];
+};
+
+// Last chunk that was decompressed, kept so that small sequential reads and
+// writes don't decompress the same chunk over and over
+struct chunk_cache {
+	// First block of the chunk map of the file, chunk_i is -1 if empty
+	uint32_t map_i;
+	int chunk_i;
+	// Open file whose writes to the chunk aren't stored yet, NULL if none,
+	// and the length of the chunk
+	struct open_file *owner;
+	size_t len;
+	// Set when the disk may not have room for the chunk, which is then stored
+	// by each write so that running out of space fails the write
+	bool through;
+	struct chunk_map_block map;
+	uint8_t data[CHUNK_SIZE];
+	uint8_t packed[CHUNK_SIZE];
+};
+
+// Block indexed for deduplication, key 0 marks a free slot
+struct dedup_slot {
+	uint64_t key;
+	uint32_t block;
+};
+
+// Whole blocks of one read or write, their chain resolved beforehand. Block i
+// goes to or comes from buf + i * BLOCK_SIZE in the caller's buffer
+struct io_job {
+	uint32_t *blocks;
+	uint8_t *buf;
+	size_t num_blocks;
+	bool write;
+	// First block of the next range to take
+	size_t next;
+	bool failed;
+	// Lowest block that failed, the blocks before it are all done
+	size_t first_failed;
+};
+
 struct fd_entry {
-	int file_i;
+	struct open_file *file;
 	size_t offset;
+	// Next entry of the free list while the descriptor is closed
+	int next_free;
 };
 
 struct superblock *superblock = NULL;
-struct fat_block *fat = NULL;
+struct layout layout;
+void *fat = NULL;
+
+// FAT blocks are loaded on first touch, fat_loaded[i] is set once block i is.
+// An optional thread prefetches the blocks in the background after mounting
+uint8_t *fat_loaded = NULL;
+// Set when a FAT block needed by the current call could not be read, see
+// fat_checked()
+bool fat_error = false;
+// FAT blocks changed since they were last written back
+uint8_t *fat_dirty = NULL;
+int fat_dirty_count = 0;
+// Inside a batch, the image of each dirty FAT block as last written, so that
+// one file's entries can be written back without the others. fat_shadowed[i]
+// is set while fat_shadow[i] holds it
+uint8_t **fat_shadow = NULL;
+uint8_t *fat_shadowed = NULL;
+pthread_mutex_t fat_lock = PTHREAD_MUTEX_INITIALIZER;
+bool fat_prefetch = false;
+bool fat_prefetch_stop = false;
+bool fat_prefetch_running = false;
+pthread_t fat_prefetch_thread;
+
+// Workers helping with large reads and writes, started on first need. The
+// thread that submits a job works on it too, then waits for all workers to
+// have seen it
+int io_threads = -1;
+pthread_t *io_pool = NULL;
+int io_pool_size = 0;
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;
+struct io_job *io_job = NULL;
+uint64_t io_job_gen = 0;
+int io_job_busy = 0;
+bool io_pool_stop = false;
+
+// Deduplication index of the shared blocks of sparse files, an open addressing
+// table filled from the hole maps on first use. dedup_keys[i] is the key block
+// i was last indexed under, cleared when it is freed or taken back by a single
+// file, so that stale entries are told apart
+bool dedup = false;
+size_t dedup_min = 1;
+uint64_t *dedup_keys = NULL;
+struct dedup_slot *dedup_table = NULL;
+size_t dedup_cap = 0;
+size_t dedup_len = 0;
+
+// Number of hole map entries flagged HOLE_SHARED pointing at each block, counted
+// from every hole map the first time one is needed. If a map could not be read
+// the counts may be short, and shared blocks are then never freed
+uint32_t *hole_refs = NULL;
+bool hole_refs_ready = false;
+bool hole_refs_partial = false;
+
 struct root_dir *root_dir = NULL;
-struct fd_entry fd_table[FS_OPEN_MAX_COUNT];
+// The root directory block as last written, so that one entry can be written
+// back without the others
+struct dir_block *root_block = NULL;
+
+// The descriptor table grows on demand, closed descriptors are kept in a free
+// list so that opening and closing never scan it
+struct fd_entry *fd_table = NULL;
+int fd_table_size = 0;
+int fd_free = -1;
+int fd_open_count = 0;
+size_t fd_open_max = FS_OPEN_MAX_COUNT;
+struct open_file *open_files = NULL;
+// Open files are also found by where their entry is stored, in a table of
+// chained buckets grown along with the number of open files
+struct open_file **open_file_table = NULL;
+size_t open_file_buckets = 0;
+size_t open_file_count = 0;
+
+// Nesting depth of fs_batch_begin(). Inside a batch, fs_backup() only notes
+// that the metadata changed and the outermost fs_batch_end() writes it back
+int batch_depth = 0;
+bool batch_dirty = false;
+
+// Checksums of the blocks covered by the checksum region. Like the FAT, region
+// blocks are loaded on first use, and written back by fs_backup() once changed
+uint32_t *csums = NULL;
+uint8_t *csum_loaded = NULL;
+uint8_t *csum_dirty = NULL;
+// Region blocks of pending groups found at mount, computed again on load.
+// csum_group is the number of region blocks per bit of the pending map
+uint8_t *csum_stale = NULL;
+int csum_group = 1;
+pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+// Cleared by fs_check(), which compares checksums itself
+bool csum_verify = true;
+
+// Number of FAT entries pointing at each data block. Chain heads are only
+// referenced from directory entries and always have a count of 0, so a count
+// greater than 1 means the block is shared between the chains of cloned files.
+// Only kept on disks whose superblock has clones set, elsewhere no block is
+// shared and every count reads as 0
+uint32_t *fat_refs = NULL;
+bool fat_refs_ready = false;
+struct chunk_cache *chunk_cache = NULL;
+
+// Fragment blocks with free slots. Built from the packed files of the whole
+// tree the first time a file is packed after mounting, then kept up to date
+struct frag_info *frag_list = NULL;
+int frag_list_len = 0;
+bool frag_list_ready = false;
+
+// Last fragment block read or written, small files sharing a fragment block
+// are usually touched together
+uint8_t *frag_cache = NULL;
+int frag_cache_index = -1;
+
+// Every public function holds this lock for its whole call, so that the file
+// system can be used from several threads. It is recursive, as some of them
+// call others, and callbacks such as those of fs_readdir() may call in again
+pthread_mutex_t fs_mutex;
+pthread_once_t fs_mutex_once = PTHREAD_ONCE_INIT;
+int fs_lock_depth = 0;
+
+void fs_mutex_init() {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&fs_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
 
-bool is_valid_superblock(struct superblock *superblock) {
-	int i;
+int fs_lock() {
+	pthread_once(&fs_mutex_once, fs_mutex_init);
+	pthread_mutex_lock(&fs_mutex);
+	// Errors are reported by the outermost call
+	if (fs_lock_depth++ == 0) {
+		fat_error = false;
+	}
+	return 1;
+}
 
-	// ecs150fs is the hexadecimal representation of the string "ECS150FS"
-	uint8_t target[8] = {'E', 'C', 'S', '1', '5', '0', 'F', 'S'};
+void fs_unlock(int *locked) {
+	(void)locked;
+	fs_lock_depth--;
+	pthread_mutex_unlock(&fs_mutex);
+}
 
-	for (i = 0; i < 8; i++) {
-		if ((superblock->signature)[i] != target[i]) {
-			return false;
-		}
+// Takes the lock until the enclosing block returns. Comes before STAT_TIMED,
+// whose arguments can read the descriptor table
+#define FS_LOCKED() \
+	int fs_locked __attribute__((cleanup(fs_unlock))) = fs_lock()
+
+// Number of blocks of the checksum region of a disk
+size_t csum_region_blocks(int flags, size_t meta_blocks, size_t data_blocks) {
+	if (!flags) {
+		return 0;
+	}
+
+	size_t covered = meta_blocks + (flags & FS_CSUM_DATA ? data_blocks : 0);
+	return (covered + CSUM_ENTRIES - 1) / CSUM_ENTRIES;
+}
+
+bool is_valid_csum_layout(struct superblock *superblock) {
+	if (superblock->csum_magic != CSUM_MAGIC) {
+		layout.csum_flags = 0;
+		layout.csum_i = layout.data_i + layout.num_data;
+		layout.num_csum = 0;
+		return true;
+	}
+
+	layout.csum_flags = superblock->csum_flags;
+	layout.csum_i = superblock->csum_i;
+	layout.num_csum = superblock->num_csum;
+
+	uint32_t sum = superblock->csum_sb;
+	superblock->csum_sb = 0;
+	uint32_t expected = crc32c(0, superblock, BLOCK_SIZE);
+	superblock->csum_sb = sum;
+	if (sum != expected) {
+		stat_add(STAT_CSUM_ERRORS, 1);
+        fs_print("Superblock checksum mismatch\n");
+		return false;
+	}
+
+	return (layout.csum_flags & ~(FS_CSUM_METADATA | FS_CSUM_DATA)) == 0 &&
+		(layout.csum_flags & FS_CSUM_METADATA) &&
+		layout.csum_i == layout.data_i + layout.num_data &&
+		(size_t)layout.num_csum >= csum_region_blocks(layout.csum_flags, layout.data_i, layout.num_data);
+}
+
+bool is_valid_superblock(struct superblock *superblock) {
+	// ecs150fs is the hexadecimal representation of the string "ECS150FS",
+	// images with 32-bit FAT entries are signed "ECS150F2" instead
+	uint8_t target[8] = {'E', 'C', 'S', '1', '5', '0', 'F', 'S'};
+	uint8_t target32[8] = {'E', 'C', 'S', '1', '5', '0', 'F', '2'};
+
+	if (memcmp(superblock->signature, target, 8) == 0) {
+		layout.fat32 = false;
+		layout.num_blocks_disk = superblock->num_blocks_disk;
+		layout.num_fat = superblock->num_fat;
+		layout.root_i = superblock->root_i;
+		layout.data_i = superblock->data_i;
+		layout.num_data = superblock->num_data;
+	} else if (memcmp(superblock->signature, target32, 8) == 0) {
+		layout.fat32 = true;
+		layout.num_blocks_disk = superblock->num_blocks_disk32;
+		layout.num_fat = superblock->num_fat32;
+		layout.root_i = superblock->root_i32;
+		layout.data_i = superblock->data_i32;
+		layout.num_data = superblock->num_data32;
+	} else {
+		return false;
 	}
 
     int blocks = block_disk_count();
-	int superBlockDataBlocks = superblock->num_blocks_disk;
+	int superBlockDataBlocks = layout.num_blocks_disk;
 
     if (superBlockDataBlocks != blocks) {
         fs_print("Block count mismatch \n");
         return false;
     }
 
+	int entries_per_block = BLOCK_SIZE / (layout.fat32 ? sizeof(uint32_t) : sizeof(uint16_t));
+	if (layout.num_data <= 0 || layout.num_fat * entries_per_block < layout.num_data ||
+		layout.root_i != layout.num_fat + 1 || !is_valid_csum_layout(superblock) ||
+		layout.csum_i + layout.num_csum > blocks) {
+        fs_print("Inconsistent layout\n");
+		return false;
+	}
+
 	return true;
 }
 
@@ -103,541 +525,4997 @@ bool is_disk_opened() {
 	return superblock != NULL;
 }
 
-int superblock_read() {
-	superblock = (struct superblock*)malloc(sizeof(struct superblock));
-	if (!superblock) {
-        fs_print("fs_mount superblock: ");
-		return -1;
+bool csum_covers(size_t block) {
+	if (!layout.csum_flags || block == 0) {
+		return false;
 	}
 
-	FAILABLE(block_read(0, superblock));
-	if (!is_valid_superblock(superblock)) {
-        fs_print("Error reading superblock with signature\n");
-		return -1;
-	}
+	return block < (size_t)layout.data_i ||
+		((layout.csum_flags & FS_CSUM_DATA) && block < (size_t)(layout.data_i + layout.num_data));
+}
 
-	return 0;
+int superblock_write() {
+	superblock->csum_sb = 0;
+	superblock->csum_sb = crc32c(0, superblock, BLOCK_SIZE);
+
+	return block_write(0, superblock);
 }
 
-int fat_read() {
-	int i;
+bool csum_pending_test(int group) {
+	return superblock->csum_pending[group / 8] & (1 << (group % 8));
+}
 
-	fat = (struct fat_block*)malloc(superblock->num_fat * sizeof(struct fat_block));
-	if (!fat) {
-        fs_print("fs_mount fat array: ");
+// Computes again the checksums of a region block whose group was pending when
+// mounting. The blocks it covers may have been written after it last was, the
+// crash losing their new checksums, so their content is taken as it is
+int csum_rebuild(size_t csum_b) {
+	size_t block;
+
+	uint8_t *buffer = (uint8_t*)malloc(BLOCK_SIZE);
+	if (!buffer) {
 		return -1;
 	}
-	for (i = 0; i < superblock->num_fat; ++i) {
-		FAILABLE(block_read(1 + i, fat + i));
-	}
 
-	return 0;
-}
+	for (block = csum_b * CSUM_ENTRIES; block < (csum_b + 1) * CSUM_ENTRIES; ++block) {
+		if (!csum_covers(block)) {
+			continue;
+		}
+		if (block_read(block, buffer) == -1) {
+			free(buffer);
+			return -1;
+		}
 
-int root_dir_read() {
-	root_dir = (struct root_dir*)malloc(sizeof(struct root_dir));
-	if (!root_dir) {
-        fs_print("fs_mount root_dir: ");
-		return -1;
+		uint32_t sum = crc32c(0, buffer, BLOCK_SIZE);
+		if (csums[block] != sum) {
+			csums[block] = sum;
+			csum_dirty[csum_b] = 1;
+		}
 	}
-	FAILABLE(block_read(superblock->num_fat + 1, root_dir));
+	free(buffer);
 
+	csum_stale[csum_b] = 0;
 	return 0;
 }
 
-void fd_table_create() {
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		fd_table[i].file_i = -1;
+// Returns the checksum of a covered block, loading its region block if needed
+uint32_t* csum_entry(size_t block) {
+	size_t csum_b = block / CSUM_ENTRIES;
+
+	if (!__atomic_load_n(csum_loaded + csum_b, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&csum_lock);
+		int ret = 0;
+		if (!__atomic_load_n(csum_loaded + csum_b, __ATOMIC_ACQUIRE)) {
+			ret = block_read(layout.csum_i + csum_b, csums + csum_b * CSUM_ENTRIES);
+			if (ret == 0 && csum_stale[csum_b]) {
+				ret = csum_rebuild(csum_b);
+			}
+			if (ret == 0) {
+				__atomic_store_n(csum_loaded + csum_b, 1, __ATOMIC_RELEASE);
+			}
+		}
+		pthread_mutex_unlock(&csum_lock);
+
+		if (ret == -1) {
+			return NULL;
+		}
 	}
-}
 
-int fs_mount(const char *diskname)
-{
-	FAILABLE(block_disk_open(diskname));
-	FAILABLE(superblock_read());
-	FAILABLE(fat_read());
-	FAILABLE(root_dir_read());
+	return csums + block;
+}
 
-	fd_table_create();
+// Reads a block, failing if it doesn't match its checksum
+int csum_block_read(size_t block, void *buf) {
+	FAILABLE(block_read(block, buf));
+
+	// Every read is verified, the disk may have changed under a block read
+	// before
+	if (csum_verify && csum_covers(block)) {
+		uint32_t *sum = csum_entry(block);
+		if (!sum || *sum != crc32c(0, buf, BLOCK_SIZE)) {
+			stat_add(STAT_CSUM_ERRORS, 1);
+            fs_print("Checksum mismatch in block %zu\n", block);
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-void fs_backup() {
-	int i = 1;
+// Marks a region block as changed. The first change of its group since
+// mounting is noted in the superblock before any block it covers is written
+int csum_mark_dirty(size_t csum_b) {
+	int ret = 0;
 
-	for (i = 0; i < superblock->num_fat; i++) {
-		block_write(1 + i, fat + i);
+	// Parallel writes may mark the same region block
+	if (__atomic_load_n(csum_dirty + csum_b, __ATOMIC_ACQUIRE)) {
+		return 0;
 	}
 
-	block_write(superblock->num_fat + 1, root_dir);
-}
-
-bool is_fd_table_empty() {
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		if (fd_table[i].file_i != -1) {
-			return false;
-		}
+	pthread_mutex_lock(&csum_lock);
+	int group = csum_b / csum_group;
+	if (!csum_pending_test(group)) {
+		superblock->csum_pending[group / 8] |= 1 << (group % 8);
+		ret = superblock_write();
 	}
-	return true;
+	if (ret == 0) {
+		__atomic_store_n(csum_dirty + csum_b, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&csum_lock);
+
+	return ret;
 }
 
-int fs_umount(void)
-{
-	if (!is_disk_opened()) {
-        fs_print("Cannot unmount, disk not open\n");
-		return -1;
+// Writes a block and updates its checksum
+int csum_block_write(size_t block, const void *buf) {
+	if (!csum_covers(block)) {
+		return block_write(block, buf);
 	}
 
-	if (!is_fd_table_empty()) {
-        fs_print("Cannot unmount, file table not empty\n");
+	uint32_t *sum = csum_entry(block);
+	if (!sum || csum_mark_dirty(block / CSUM_ENTRIES) == -1) {
 		return -1;
 	}
+	*sum = crc32c(0, buf, BLOCK_SIZE);
 
-	fs_backup();
-
-	free(fat);
-	fat = NULL;
+	return block_write(block, buf);
+}
 
-	free(superblock);
-	superblock = NULL;
+int csum_read() {
+	if (!layout.csum_flags) {
+		return 0;
+	}
 
-	free(root_dir);
-	root_dir = NULL;
+	csums = (uint32_t*)malloc(layout.num_csum * BLOCK_SIZE);
+	csum_loaded = (uint8_t*)calloc(layout.num_csum, sizeof(uint8_t));
+	csum_dirty = (uint8_t*)calloc(layout.num_csum, sizeof(uint8_t));
+	csum_stale = (uint8_t*)calloc(layout.num_csum, sizeof(uint8_t));
+	if (!csums || !csum_loaded || !csum_dirty || !csum_stale) {
+        fs_print("fs_mount csums: ");
+		return -1;
+	}
 
-	FAILABLE(block_disk_close());
+	int i;
+	csum_group = (layout.num_csum + CSUM_PENDING_BITS - 1) / CSUM_PENDING_BITS;
+	for (i = 0; i < layout.num_csum; ++i) {
+		csum_stale[i] = csum_pending_test(i / csum_group);
+	}
 
 	return 0;
 }
 
-uint16_t* fat_entry_at_index(int index) {
-	int fat_index = index / FAT_SIZE;
-	int entry_index = index % FAT_SIZE;
-
-	return fat[fat_index].entries + entry_index;
-}
-
-uint8_t num_fat_free() {
+// Writes back the region blocks whose checksums changed
+void csum_flush() {
 	int i;
-    uint8_t num_free;
 
-	num_free = 0;
-	for (i = 0; i < superblock->num_data; i++) {
-		if (*fat_entry_at_index(i) == 0) {
-			num_free += 1;
+	for (i = 0; i < layout.num_csum && csum_dirty; ++i) {
+		if (csum_dirty[i] && block_write(layout.csum_i + i, csums + i * CSUM_ENTRIES) == 0) {
+			csum_dirty[i] = 0;
 		}
 	}
-
-	return num_free;
 }
 
-int num_files_free() {
-	int i, num_free;
+// Clears the pending groups whose region blocks are all written back and up
+// to date, once the blocks they cover are
+int csum_settle() {
+	uint8_t pending[CSUM_PENDING_BITS / 8] = { 0 };
+	int i;
 
-	num_free = 0;
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (root_dir->entries[i].fname[0] == '\0') {
-			num_free += 1;
+	if (!csum_dirty) {
+		return 0;
+	}
+
+	for (i = 0; i < layout.num_csum; ++i) {
+		if (csum_dirty[i] || csum_stale[i]) {
+			pending[i / csum_group / 8] |= 1 << (i / csum_group % 8);
 		}
 	}
 
-	return num_free;
+	if (memcmp(pending, superblock->csum_pending, sizeof(pending)) == 0) {
+		return 0;
+	}
+	memcpy(superblock->csum_pending, pending, sizeof(pending));
+
+	return superblock_write();
 }
 
-int fs_info(void)
-{
-	if (!is_disk_opened()) {
+int superblock_read() {
+	superblock = (struct superblock*)malloc(sizeof(struct superblock));
+	if (!superblock) {
+        fs_print("fs_mount superblock: ");
 		return -1;
 	}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%" PRIu16 "\n", superblock->num_blocks_disk);
-	printf("fat_blk_count=%" PRIu8 "\n", superblock->num_fat);
-	printf("rdir_blk=%" PRIu16 "\n", superblock->num_fat + 1);
-	printf("data_blk=%" PRIu16 "\n", superblock->num_fat + 2);
-	printf("data_blk_count=%" PRIu16 "\n", superblock->num_data);
-	printf("fat_free_ratio=%" PRIu8 "/%" PRIu8 "\n", num_fat_free(), superblock->num_data);
-	printf("rdir_free_ratio=%d/%d\n", num_files_free(), FS_FILE_MAX_COUNT);
+	FAILABLE(block_read(0, superblock));
+	if (!is_valid_superblock(superblock)) {
+        fs_print("Error reading superblock with signature\n");
+		return -1;
+	}
 
-	return 0;
+	return csum_read();
 }
 
-int first_free_fat_index() {
-	int i = 0;
-	for (i = 0; i < superblock->num_data; ++i) {
-		if (*fat_entry_at_index(i) == 0) {
-			return i;
+// Reads a FAT block into memory unless it already is. Safe to call from
+// several threads, such as the prefetcher and the thread using the disk
+int fat_load_block(int fat_i) {
+	int ret = 0;
+
+	pthread_mutex_lock(&fat_lock);
+	if (!__atomic_load_n(fat_loaded + fat_i, __ATOMIC_ACQUIRE)) {
+		ret = csum_block_read(1 + fat_i, (uint8_t*)fat + fat_i * BLOCK_SIZE);
+		if (ret == 0) {
+			stat_add(STAT_FAT_LOADS, 1);
+			__atomic_store_n(fat_loaded + fat_i, 1, __ATOMIC_RELEASE);
 		}
 	}
+	pthread_mutex_unlock(&fat_lock);
 
-	return -1;
+	return ret;
 }
 
+// FAT blocks are only read on first touch, see fat_entry_at_index()
+int fat_read() {
+	fat = malloc(layout.num_fat * BLOCK_SIZE);
+	fat_loaded = (uint8_t*)calloc(layout.num_fat, sizeof(uint8_t));
+	fat_dirty = (uint8_t*)calloc(layout.num_fat, sizeof(uint8_t));
+	fat_dirty_count = 0;
+	fat_shadow = (uint8_t**)calloc(layout.num_fat, sizeof(uint8_t*));
+	fat_shadowed = (uint8_t*)calloc(layout.num_fat, sizeof(uint8_t));
+	if (!fat || !fat_loaded || !fat_dirty || !fat_shadow || !fat_shadowed) {
+        fs_print("fs_mount fat array: ");
+		return -1;
+	}
 
-// Returns -1 if filename already in root_dir
-int new_file_index(const char* filename) {
-	int i;
-	int file_index = -1;
+	return 0;
+}
 
-	for (i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-		if (strcmp((const char*) root_dir->entries[i].fname, filename) == 0) {
-			return -1;
-		}
+void* fat_prefetch_worker(void *arg) {
+	int i;
 
-		if (file_index == -1 && root_dir->entries[i].fname[0] == '\0') {
-			file_index = i;
+	(void)arg;
+	for (i = 0; i < layout.num_fat && !__atomic_load_n(&fat_prefetch_stop, __ATOMIC_RELAXED); ++i) {
+		if (fat_load_block(i) == -1) {
+			break;
 		}
 	}
 
-	return file_index;
+	return NULL;
 }
 
-// Returns -1 if file not found
-int first_index_of_filename(const char* filename) {
-	int i;
+void fs_set_fat_prefetch(int enable)
+{
+	FS_LOCKED();
 
-	for (i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-		if (strcmp((const char*) root_dir->entries[i].fname, filename) == 0) {
-			return i;
-		}
+	fat_prefetch = enable != 0;
+}
+
+void fat_prefetch_start() {
+	fat_prefetch_stop = false;
+	fat_prefetch_running = fat_prefetch && layout.num_fat > 1 &&
+		pthread_create(&fat_prefetch_thread, NULL, fat_prefetch_worker, NULL) == 0;
+}
+
+void fat_prefetch_join() {
+	if (fat_prefetch_running) {
+		__atomic_store_n(&fat_prefetch_stop, true, __ATOMIC_RELAXED);
+		pthread_join(fat_prefetch_thread, NULL);
+		fat_prefetch_running = false;
 	}
+}
 
-	return -1;
+void fs_set_dedup(int enable)
+{
+	FS_LOCKED();
+
+	dedup = enable != 0;
 }
 
-void create_file(const char *filename, int index) {
-	strcpy((char * restrict) root_dir->entries[index].fname, filename);
-	root_dir->entries[index].fsize = 0;
-	root_dir->entries[index].first_block_i = FAT_EOC;
+void fs_set_dedup_min(int blocks)
+{
+	FS_LOCKED();
+
+	dedup_min = blocks < 1 ? 1 : blocks;
 }
 
-int fs_create(const char *filename)
+void fs_set_io_threads(int threads)
 {
-	if (strlen(filename) >= FS_FILENAME_LEN){
-        fs_print("Error creating file: file name too long\n");
-        return -1;
-    }
+	FS_LOCKED();
 
-	if (!is_disk_opened()) {
-        fs_print("Disk not opened\n");
-		return -1;
-	}
+	io_threads = threads < 0 ? -1 : (threads > IO_THREADS_MAX ? IO_THREADS_MAX : threads);
+}
 
-	int file_index = new_file_index(filename);
-	if (file_index == -1) {
-        fs_print("Error creating file: %s not unique\n", filename);
-		return -1;
+// Notes that block i of a job failed, keeping the lowest one that did
+void io_job_fail(struct io_job *job, size_t i) {
+	size_t first = __atomic_load_n(&job->first_failed, __ATOMIC_RELAXED);
+
+	while (i < first && !__atomic_compare_exchange_n(&job->first_failed, &first, i, true,
+	                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
 	}
+	__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+}
 
-	create_file(filename, file_index);
+// Takes ranges of the job until none are left. Workers only ever read or write
+// whole blocks of their own, everything else about the file is done already
+void io_job_work(struct io_job *job) {
+	size_t i, start;
 
-	fs_backup();
-	
-	return 0;
+	while ((start = __atomic_fetch_add(&job->next, IO_RANGE_BLOCKS, __ATOMIC_RELAXED)) < job->num_blocks) {
+		size_t end = start + IO_RANGE_BLOCKS < job->num_blocks ? start + IO_RANGE_BLOCKS : job->num_blocks;
+
+		for (i = start; i < end; ++i) {
+			int ret = job->write ?
+				csum_block_write(layout.data_i + job->blocks[i], job->buf + i * BLOCK_SIZE) :
+				csum_block_read(layout.data_i + job->blocks[i], job->buf + i * BLOCK_SIZE);
+			if (ret == -1) {
+				io_job_fail(job, i);
+			}
+		}
+	}
 }
 
-void clear_blocks(struct file_entry *file) {
-	int data_index = file->first_block_i;
+void* io_worker(void *arg) {
+	uint64_t seen = 0;
 
-	uint8_t *empty_buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+	(void)arg;
+	pthread_mutex_lock(&io_lock);
+	for (;;) {
+		while (!io_pool_stop && io_job_gen == seen) {
+			pthread_cond_wait(&io_start, &io_lock);
+		}
+		if (io_pool_stop) {
+			break;
+		}
+		seen = io_job_gen;
 
-	while (data_index != FAT_EOC) {
-		block_write(superblock->num_fat + 2 + data_index, empty_buffer);
-		int old_index = data_index;
-		data_index = *fat_entry_at_index(data_index);
-		*fat_entry_at_index(old_index) = 0;
+		// A job that already ended is none of this worker's business
+		struct io_job *job = io_job;
+		if (!job) {
+			continue;
+		}
+		pthread_mutex_unlock(&io_lock);
+		io_job_work(job);
+		pthread_mutex_lock(&io_lock);
+
+		if (--io_job_busy == 0) {
+			pthread_cond_signal(&io_done);
+		}
 	}
+	pthread_mutex_unlock(&io_lock);
 
-	free(empty_buffer);
+	return NULL;
 }
 
-int fs_delete(const char *filename)
-{
-	int i;
+// One worker per processor besides the calling thread, unless told otherwise
+void io_pool_start() {
+	int threads = io_threads;
 
-	if (!is_disk_opened()) {
-        fs_print("Disk not opened\n");
-		return -1;
+	if (threads < 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 1 ? (cpus - 1 < IO_THREADS_MAX ? cpus - 1 : IO_THREADS_MAX) : 0;
 	}
-
-	int file_index = first_index_of_filename(filename);
-	if (file_index == -1) {
-        fs_print("Unable to find file to delete\n");
-		return -1;
+	if (threads == 0) {
+		return;
 	}
 
-	// Check to see if file is open
-	for (i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (fd_table[i].file_i == file_index) {
-            fs_print("file_i %d\n", fd_table[i].file_i);
-            fs_print("Unable to delete open file\n");
-			return -1;
-		}
+	io_pool = (pthread_t*)calloc(threads, sizeof(pthread_t));
+	if (!io_pool) {
+		return;
 	}
 
-	if (file_index == -1) {
-        fs_print("Unable to find file in file root directory\n");
-		return -1;
+	io_pool_stop = false;
+	while (io_pool_size < threads && pthread_create(io_pool + io_pool_size, NULL, io_worker, NULL) == 0) {
+		io_pool_size++;
 	}
+}
 
-	clear_blocks(root_dir->entries + file_index);
-
-	// Clear file entry
-	memset(root_dir->entries + file_index, 0, sizeof(struct file_entry));
+void io_pool_join() {
+	int i;
 
-	fs_backup();
+	pthread_mutex_lock(&io_lock);
+	io_pool_stop = true;
+	pthread_cond_broadcast(&io_start);
+	pthread_mutex_unlock(&io_lock);
 
-	return 0;
+	for (i = 0; i < io_pool_size; ++i) {
+		pthread_join(io_pool[i], NULL);
+	}
+	free(io_pool);
+	io_pool = NULL;
+	io_pool_size = 0;
+
+	// Workers of the next pool start from generation 0
+	io_job = NULL;
+	io_job_gen = 0;
+	io_job_busy = 0;
 }
 
-int fs_ls(void)
-{
-	int i;
-	struct file_entry entry;
+// Reads or writes the blocks of a job, on the pool if there are enough of them
+int io_job_run(struct io_job *job) {
+	job->failed = false;
+	job->first_failed = SIZE_MAX;
 
-	if (!is_disk_opened()) {
-        fs_print("fs not opened\n");
-		return -1;
+	if (job->num_blocks >= IO_PARALLEL_MIN && !io_pool) {
+		io_pool_start();
 	}
 
-    printf("FS Ls:\n");
-	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		entry = root_dir->entries[i];
-		if (entry.fname[0] != '\0') {
-			printf("file: %s, size: %" PRIu32 ", data_blk: %" PRIu16 "\n", entry.fname, entry.fsize, entry.first_block_i);
-		}
+	if (job->num_blocks < IO_PARALLEL_MIN || io_pool_size == 0) {
+		io_job_work(job);
+		return job->failed ? -1 : 0;
 	}
-	return 0;
+
+	pthread_mutex_lock(&io_lock);
+	io_job = job;
+	io_job_busy = io_pool_size;
+	io_job_gen++;
+	pthread_cond_broadcast(&io_start);
+	pthread_mutex_unlock(&io_lock);
+
+	io_job_work(job);
+
+	// Workers still hold the job until they are done with it
+	pthread_mutex_lock(&io_lock);
+	while (io_job_busy > 0) {
+		pthread_cond_wait(&io_done, &io_lock);
+	}
+	io_job = NULL;
+	pthread_mutex_unlock(&io_lock);
+
+	return job->failed ? -1 : 0;
 }
 
-// Returns -1 if max number of files are open
-int first_open_fd_i() {
-	int i;
-	for (i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		if (fd_table[i].file_i == -1) {
-			return i;
-		}
+void file_entry_load(struct file_entry *file, const struct dir_entry *entry) {
+	memcpy(file->fname, entry->fname, FS_FILENAME_LEN);
+	file->fsize = entry->fsize | ((uint64_t)entry->fsize_hi << 32);
+	file->first_block_i = entry->first_block_i | ((uint32_t)entry->first_block_hi << 16);
+	if (!layout.fat32 && file->first_block_i == FAT16_EOC) {
+		file->first_block_i = FAT_EOC;
 	}
-	return -1;
+	file->flags = entry->flags;
+	file->frag_slot = entry->frag_slot;
+	file->frag_count = entry->frag_count;
 }
 
-int fs_open(const char *filename)
-{
-	int fd = first_open_fd_i();
-	if (fd == -1) {
-        fs_print("Unable to open file: max num files opened\n");
+void file_entry_store(struct dir_entry *entry, const struct file_entry *file) {
+	memset(entry, 0, sizeof(struct dir_entry));
+	memcpy(entry->fname, file->fname, FS_FILENAME_LEN);
+	entry->fsize = file->fsize;
+	entry->first_block_i = file->first_block_i;
+	if (layout.fat32) {
+		entry->fsize_hi = file->fsize >> 32;
+		entry->first_block_hi = file->first_block_i >> 16;
+	}
+	entry->flags = file->flags;
+	entry->frag_slot = file->frag_slot;
+	entry->frag_count = file->frag_count;
+}
+
+int root_dir_read() {
+	int i;
+
+	root_dir = (struct root_dir*)malloc(sizeof(struct root_dir));
+	root_block = (struct dir_block*)malloc(sizeof(struct dir_block));
+	if (!root_dir || !root_block) {
+        fs_print("fs_mount root_dir: ");
 		return -1;
 	}
 
-	int file_i = first_index_of_filename(filename);
-	if (file_i == -1) {
-        fs_print("Unable to open file: file not found\n");
+	if (csum_block_read(layout.root_i, root_block) == -1) {
 		return -1;
 	}
 
-	fd_table[fd].file_i = file_i;
-	fd_table[fd].offset = 0;
+	for (i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		file_entry_load(root_dir->entries + i, root_block->entries + i);
+	}
 
-	return fd;
+	return 0;
 }
 
-int verify_fd(int fd) {
-	if (fd < 0 || fd > 31) {
-        fs_print("fd out of bounds\n");
+// FAT block holding the entry of a data block
+static inline int fat_block_of(uint32_t index) {
+	return index / (layout.fat32 ? BLOCK_SIZE / 4 : BLOCK_SIZE / 2);
+}
+
+// Makes sure the FAT block holding an entry is in memory. An entry whose block
+// cannot be read is reported as the end of a chain, so that it is never taken
+// for a free block, and sets fat_error so that the call fails
+static inline bool fat_entry_loaded(int index) {
+	int fat_i = fat_block_of(index);
+
+	if (__atomic_load_n(fat_loaded + fat_i, __ATOMIC_ACQUIRE) || fat_load_block(fat_i) == 0) {
+		return true;
+	}
+
+	__atomic_store_n(&fat_error, true, __ATOMIC_RELAXED);
+	return false;
+}
+
+// Result of a call that walked or changed chains: -1 if a FAT block it needed
+// could not be read, as chains then looked shorter than they are and changes
+// to them were dropped, or else ret
+int fat_checked(int ret) {
+	if (__atomic_load_n(&fat_error, __ATOMIC_RELAXED)) {
+        fs_print("Cannot read FAT\n");
 		return -1;
 	}
 
-	if (fd_table[fd].file_i == -1) {
-        fs_print("fd not open\n");
+	return ret;
+}
+
+uint32_t fat_entry_at_index(int index) {
+	if (!fat_entry_loaded(index)) {
+		return FAT_EOC;
+	}
+
+	if (layout.fat32) {
+		return ((uint32_t*)fat)[index];
+	}
+
+	uint16_t entry = ((uint16_t*)fat)[index];
+	return entry == FAT16_EOC ? FAT_EOC : entry;
+}
+
+// Follows a chain one block further
+uint32_t fat_next(uint32_t index) {
+	stat_add(STAT_FAT_HOPS, 1);
+	return fat_entry_at_index(index);
+}
+
+int fat_refs_build() {
+	fat_refs = (uint32_t*)calloc(layout.num_data, sizeof(uint32_t));
+	fat_refs_ready = false;
+	if (!fat_refs) {
+        fs_print("fs_mount fat_refs: ");
 		return -1;
 	}
 
 	return 0;
 }
 
-int fs_close(int fd)
-{
-	FAILABLE(verify_fd(fd));
-	fd_table[fd].file_i = -1;
+int dedup_start() {
+	if (!dedup) {
+		return 0;
+	}
+
+	dedup_keys = (uint64_t*)calloc(layout.num_data, sizeof(uint64_t));
+	if (!dedup_keys) {
+        fs_print("fs_mount dedup_keys: ");
+		return -1;
+	}
+
 	return 0;
 }
 
-int fs_stat(int fd)
-{
-	FAILABLE(verify_fd(fd));
-	return root_dir->entries[fd_table[fd].file_i].fsize;
+// Reference counts need the whole FAT, so they are only computed the first
+// time a chain is changed rather than at mount, and only on disks with clones
+uint32_t* fat_refs_get() {
+	int i;
+
+	if (!fat_refs_ready) {
+		for (i = 0; i < layout.num_data; ++i) {
+			uint32_t next = fat_entry_at_index(i);
+			if (next != 0 && next != FAT_EOC && next < (uint32_t)layout.num_data) {
+				fat_refs[next] += 1;
+			}
+		}
+		fat_refs_ready = true;
+	}
+
+	return fat_refs;
 }
 
-int fs_lseek(int fd, size_t offset)
-{
-	FAILABLE(verify_fd(fd));
+uint32_t fat_ref_count(uint32_t index) {
+	return superblock->clones ? fat_refs_get()[index] : 0;
+}
+
+// Adds delta to the reference count of a block and returns the new count
+uint32_t fat_ref_add(uint32_t index, int delta) {
+	if (!superblock->clones) {
+		return 0;
+	}
+
+	return fat_refs_get()[index] += delta;
+}
+
+// Marks the disk as having clones before the first one shares blocks. The
+// counts are computed from the FAT as it is, then follow the changes
+int fat_refs_start() {
+	superblock->clones = 1;
+	fat_refs_get();
 
-	if (offset > root_dir->entries[fd_table[fd].file_i].fsize) {
+	if (superblock_write() == -1) {
+		superblock->clones = 0;
 		return -1;
 	}
 
-	fd_table[fd].offset = offset;
-	
 	return 0;
 }
 
-int fs_write(int fd, void *buf, size_t count)
-{
-	FAILABLE(verify_fd(fd));
-
-    uint16_t *data_index_ptr = &(root_dir->entries[fd_table[fd].file_i].first_block_i);
+// Keeps a copy of a FAT block before its first change in a batch. Without
+// one, the block can only be written back whole
+void fat_shadow_save(int fat_i) {
+	if (!fat_shadow[fat_i]) {
+		fat_shadow[fat_i] = (uint8_t*)malloc(BLOCK_SIZE);
+		if (!fat_shadow[fat_i]) {
+			return;
+		}
+	}
 
-    size_t startingByte = fd_table[fd].offset;
-    size_t finalByte = startingByte + count - 1;
+	memcpy(fat_shadow[fat_i], (uint8_t*)fat + fat_i * BLOCK_SIZE, BLOCK_SIZE);
+	fat_shadowed[fat_i] = 1;
+}
 
-    uint8_t *bounce_buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+// Copies the entry of a data block into the copy of its FAT block, returns
+// whether it changed
+bool fat_shadow_entry(uint32_t index) {
+	int fat_i = fat_block_of(index);
 
-    int blocksIteratedOver = 0;
-    size_t total_bytes_written = 0;
-    while (total_bytes_written < count) {
-		// Allocate block if we are out of room
-		if (*data_index_ptr == FAT_EOC){
-            // now we allocate new space, and then update the data index to point to the new space.
-			int new_index = first_free_fat_index();
+	if (layout.fat32) {
+		uint32_t *entry = (uint32_t*)fat_shadow[fat_i] + index % (BLOCK_SIZE / 4);
+		bool changed = *entry != ((uint32_t*)fat)[index];
+		*entry = ((uint32_t*)fat)[index];
+		return changed;
+	}
 
-			// Check to see if out of space
-			if (new_index == -1) {
-                fs_print("Disk space unavailable\n");
-				break;
-			}
+	uint16_t *entry = (uint16_t*)fat_shadow[fat_i] + index % (BLOCK_SIZE / 2);
+	bool changed = *entry != ((uint16_t*)fat)[index];
+	*entry = ((uint16_t*)fat)[index];
+	return changed;
+}
 
-			*data_index_ptr = new_index;
-			*fat_entry_at_index(new_index) = FAT_EOC;
-        }
+// Returns -1, leaving the entry as it was, if its FAT block cannot be read
+int fat_set_entry(int index, uint32_t value) {
+	// The reference counts are computed from the FAT as it was before any
+	// change, which they then follow
+	if (fat_refs && !fat_refs_ready && superblock->clones) {
+		fat_refs_get();
+	}
 
-        size_t blockLowerBound = blocksIteratedOver * BLOCK_SIZE;
-        size_t blockUpperBound = ((blocksIteratedOver + 1) * BLOCK_SIZE) - 1;
+	if (!fat_entry_loaded(index)) {
+		return -1;
+	}
 
-        // If byte upper bound is greater than starting byte, we know that
-        // this block intersects with the bytes that we are trying to read
-        if (blockUpperBound >= startingByte) {
-            int start_write, end_write;
+	int fat_i = fat_block_of(index);
+	if (!fat_dirty[fat_i]) {
+		// Outside a batch, the block is written back before the call
+		// returns
+		if (batch_depth > 0) {
+			fat_shadow_save(fat_i);
+		}
+		fat_dirty[fat_i] = 1;
+		fat_dirty_count++;
+	}
 
-            if (blockLowerBound < startingByte) {
-                // The start of the section to read is in the middle of the block
-                start_write = startingByte - blockLowerBound;
-            } else {
-                start_write = 0;
-            }
+	if (layout.fat32) {
+		((uint32_t*)fat)[index] = value;
+	} else {
+		((uint16_t*)fat)[index] = value;
+	}
 
-            if (blockUpperBound > finalByte) {
-                // The end of the section to read is in the middle of the block
-                end_write = finalByte - blockLowerBound;
-            } else {
-                end_write = BLOCK_SIZE - 1;
-            }
+	if (value == 0 && dedup_keys) {
+		dedup_keys[index] = 0;
+	}
 
-			int block_bytes_written = end_write - start_write + 1;
+	return 0;
+}
 
-            if (start_write == 0 && end_write == BLOCK_SIZE - 1) {
-                fs_print("Direct write\n");
-                // Perfect case
-                FAILABLE(block_write(superblock->num_fat + 2 + *data_index_ptr, buf + total_bytes_written));
-            } else {
-                fs_print("Bounce write\n");
-                // We're don't need the whole block so we use a bounce buffer
-                FAILABLE(block_read(superblock->num_fat + 2 + *data_index_ptr, bounce_buffer));
-                memcpy(bounce_buffer + start_write, buf + total_bytes_written, block_bytes_written);
-                FAILABLE(block_write(superblock->num_fat + 2 + *data_index_ptr, bounce_buffer));
-            }
+int fat_block_write(int fat_i) {
+	if (fat_dirty[fat_i]) {
+		fat_dirty[fat_i] = 0;
+		fat_dirty_count--;
+	}
+	fat_shadowed[fat_i] = 0;
 
-            total_bytes_written += block_bytes_written;
-            if (blockUpperBound > finalByte) { // If we have done the correct amount of writing, we terminate.
-                break;
-            }
-        }
+	return csum_block_write(1 + fat_i, (uint8_t*)fat + fat_i * BLOCK_SIZE);
+}
 
-        data_index_ptr = fat_entry_at_index(*data_index_ptr);
-        blocksIteratedOver++;
-    }
+void fd_table_create() {
+	fd_table = NULL;
+	fd_table_size = 0;
+	fd_free = -1;
+	fd_open_count = 0;
+}
 
-    free(bounce_buffer);
+// Doubles the descriptor table, adding the new entries to the free list with
+// the lowest descriptor first
+int fd_table_grow() {
+	int i;
+	int size = fd_table_size ? 2 * fd_table_size : FS_OPEN_MAX_COUNT;
 
-	fs_backup();
+	struct fd_entry *table = (struct fd_entry*)realloc(fd_table, size * sizeof(struct fd_entry));
+	if (!table) {
+		return -1;
+	}
 
-	// Increment offset in fd_table
-	fd_table[fd].offset += total_bytes_written;
-	if (startingByte + total_bytes_written > root_dir->entries[fd_table[fd].file_i].fsize) {
-		root_dir->entries[fd_table[fd].file_i].fsize = startingByte + total_bytes_written;
+	for (i = size - 1; i >= fd_table_size; --i) {
+		table[i].file = NULL;
+		table[i].next_free = fd_free;
+		fd_free = i;
 	}
 
-	return total_bytes_written;
+	fd_table = table;
+	fd_table_size = size;
+	return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_set_open_max(size_t max)
 {
-	FAILABLE(verify_fd(fd));
+	FS_LOCKED();
 
-   	uint16_t data_index = root_dir->entries[fd_table[fd].file_i].first_block_i;
+	if (max == 0 || max > INT32_MAX) {
+		return -1;
+	}
 
-    size_t startingByte = fd_table[fd].offset;
-    size_t finalByte = startingByte + count - 1;
+	fd_open_max = max;
+	return 0;
+}
 
+// Writes the checksum region of a fresh disk, on which every covered block is
+// zeroed except the first FAT block
+int csum_format(size_t csum_i, size_t num_csum, uint32_t fat_sum) {
+	size_t i, j;
 
-	if (finalByte > root_dir->entries[fd_table[fd].file_i].fsize - 1) {
-        finalByte = root_dir->entries[fd_table[fd].file_i].fsize - 1;
-    }
+	uint32_t *region = (uint32_t*)malloc(BLOCK_SIZE);
+	uint8_t *zeros = (uint8_t*)calloc(1, BLOCK_SIZE);
+	if (!region || !zeros) {
+		free(region);
+		free(zeros);
+		return -1;
+	}
 
-	uint8_t *bounce_buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+	uint32_t zero_sum = crc32c(0, zeros, BLOCK_SIZE);
+	int ret = 0;
+	for (i = 0; i < num_csum && ret == 0; ++i) {
+		for (j = 0; j < CSUM_ENTRIES; ++j) {
+			region[j] = zero_sum;
+		}
+		if (i == 0) {
+			region[1] = fat_sum;
+		}
+		ret = block_write(csum_i + i, region);
+	}
 
-    size_t blocksIteratedOver = 0;
-    size_t total_bytes_read = 0;
-	while (data_index != FAT_EOC) {
-        uint32_t blockLowerBound = blocksIteratedOver * BLOCK_SIZE;
-        uint32_t blockUpperBound = ((blocksIteratedOver + 1) * BLOCK_SIZE) - 1;
+	free(region);
+	free(zeros);
+	return ret;
+}
 
-		// If byte upper bound is greater than starting byte, we know that
-		// this block intersects with the bytes that we are trying to read
-		if (blockUpperBound >= startingByte) {
-            int start_read, end_read;
+int fs_format(const char *diskname, size_t data_blocks,
+	      const struct fs_format_options *options)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_FORMAT, -1, 0, data_blocks * BLOCK_SIZE);
+	STAT_NAMES(diskname, NULL);
 
-			if (blockLowerBound < startingByte) {
-				// The start of the section to read is in the middle of the block
-				start_read = startingByte - blockLowerBound;
-			} else {
-				start_read = 0;
-			}
+	int fat_bits = options ? options->fat_bits : 0;
+	int csum_flags = options ? options->checksums : 0;
+	int preallocate = options ? options->preallocate : 0;
 
-			if (blockUpperBound > finalByte) {
-				// The end of the section to read is in the middle of the block
-				end_read = finalByte - blockLowerBound;
-			} else {
-				end_read = BLOCK_SIZE - 1;
-			}
+	if (is_disk_opened()) {
+        fs_print("Cannot format while mounted\n");
+		return -1;
+	}
 
-			if (start_read == 0 && end_read == BLOCK_SIZE - 1) {
-                fs_print("Direct read\n");
-				// Perfect case
-				FAILABLE(block_read(superblock->num_fat + 2 + data_index, buf + total_bytes_read));
-			} else {
-                fs_print("Bounce read\n");
-				// We're don't need the whole block so we use a bounce buffer
-				FAILABLE(block_read(superblock->num_fat + 2 + data_index, bounce_buffer));
-				memcpy(buf + total_bytes_read, bounce_buffer + start_read, end_read - start_read + 1);
-			}
+	// Data checksums only make sense along with metadata checksums
+	if (csum_flags & FS_CSUM_DATA) {
+		csum_flags |= FS_CSUM_METADATA;
+	}
 
-			total_bytes_read += end_read - start_read + 1;
+	size_t fat16_blocks = (data_blocks + 2047) / 2048;
+	size_t csum16_blocks = csum_region_blocks(csum_flags, 2 + fat16_blocks, data_blocks);
+	bool fits_fat16 = data_blocks < FAT16_EOC && 2 + fat16_blocks + data_blocks + csum16_blocks <= 0xFFFF;
 
-			if (blockUpperBound > finalByte) {
-				break;
-			}
+	if (fat_bits == 0) {
+		fat_bits = fits_fat16 ? 16 : 32;
+	}
+	if (data_blocks == 0 || (fat_bits == 16 && !fits_fat16) || (fat_bits != 16 && fat_bits != 32) ||
+		(csum_flags & ~(FS_CSUM_METADATA | FS_CSUM_DATA))) {
+        fs_print("Invalid format options\n");
+		return -1;
+	}
+
+	size_t num_fat = (data_blocks + BLOCK_SIZE / (fat_bits / 8) - 1) / (BLOCK_SIZE / (fat_bits / 8));
+	size_t num_csum = csum_region_blocks(csum_flags, 2 + num_fat, data_blocks);
+	size_t num_blocks_disk = 2 + num_fat + data_blocks + num_csum;
+	if (num_blocks_disk > INT32_MAX) {
+        fs_print("Invalid format options\n");
+		return -1;
+	}
+
+	struct superblock *sb = (struct superblock*)calloc(1, sizeof(struct superblock));
+	if (!sb) {
+		return -1;
+	}
+
+	if (fat_bits == 16) {
+		memcpy(sb->signature, "ECS150FS", 8);
+		sb->num_blocks_disk = num_blocks_disk;
+		sb->root_i = num_fat + 1;
+		sb->data_i = num_fat + 2;
+		sb->num_data = data_blocks;
+		sb->num_fat = num_fat;
+	} else {
+		memcpy(sb->signature, "ECS150F2", 8);
+		sb->num_blocks_disk32 = num_blocks_disk;
+		sb->root_i32 = num_fat + 1;
+		sb->data_i32 = num_fat + 2;
+		sb->num_data32 = data_blocks;
+		sb->num_fat32 = num_fat;
+	}
+
+	if (csum_flags) {
+		sb->csum_magic = CSUM_MAGIC;
+		sb->csum_flags = csum_flags;
+		sb->csum_i = 2 + num_fat + data_blocks;
+		sb->num_csum = num_csum;
+		sb->csum_sb = crc32c(0, sb, BLOCK_SIZE);
+	}
+
+	int ret = -1;
+	if (block_disk_create(diskname, num_blocks_disk, preallocate) == 0 && block_disk_open(diskname) == 0) {
+		ret = block_write(0, sb);
+
+		// The first data block is reserved, its FAT entry is the end of chain
+		// marker so that index 0 can mean free
+		memset(sb, 0, sizeof(struct superblock));
+		if (fat_bits == 16) {
+			((uint16_t*)sb)[0] = FAT16_EOC;
+		} else {
+			((uint32_t*)sb)[0] = FAT_EOC;
+		}
+		if (ret == 0) {
+			ret = block_write(1, sb);
+		}
+		if (ret == 0 && csum_flags) {
+			ret = csum_format(2 + num_fat + data_blocks, num_csum, crc32c(0, sb, BLOCK_SIZE));
 		}
 
-		data_index = *fat_entry_at_index(data_index);
-		blocksIteratedOver++;
+		block_disk_close();
 	}
 
-	free(bounce_buffer);
+	free(sb);
 
-	// Increment offset in fd_table
-	fd_table[fd].offset += total_bytes_read;
+	return ret;
+}
 
-	return total_bytes_read;
-}
\ No newline at end of file
+void fs_release() {
+	int i;
+
+	fat_prefetch_join();
+	io_pool_join();
+
+	batch_depth = 0;
+	batch_dirty = false;
+
+	free(fat);
+	fat = NULL;
+
+	free(fat_loaded);
+	fat_loaded = NULL;
+	free(fat_dirty);
+	fat_dirty = NULL;
+
+	for (i = 0; fat_shadow && i < layout.num_fat; i++) {
+		free(fat_shadow[i]);
+	}
+	free(fat_shadow);
+	fat_shadow = NULL;
+	free(fat_shadowed);
+	fat_shadowed = NULL;
+
+	free(csums);
+	csums = NULL;
+	free(csum_loaded);
+	csum_loaded = NULL;
+	free(csum_dirty);
+	csum_dirty = NULL;
+	free(csum_stale);
+	csum_stale = NULL;
+
+	free(fat_refs);
+	fat_refs = NULL;
+
+	free(dedup_keys);
+	dedup_keys = NULL;
+	free(dedup_table);
+	dedup_table = NULL;
+	dedup_cap = 0;
+	dedup_len = 0;
+
+	free(hole_refs);
+	hole_refs = NULL;
+	hole_refs_ready = false;
+	hole_refs_partial = false;
+
+	free(chunk_cache);
+	chunk_cache = NULL;
+
+	free(frag_list);
+	frag_list = NULL;
+	frag_list_len = 0;
+	frag_list_ready = false;
+
+	free(frag_cache);
+	frag_cache = NULL;
+	frag_cache_index = -1;
+
+	free(superblock);
+	superblock = NULL;
+
+	free(root_dir);
+	root_dir = NULL;
+	free(root_block);
+	root_block = NULL;
+
+	free(fd_table);
+	fd_table = NULL;
+	fd_table_size = 0;
+
+	while (open_files) {
+		struct open_file *next = open_files->next;
+		free(open_files);
+		open_files = next;
+	}
+	free(open_file_table);
+	open_file_table = NULL;
+	open_file_buckets = 0;
+	open_file_count = 0;
+}
+
+int fs_mount(const char *diskname)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_MOUNT, -1, 0, 0);
+	STAT_NAMES(diskname, NULL);
+
+	FAILABLE(block_disk_open(diskname));
+
+	if (superblock_read() == -1 || fat_read() == -1 ||
+		fat_refs_build() == -1 || dedup_start() == -1 || root_dir_read() == -1) {
+		fs_release();
+		block_disk_close();
+		return -1;
+	}
+
+	fat_prefetch_start();
+	fd_table_create();
+
+	return 0;
+}
+
+// Writes back the root directory with the entry of the given slot, or all of
+// its entries if slot is -1
+int root_dir_write(int slot) {
+	int i;
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (slot == -1 || slot == i) {
+			file_entry_store(root_block->entries + i, root_dir->entries + i);
+		}
+	}
+
+	return csum_block_write(layout.root_i, root_block);
+}
+
+// Whether a root directory entry changed since the root directory was written
+bool root_entry_dirty(int slot) {
+	struct dir_entry entry;
+
+	file_entry_store(&entry, root_dir->entries + slot);
+	return memcmp(&entry, root_block->entries + slot, sizeof(struct dir_entry)) != 0;
+}
+
+void fs_backup() {
+	if (batch_depth > 0) {
+		batch_dirty = true;
+		return;
+	}
+
+	STAT_TIMED(FS_OP_BACKUP, -1, 0, 0);
+
+	int i = 1;
+
+	stat_add(STAT_BACKUPS, 1);
+	stat_add(STAT_BACKUP_BLOCKS, fat_dirty_count + 1);
+
+	// Only FAT blocks that changed need writing back
+	for (i = 0; i < layout.num_fat && fat_dirty_count > 0; i++) {
+		if (fat_dirty[i]) {
+			fat_block_write(i);
+		}
+	}
+
+	root_dir_write(-1);
+
+	csum_flush();
+}
+
+int fs_umount(void)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_UMOUNT, -1, 0, 0);
+
+	if (!is_disk_opened()) {
+        fs_print("Cannot unmount, disk not open\n");
+		return -1;
+	}
+
+	if (fd_open_count != 0) {
+        fs_print("Cannot unmount, file table not empty\n");
+		return -1;
+	}
+
+	// Queued requests would otherwise run against the next disk mounted
+	if (async_pending() != 0) {
+        fs_print("Cannot unmount, asynchronous requests pending\n");
+		return -1;
+	}
+
+	// An unfinished batch ends with the mount
+	batch_depth = 0;
+	fs_backup();
+	csum_settle();
+
+	fs_release();
+
+	FAILABLE(block_disk_close());
+
+	return 0;
+}
+
+int fs_batch_begin(void)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_BATCH_BEGIN, -1, 0, 0);
+
+	if (!is_disk_opened()) {
+        fs_print("fs not opened\n");
+		return -1;
+	}
+
+	batch_depth++;
+	return 0;
+}
+
+int fs_batch_end(void)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_BATCH_END, -1, 0, 0);
+
+	if (!is_disk_opened() || batch_depth == 0) {
+        fs_print("No batch to end\n");
+		return -1;
+	}
+
+	if (--batch_depth == 0 && batch_dirty) {
+		batch_dirty = false;
+		fs_backup();
+	}
+
+	return 0;
+}
+
+int num_fat_free() {
+	int i;
+    int num_free;
+
+	num_free = 0;
+	for (i = 0; i < layout.num_data; i++) {
+		if (fat_entry_at_index(i) == 0) {
+			num_free += 1;
+		}
+	}
+
+	return num_free;
+}
+
+int num_files_free() {
+	int i, num_free;
+
+	num_free = 0;
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root_dir->entries[i].fname[0] == '\0') {
+			num_free += 1;
+		}
+	}
+
+	return num_free;
+}
+
+int fs_info(void)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_INFO, -1, 0, 0);
+
+	if (!is_disk_opened()) {
+		return -1;
+	}
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%d\n", layout.num_blocks_disk);
+	printf("fat_blk_count=%d\n", layout.num_fat);
+	printf("rdir_blk=%d\n", layout.root_i);
+	printf("data_blk=%d\n", layout.data_i);
+	printf("data_blk_count=%d\n", layout.num_data);
+	printf("fat_free_ratio=%d/%d\n", num_fat_free(), layout.num_data);
+	printf("rdir_free_ratio=%d/%d\n", num_files_free(), FS_FILE_MAX_COUNT);
+
+	return fat_checked(0);
+}
+
+int first_free_fat_index() {
+	int i = 0;
+
+	stat_add(STAT_ALLOC_SCANS, 1);
+	for (i = 0; i < layout.num_data; ++i) {
+		if (fat_entry_at_index(i) == 0) {
+			stat_add(STAT_ALLOC_SCAN_ENTRIES, i + 1);
+			return i;
+		}
+		if (fat_error) {
+			// The free blocks of the unreadable FAT block are unknown
+			return -1;
+		}
+	}
+
+	stat_add(STAT_ALLOC_SCAN_ENTRIES, layout.num_data);
+	return -1;
+}
+
+
+bool has_free_blocks(int count) {
+	int i;
+	for (i = 0; i < layout.num_data && count > 0; ++i) {
+		if (fat_entry_at_index(i) == 0) {
+			count -= 1;
+		}
+	}
+
+	return count <= 0;
+}
+
+// Frees a chain, stopping at the first block that is still shared with a clone.
+// Returns the number of blocks freed
+size_t free_chain(uint32_t data_index) {
+	size_t freed = 0;
+
+	while (data_index != FAT_EOC) {
+		uint32_t next_index = fat_next(data_index);
+		fat_set_entry(data_index, 0);
+		freed++;
+
+		if (next_index != FAT_EOC && fat_ref_add(next_index, -1) > 0) {
+			break;
+		}
+		data_index = next_index;
+	}
+
+	return freed;
+}
+
+// Points the link preceding a block (the file entry for the head, or the FAT
+// entry of the previous block) at new_index
+void link_block(struct file_entry *file, uint32_t prev_index, uint32_t new_index) {
+	if (prev_index == FAT_EOC) {
+		file->first_block_i = new_index;
+	} else {
+		fat_set_entry(prev_index, new_index);
+		fat_ref_add(new_index, 1);
+	}
+}
+
+// Returns the data index of the nth block of a chain, or FAT_EOC
+uint32_t chain_index_at(uint32_t data_index, size_t n) {
+	while (n-- > 0 && data_index != FAT_EOC) {
+		data_index = fat_next(data_index);
+	}
+
+	return data_index;
+}
+
+// Frees the blocks of the chain of a file past its first num_blocks blocks
+void chain_truncate(struct file_entry *file, size_t num_blocks) {
+	uint32_t data_index;
+
+	if (num_blocks == 0) {
+		data_index = file->first_block_i;
+		file->first_block_i = FAT_EOC;
+	} else {
+		uint32_t last_index = chain_index_at(file->first_block_i, num_blocks - 1);
+		if (last_index == FAT_EOC) {
+			return;
+		}
+		data_index = fat_next(last_index);
+		if (data_index == FAT_EOC) {
+			return;
+		}
+		fat_set_entry(last_index, FAT_EOC);
+		fat_ref_add(data_index, -1);
+	}
+
+	// Blocks shared with a clone are left to it
+	if (data_index != FAT_EOC && fat_ref_count(data_index) == 0) {
+		free_chain(data_index);
+	}
+}
+
+// Returns -1 if filename already in root_dir
+int new_file_index(const char* filename) {
+	int i;
+	int file_index = -1;
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (strcmp((const char*) root_dir->entries[i].fname, filename) == 0) {
+			return -1;
+		}
+
+		if (file_index == -1 && root_dir->entries[i].fname[0] == '\0') {
+			file_index = i;
+		}
+	}
+
+	return file_index;
+}
+
+// Returns -1 if file not found
+int first_index_of_filename(const char* filename) {
+	int i;
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (strcmp((const char*) root_dir->entries[i].fname, filename) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void create_file(struct file_entry *file, const char *filename) {
+	memset(file, 0, sizeof(struct file_entry));
+	strcpy((char * restrict) file->fname, filename);
+	file->fsize = 0;
+	file->first_block_i = FAT_EOC;
+}
+
+struct open_file** open_file_bucket(uint32_t dir_i, int slot) {
+	uint64_t key = ((uint64_t)dir_i << 32) | (uint32_t)slot;
+
+	return &open_file_table[((key * 0x9E3779B97F4A7C15ull) >> 32) & (open_file_buckets - 1)];
+}
+
+struct open_file* open_file_find(const struct file_ref *ref) {
+	struct open_file *file;
+
+	if (!open_file_buckets) {
+		return NULL;
+	}
+
+	for (file = *open_file_bucket(ref->dir_i, ref->slot); file; file = file->hash_next) {
+		if (file->ref.dir_i == ref->dir_i && file->ref.slot == ref->slot) {
+			return file;
+		}
+	}
+
+	return NULL;
+}
+
+void open_file_hash(struct open_file *file) {
+	struct open_file **bucket = open_file_bucket(file->ref.dir_i, file->ref.slot);
+
+	file->hash_next = *bucket;
+	*bucket = file;
+}
+
+void open_file_unhash(struct open_file *file) {
+	struct open_file **link = open_file_bucket(file->ref.dir_i, file->ref.slot);
+
+	while (*link != file) {
+		link = &(*link)->hash_next;
+	}
+	*link = file->hash_next;
+}
+
+// Doubles the table of open files, at least one bucket per open file
+int open_file_grow() {
+	size_t buckets = open_file_buckets ? 2 * open_file_buckets : 64;
+	struct open_file **table = (struct open_file**)calloc(buckets, sizeof(struct open_file*));
+	if (!table) {
+		return -1;
+	}
+
+	free(open_file_table);
+	open_file_table = table;
+	open_file_buckets = buckets;
+
+	struct open_file *file;
+	for (file = open_files; file; file = file->next) {
+		open_file_hash(file);
+	}
+
+	return 0;
+}
+
+int open_file_add(struct open_file *file) {
+	if (open_file_count >= open_file_buckets) {
+		FAILABLE(open_file_grow());
+	}
+
+	file->prev = NULL;
+	file->next = open_files;
+	if (open_files) {
+		open_files->prev = file;
+	}
+	open_files = file;
+	open_file_hash(file);
+	open_file_count++;
+
+	return 0;
+}
+
+void open_file_remove(struct open_file *file) {
+	open_file_unhash(file);
+	if (file->prev) {
+		file->prev->next = file->next;
+	} else {
+		open_files = file->next;
+	}
+	if (file->next) {
+		file->next->prev = file->prev;
+	}
+	open_file_count--;
+}
+
+// Drops the last block remembered for a file whose chain is changed other than
+// by fs_write()
+void open_file_forget_tail(const struct file_ref *ref) {
+	struct open_file *file = open_file_find(ref);
+
+	if (file) {
+		file->tail_i = FAT_EOC;
+	}
+}
+
+// Mixes the sum of a block into a key. The splitmix64 finalizer, never 0
+uint64_t dedup_mix(uint64_t key, uint32_t sum) {
+	key ^= sum;
+	key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ull;
+	key = (key ^ (key >> 27)) * 0x94D049BB133111EBull;
+	key ^= key >> 31;
+
+	return key ? key : 1;
+}
+
+// Slot of the table holding key, or the free slot where it would go
+struct dedup_slot* dedup_slot_find(uint64_t key) {
+	size_t i = key & (dedup_cap - 1);
+
+	while (dedup_table[i].key && dedup_table[i].key != key) {
+		i = (i + 1) & (dedup_cap - 1);
+	}
+
+	return &dedup_table[i];
+}
+
+// Rebuilds the table with room to spare, dropping the stale entries
+int dedup_grow() {
+	size_t i, live = 0, old_cap = dedup_cap;
+	struct dedup_slot *old_table = dedup_table;
+
+	for (i = 0; i < old_cap; ++i) {
+		if (old_table[i].key && dedup_keys[old_table[i].block] == old_table[i].key) {
+			live++;
+		}
+	}
+
+	size_t cap = DEDUP_TABLE_MIN;
+	while (cap < (live + 1) * 2) {
+		cap *= 2;
+	}
+
+	struct dedup_slot *table = (struct dedup_slot*)calloc(cap, sizeof(struct dedup_slot));
+	if (!table) {
+		return -1;
+	}
+
+	dedup_table = table;
+	dedup_cap = cap;
+	dedup_len = live;
+	for (i = 0; i < old_cap; ++i) {
+		if (old_table[i].key && dedup_keys[old_table[i].block] == old_table[i].key) {
+			*dedup_slot_find(old_table[i].key) = old_table[i];
+		}
+	}
+	free(old_table);
+
+	return 0;
+}
+
+void dedup_insert(uint64_t key, uint32_t block) {
+	if ((dedup_len + 1) * 4 > dedup_cap * 3 && dedup_grow() == -1) {
+		return;
+	}
+
+	struct dedup_slot *slot = dedup_slot_find(key);
+	if (!slot->key) {
+		dedup_len++;
+	}
+	slot->key = key;
+	slot->block = block;
+	dedup_keys[block] = key;
+}
+
+// Returns the block indexed under key, or FAT_EOC
+uint32_t dedup_lookup(uint64_t key) {
+	if (!dedup_cap) {
+		return FAT_EOC;
+	}
+
+	struct dedup_slot *slot = dedup_slot_find(key);
+	if (!slot->key || dedup_keys[slot->block] != key) {
+		return FAT_EOC;
+	}
+
+	return slot->block;
+}
+
+// FNV-1a, spreads short and similar names well enough
+uint32_t name_hash(const char *name) {
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash = (hash ^ (uint8_t)*name++) * 16777619u;
+	}
+
+	return hash;
+}
+
+int dir_num_slots(const struct file_entry *dir) {
+	return dir->fsize / sizeof(struct dir_entry);
+}
+
+int dir_first_slot(const char *name, int num_slots) {
+	return 1 + name_hash(name) % (num_slots - 1);
+}
+
+// Looks name up in the hash table of a subdirectory. Returns the slot holding
+// it, or -1 with *free_slot set to the slot it would be added at
+int dir_probe(const struct file_entry *dir, const char *name, struct file_entry *found, int *free_slot) {
+	int i;
+	int num_slots = dir_num_slots(dir);
+	int slot = dir_first_slot(name, num_slots);
+	int block_i = -1;
+
+	*free_slot = -1;
+
+	struct dir_block *block = (struct dir_block*)malloc(sizeof(struct dir_block));
+	if (!block) {
+		return -1;
+	}
+
+	for (i = 0; i < num_slots - 1; ++i) {
+		if (slot / (int)DIR_SLOTS != block_i) {
+			block_i = slot / DIR_SLOTS;
+			uint32_t data_index = chain_index_at(dir->first_block_i, block_i);
+			if (data_index == FAT_EOC || csum_block_read(layout.data_i + data_index, block) == -1) {
+				*free_slot = -1;
+				break;
+			}
+		}
+
+		struct dir_entry *entry = block->entries + slot % DIR_SLOTS;
+		if (entry->fname[0] == '\0') {
+			if (*free_slot == -1) {
+				*free_slot = slot;
+			}
+			if (!(entry->flags & FILE_DELETED)) {
+				break;
+			}
+		} else if (strncmp((const char*)entry->fname, name, FS_FILENAME_LEN) == 0) {
+			file_entry_load(found, entry);
+			free(block);
+			return slot;
+		}
+
+		slot = slot + 1 < num_slots ? slot + 1 : 1;
+	}
+
+	free(block);
+	return -1;
+}
+
+// Stores an entry in a slot of a subdirectory. Sets *was_deleted if the slot
+// held a deleted entry
+int dir_slot_store(uint32_t dir_i, int slot, const struct file_entry *file, bool *was_deleted) {
+	uint32_t data_index = chain_index_at(dir_i, slot / DIR_SLOTS);
+	if (data_index == FAT_EOC) {
+		return -1;
+	}
+
+	struct dir_block *block = (struct dir_block*)malloc(sizeof(struct dir_block));
+	if (!block) {
+		return -1;
+	}
+
+	int ret = csum_block_read(layout.data_i + data_index, block);
+	if (ret == 0) {
+		struct dir_entry *entry = block->entries + slot % DIR_SLOTS;
+		if (was_deleted) {
+			*was_deleted = entry->fname[0] == '\0' && (entry->flags & FILE_DELETED);
+		}
+		file_entry_store(entry, file);
+		ret = csum_block_write(layout.data_i + data_index, block);
+	}
+
+	free(block);
+	return ret;
+}
+
+// Reads the header of a subdirectory, then adds the given deltas to its counts
+// and writes it back if any is non-zero
+int dir_header_update(uint32_t dir_i, struct dir_header *header, int count, int tombstones) {
+	struct dir_block *block = (struct dir_block*)malloc(sizeof(struct dir_block));
+	if (!block) {
+		return -1;
+	}
+
+	int ret = csum_block_read(layout.data_i + dir_i, block);
+	struct dir_header *stored = (struct dir_header*)block->entries;
+	if (ret == 0 && (count || tombstones)) {
+		stored->count += count;
+		stored->tombstones += tombstones;
+		ret = csum_block_write(layout.data_i + dir_i, block);
+	}
+	if (ret == 0 && header) {
+		*header = *stored;
+	}
+
+	free(block);
+	return ret;
+}
+
+// Stores a file entry back where it came from, and into its open file if any
+int file_ref_store(const struct file_ref *ref) {
+	struct open_file *file = open_file_find(ref);
+	if (file && &file->ref != ref) {
+		file->ref.entry = ref->entry;
+	}
+
+	if (ref->dir_i == FAT_EOC) {
+		root_dir->entries[ref->slot] = ref->entry;
+		return 0;
+	}
+
+	return dir_slot_store(ref->dir_i, ref->slot, &ref->entry, NULL);
+}
+
+// Rehashes the entries of a subdirectory into a table of new_blocks blocks,
+// dropping deleted ones
+int dir_rehash(struct file_ref *dir, int new_blocks) {
+	int i;
+	int old_blocks = dir->entry.fsize / BLOCK_SIZE;
+	int num_slots = new_blocks * DIR_SLOTS;
+
+	if (!has_free_blocks(new_blocks - old_blocks)) {
+        fs_print("Disk space unavailable\n");
+		return -1;
+	}
+
+	struct dir_entry *old_table = (struct dir_entry*)malloc(old_blocks * BLOCK_SIZE);
+	struct dir_entry *table = (struct dir_entry*)calloc(num_slots, sizeof(struct dir_entry));
+	if (!old_table || !table) {
+		free(old_table);
+		free(table);
+		return -1;
+	}
+
+	uint32_t prev_index = FAT_EOC;
+	uint32_t data_index = dir->entry.first_block_i;
+	for (i = 0; i < old_blocks && data_index != FAT_EOC; ++i) {
+		if (csum_block_read(layout.data_i + data_index, old_table + i * DIR_SLOTS) == -1) {
+			free(old_table);
+			free(table);
+			return -1;
+		}
+		prev_index = data_index;
+		data_index = fat_next(data_index);
+	}
+
+	struct dir_header *header = (struct dir_header*)table;
+	for (i = 1; i < old_blocks * (int)DIR_SLOTS; ++i) {
+		if (old_table[i].fname[0] == '\0') {
+			continue;
+		}
+
+		int slot = dir_first_slot((const char*)old_table[i].fname, num_slots);
+		while (table[slot].fname[0] != '\0') {
+			slot = slot + 1 < num_slots ? slot + 1 : 1;
+		}
+		table[slot] = old_table[i];
+		header->count++;
+	}
+	free(old_table);
+
+	for (i = old_blocks; i < new_blocks; ++i) {
+		int new_index = first_free_fat_index();
+		fat_set_entry(new_index, FAT_EOC);
+		link_block(&dir->entry, prev_index, new_index);
+		prev_index = new_index;
+	}
+
+	data_index = dir->entry.first_block_i;
+	for (i = 0; i < new_blocks; ++i) {
+		if (csum_block_write(layout.data_i + data_index, table + i * DIR_SLOTS) == -1) {
+			free(table);
+			return -1;
+		}
+		data_index = fat_next(data_index);
+	}
+
+	// The entries of open files have moved
+	struct open_file *file;
+	for (file = open_files; file; file = file->next) {
+		if (file->ref.dir_i != dir->entry.first_block_i) {
+			continue;
+		}
+
+		int slot = dir_first_slot((const char*)file->ref.entry.fname, num_slots);
+		while (strncmp((const char*)table[slot].fname, (const char*)file->ref.entry.fname, FS_FILENAME_LEN) != 0) {
+			slot = slot + 1 < num_slots ? slot + 1 : 1;
+		}
+		open_file_unhash(file);
+		file->ref.slot = slot;
+		open_file_hash(file);
+	}
+	free(table);
+
+	dir->entry.fsize = (uint64_t)new_blocks * BLOCK_SIZE;
+	return file_ref_store(dir);
+}
+
+// Finds the entry named name in a directory
+int dir_find(const struct file_ref *dir, const char *name, struct file_ref *found) {
+	if (dir->slot == -1) {
+		int file_index = first_index_of_filename(name);
+		FAILABLE(file_index);
+
+		found->entry = root_dir->entries[file_index];
+		found->dir_i = FAT_EOC;
+		found->slot = file_index;
+		return 0;
+	}
+
+	int free_slot;
+	int slot = dir_probe(&dir->entry, name, &found->entry, &free_slot);
+	FAILABLE(slot);
+
+	found->dir_i = dir->entry.first_block_i;
+	found->slot = slot;
+	return 0;
+}
+
+// Adds an entry to a directory, growing a subdirectory whose table is getting
+// full. Fails if the name is taken
+int dir_add(struct file_ref *dir, const struct file_entry *file) {
+	if (dir->slot == -1) {
+		int file_index = new_file_index((const char*)file->fname);
+		FAILABLE(file_index);
+
+		root_dir->entries[file_index] = *file;
+		return 0;
+	}
+
+	struct dir_header header;
+	FAILABLE(dir_header_update(dir->entry.first_block_i, &header, 0, 0));
+
+	// Keep at least a quarter of the slots empty so that probes stay short. The
+	// table doubles unless it is mostly full of deleted entries
+	uint32_t usable = dir_num_slots(&dir->entry) - 1;
+	if ((header.count + header.tombstones + 1) * 4 > usable * 3) {
+		int blocks = dir->entry.fsize / BLOCK_SIZE;
+		FAILABLE(dir_rehash(dir, (header.count + 1) * 2 > usable ? 2 * blocks : blocks));
+	}
+
+	struct file_entry existing;
+	int free_slot;
+	if (dir_probe(&dir->entry, (const char*)file->fname, &existing, &free_slot) != -1 || free_slot == -1) {
+		return -1;
+	}
+
+	bool was_deleted = false;
+	FAILABLE(dir_slot_store(dir->entry.first_block_i, free_slot, file, &was_deleted));
+
+	return dir_header_update(dir->entry.first_block_i, NULL, 1, was_deleted ? -1 : 0);
+}
+
+// Removes an entry from the directory it is stored in
+int dir_remove(const struct file_ref *ref) {
+	if (ref->dir_i == FAT_EOC) {
+		memset(root_dir->entries + ref->slot, 0, sizeof(struct file_entry));
+		return 0;
+	}
+
+	struct file_entry deleted;
+	memset(&deleted, 0, sizeof(struct file_entry));
+	deleted.flags = FILE_DELETED;
+
+	FAILABLE(dir_slot_store(ref->dir_i, ref->slot, &deleted, NULL));
+
+	return dir_header_update(ref->dir_i, NULL, -1, 1);
+}
+
+void root_ref(struct file_ref *dir) {
+	memset(dir, 0, sizeof(struct file_ref));
+	dir->entry.flags = FILE_DIR;
+	dir->dir_i = FAT_EOC;
+	dir->slot = -1;
+}
+
+// Resolves every component of a path but the last one, which must name an
+// entry of the resulting directory, and copies that last component into name.
+// Components are separated by '/', a leading '/' is optional
+int path_parent(const char *path, struct file_ref *dir, char *name) {
+	root_ref(dir);
+
+	if (*path == '/') {
+		path++;
+	}
+
+	while (true) {
+		const char *end = strchr(path, '/');
+		size_t len = end ? (size_t)(end - path) : strlen(path);
+		if (len == 0 || len >= FS_FILENAME_LEN) {
+	        fs_print("Invalid path component\n");
+			return -1;
+		}
+
+		memcpy(name, path, len);
+		name[len] = '\0';
+		if (!end) {
+			return 0;
+		}
+
+		struct file_ref child;
+		if (dir_find(dir, name, &child) == -1 || !(child.entry.flags & FILE_DIR)) {
+	        fs_print("No directory %s\n", name);
+			return -1;
+		}
+
+		*dir = child;
+		path = end + 1;
+	}
+}
+
+// Resolves a path to the entry it names, the root directory being "/"
+int path_lookup(const char *path, struct file_ref *ref) {
+	char name[FS_FILENAME_LEN];
+	struct file_ref dir;
+
+	if (strcmp(path, "/") == 0 || *path == '\0') {
+		root_ref(ref);
+		return 0;
+	}
+
+	FAILABLE(path_parent(path, &dir, name));
+
+	return dir_find(&dir, name, ref);
+}
+
+int fs_create(const char *filename)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_CREATE, -1, 0, 0);
+	STAT_NAMES(filename, NULL);
+
+	char name[FS_FILENAME_LEN];
+	struct file_ref dir;
+	struct file_entry file;
+
+	if (!is_disk_opened()) {
+        fs_print("Disk not opened\n");
+		return -1;
+	}
+
+	if (path_parent(filename, &dir, name) == -1) {
+        fs_print("Error creating file: invalid path\n");
+		return -1;
+	}
+
+	create_file(&file, name);
+	if (dir_add(&dir, &file) == -1) {
+        fs_print("Error creating file: %s not unique\n", filename);
+		return -1;
+	}
+
+	fs_backup();
+	
+	return fat_checked(0);
+}
+
+int fs_mkdir(const char *dirname)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_MKDIR, -1, 0, 0);
+	STAT_NAMES(dirname, NULL);
+
+	char name[FS_FILENAME_LEN];
+	struct file_ref dir, existing;
+	struct file_entry file;
+
+	if (!is_disk_opened()) {
+        fs_print("Disk not opened\n");
+		return -1;
+	}
+
+	if (path_parent(dirname, &dir, name) == -1 || dir_find(&dir, name, &existing) == 0) {
+        fs_print("Error creating directory: invalid path or not unique\n");
+		return -1;
+	}
+
+	int new_index = first_free_fat_index();
+	if (new_index == -1) {
+        fs_print("Disk space unavailable\n");
+		return -1;
+	}
+
+	// A fresh table: a zeroed header and only empty slots
+	uint8_t *empty_buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+	if (!empty_buffer || csum_block_write(layout.data_i + new_index, empty_buffer) == -1) {
+		free(empty_buffer);
+		return -1;
+	}
+	free(empty_buffer);
+
+	fat_set_entry(new_index, FAT_EOC);
+
+	create_file(&file, name);
+	file.flags = FILE_DIR;
+	file.fsize = BLOCK_SIZE;
+	file.first_block_i = new_index;
+
+	if (dir_add(&dir, &file) == -1) {
+		fat_set_entry(new_index, 0);
+		return -1;
+	}
+
+	fs_backup();
+
+	return fat_checked(0);
+}
+
+uint32_t frag_mask(int slot, int count) {
+	return (count == 32 ? 0xFFFFFFFF : ((1u << count) - 1)) << slot;
+}
+
+// Returns the first slot of a run of count free slots, or -1
+int frag_find_run(uint32_t used, int count) {
+	int slot;
+	for (slot = 1; slot + count <= FRAG_SLOTS; ++slot) {
+		if (!(used & frag_mask(slot, count))) {
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+void frag_remember(uint32_t data_index, uint32_t used) {
+	int i;
+	for (i = 0; i < frag_list_len; ++i) {
+		if (frag_list[i].data_index == data_index) {
+			break;
+		}
+	}
+
+	if (used == 1) {
+		// Only the header is left, forget about the block
+		if (i < frag_list_len) {
+			frag_list[i] = frag_list[--frag_list_len];
+		}
+		return;
+	}
+
+	if (i == frag_list_len) {
+		struct frag_info *list = (struct frag_info*)realloc(frag_list, (frag_list_len + 1) * sizeof(struct frag_info));
+		if (!list) {
+			return;
+		}
+		frag_list = list;
+		frag_list_len++;
+	}
+
+	frag_list[i].data_index = data_index;
+	frag_list[i].used = used;
+}
+
+// Calls func on every entry of a directory
+int dir_for_each(const struct file_ref *ref, void (*func)(const struct file_entry *entry, void *arg), void *arg) {
+	int i;
+
+	if (ref->slot == -1) {
+		for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (root_dir->entries[i].fname[0] != '\0') {
+				func(root_dir->entries + i, arg);
+			}
+		}
+		return 0;
+	}
+
+	struct dir_block *block = (struct dir_block*)malloc(sizeof(struct dir_block));
+	if (!block) {
+		return -1;
+	}
+
+	uint32_t data_index = ref->entry.first_block_i;
+	while (data_index != FAT_EOC) {
+		if (csum_block_read(layout.data_i + data_index, block) == -1) {
+			free(block);
+			return -1;
+		}
+
+		// Slot 0 of the first block is the header, its name is always empty
+		for (i = 0; i < (int)DIR_SLOTS; i++) {
+			if (block->entries[i].fname[0] != '\0') {
+				struct file_entry entry;
+				file_entry_load(&entry, block->entries + i);
+				func(&entry, arg);
+			}
+		}
+
+		data_index = fat_next(data_index);
+	}
+
+	free(block);
+	return 0;
+}
+
+void frag_list_entry(const struct file_entry *entry, void *arg) {
+	if (entry->flags & FILE_DIR) {
+		struct file_ref dir = { .entry = *entry, .dir_i = FAT_EOC, .slot = 0 };
+		dir_for_each(&dir, frag_list_entry, arg);
+	} else if (entry->flags & FILE_PACKED) {
+		frag_remember(entry->first_block_i, 1 | frag_mask(entry->frag_slot, entry->frag_count));
+	}
+}
+
+// Finds the fragment blocks of every packed file, then takes the slots in use
+// from their headers. A directory that cannot be read only hides its blocks
+void frag_list_build() {
+	struct file_ref root = { .dir_i = FAT_EOC, .slot = -1 };
+	int i;
+
+	frag_list_ready = true;
+	dir_for_each(&root, frag_list_entry, NULL);
+
+	uint8_t *block = (uint8_t*)malloc(BLOCK_SIZE);
+	if (!block) {
+		return;
+	}
+
+	for (i = 0; i < frag_list_len; ++i) {
+		if (frag_list[i].data_index == (uint32_t)frag_cache_index) {
+			frag_list[i].used = ((struct frag_header*)frag_cache)->used;
+		} else if (csum_block_read(layout.data_i + frag_list[i].data_index, block) == 0) {
+			frag_list[i].used = ((struct frag_header*)block)->used;
+		}
+	}
+	free(block);
+}
+
+// Loads a fragment block into the fragment cache, or initializes it if fresh
+uint8_t* frag_block_get(uint32_t data_index, bool fresh) {
+	if (!frag_cache) {
+		frag_cache = (uint8_t*)malloc(BLOCK_SIZE);
+		if (!frag_cache) {
+			return NULL;
+		}
+	}
+
+	if (fresh) {
+		memset(frag_cache, 0, BLOCK_SIZE);
+		((struct frag_header*)frag_cache)->used = 1;
+	} else if (frag_cache_index != (int)data_index) {
+		frag_cache_index = -1;
+		if (csum_block_read(layout.data_i + data_index, frag_cache) == -1) {
+			return NULL;
+		}
+		frag_remember(data_index, ((struct frag_header*)frag_cache)->used);
+	}
+
+	frag_cache_index = data_index;
+	return frag_cache;
+}
+
+// Writes back the fragment cache, freeing its block if no slot is in use
+int frag_block_put() {
+	uint32_t data_index = frag_cache_index;
+	uint32_t used = ((struct frag_header*)frag_cache)->used;
+
+	frag_remember(data_index, used);
+
+	if (used == 1) {
+		fat_set_entry(data_index, 0);
+		frag_cache_index = -1;
+		return 0;
+	}
+
+	if (csum_block_write(layout.data_i + data_index, frag_cache) == -1) {
+		frag_cache_index = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Releases the slots of a packed file
+int frag_release(struct file_entry *file) {
+	uint8_t *block = frag_block_get(file->first_block_i, false);
+	if (!block) {
+		return -1;
+	}
+
+	((struct frag_header*)block)->used &= ~frag_mask(file->frag_slot, file->frag_count);
+
+	return frag_block_put();
+}
+
+// Copies the content of a packed file into buf
+int frag_read(struct file_entry *file, uint8_t *buf) {
+	uint8_t *block = frag_block_get(file->first_block_i, false);
+	if (!block) {
+		return -1;
+	}
+
+	memcpy(buf, block + file->frag_slot * FRAG_SLOT_SIZE, file->fsize);
+	return 0;
+}
+
+// Stores len bytes (at most FRAG_MAX) as the content of a file, which must
+// either be packed already or have no blocks. The file's old slots are only
+// released once the data is safely in its new ones
+int frag_store(struct file_entry *file, const uint8_t *data, size_t len) {
+	int i;
+	int count = (len + FRAG_SLOT_SIZE - 1) / FRAG_SLOT_SIZE;
+	bool packed = file->flags & FILE_PACKED;
+	uint32_t old_mask = packed ? frag_mask(file->frag_slot, file->frag_count) : 0;
+	int target = -1, slot = -1;
+	bool fresh = false;
+
+	if (packed) {
+		uint8_t *block = frag_block_get(file->first_block_i, false);
+		if (!block) {
+			return -1;
+		}
+
+		if (count <= file->frag_count) {
+			slot = file->frag_slot;
+		} else {
+			slot = frag_find_run(((struct frag_header*)block)->used & ~old_mask, count);
+		}
+
+		if (slot != -1) {
+			target = file->first_block_i;
+		}
+	}
+
+	if (!frag_list_ready) {
+		frag_list_build();
+	}
+
+	for (i = 0; target == -1 && i < frag_list_len; ++i) {
+		if (packed && frag_list[i].data_index == file->first_block_i) {
+			continue;
+		}
+
+		slot = frag_find_run(frag_list[i].used, count);
+		if (slot != -1) {
+			target = frag_list[i].data_index;
+		}
+	}
+
+	if (target == -1) {
+		target = first_free_fat_index();
+		if (target == -1) {
+            fs_print("Disk space unavailable\n");
+			return -1;
+		}
+		fat_set_entry(target, FAT_EOC);
+		slot = 1;
+		fresh = true;
+	}
+
+	uint8_t *block = frag_block_get(target, fresh);
+	if (!block) {
+		return -1;
+	}
+
+	struct frag_header *header = (struct frag_header*)block;
+	if (packed && target == (int)file->first_block_i) {
+		header->used &= ~old_mask;
+	}
+	header->used |= frag_mask(slot, count);
+	memcpy(block + slot * FRAG_SLOT_SIZE, data, len);
+
+	if (frag_block_put() == -1) {
+		if (fresh) {
+			fat_set_entry(target, 0);
+		}
+		return -1;
+	}
+
+	if (packed && target != (int)file->first_block_i) {
+		frag_release(file);
+	}
+
+	file->flags |= FILE_PACKED;
+	file->first_block_i = target;
+	file->frag_slot = slot;
+	file->frag_count = count;
+
+	return 0;
+}
+
+// Moves the content of a packed file to a regular data block
+int frag_unpack(struct file_entry *file) {
+	uint8_t *buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+	if (!buffer) {
+		return -1;
+	}
+
+	int new_index = first_free_fat_index();
+	if (new_index == -1 || frag_read(file, buffer) == -1 ||
+		csum_block_write(layout.data_i + new_index, buffer) == -1) {
+		free(buffer);
+		return -1;
+	}
+	free(buffer);
+
+	fat_set_entry(new_index, FAT_EOC);
+
+	frag_release(file);
+
+	file->flags &= ~FILE_PACKED;
+	file->first_block_i = new_index;
+	file->frag_slot = 0;
+	file->frag_count = 0;
+
+	return 0;
+}
+
+// Frees the chunks listed in the chunk map of a compressed file
+void clear_chunks(struct file_entry *file) {
+	int i;
+	uint32_t map_index = file->first_block_i;
+
+	struct chunk_map_block *map = (struct chunk_map_block*)malloc(sizeof(struct chunk_map_block));
+
+	while (map_index != FAT_EOC) {
+		if (csum_block_read(layout.data_i + map_index, map) == 0) {
+			for (i = 0; i < (int)CHUNK_MAP_SIZE; i++) {
+				if (map->entries[i].clen) {
+					free_chain(map->entries[i].first_block_i);
+				}
+			}
+		}
+		map_index = fat_next(map_index);
+	}
+
+	free(map);
+}
+
+// Indexes a shared block under the sum of its content, taken from the
+// checksum region when there is one
+void dedup_index_block(uint32_t data_index, uint8_t *buffer) {
+	uint32_t *sum = csum_covers(layout.data_i + data_index) ? csum_entry(layout.data_i + data_index) : NULL;
+	uint32_t value;
+
+	if (sum) {
+		value = *sum;
+	} else if (csum_block_read(layout.data_i + data_index, buffer) == 0) {
+		value = crc32c(0, buffer, BLOCK_SIZE);
+	} else {
+		return;
+	}
+
+	dedup_insert(dedup_mix(DEDUP_SEED, value), data_index);
+}
+
+// Counts the shared entries of the hole maps of a sparse file, indexing their
+// blocks when deduplicating. The buffer holds a map block and a data block
+void hole_refs_entry(const struct file_entry *entry, void *arg) {
+	int i;
+	struct hole_map_block *map = (struct hole_map_block*)arg;
+
+	if (entry->flags & FILE_DIR) {
+		struct file_ref dir = { .entry = *entry, .dir_i = FAT_EOC, .slot = 0 };
+		if (dir_for_each(&dir, hole_refs_entry, arg) == -1) {
+			hole_refs_partial = true;
+		}
+		return;
+	}
+
+	if (!(entry->flags & FILE_SPARSE)) {
+		return;
+	}
+
+	uint32_t map_index;
+	for (map_index = entry->first_block_i; map_index != FAT_EOC; map_index = fat_next(map_index)) {
+		if (csum_block_read(layout.data_i + map_index, map) == -1) {
+			hole_refs_partial = true;
+			return;
+		}
+
+		for (i = 0; i < (int)HOLE_MAP_SIZE; i++) {
+			uint32_t data_index = map->blocks[i] & ~HOLE_SHARED;
+			if (!(map->blocks[i] & HOLE_SHARED) || data_index == 0 || data_index >= (uint32_t)layout.num_data) {
+				continue;
+			}
+
+			if (hole_refs[data_index]++ == 0 && dedup_keys) {
+				dedup_index_block(data_index, (uint8_t*)(map + 1));
+			}
+		}
+	}
+}
+
+// Shared entries can be in any hole map, so they are only counted the first
+// time one is changed, rebuilding the deduplication index on the way
+uint32_t* hole_refs_get() {
+	if (hole_refs_ready) {
+		return hole_refs;
+	}
+
+	hole_refs = (uint32_t*)calloc(layout.num_data, sizeof(uint32_t));
+	uint8_t *buffer = (uint8_t*)malloc(sizeof(struct hole_map_block) + BLOCK_SIZE);
+	if (!hole_refs || !buffer) {
+		free(hole_refs);
+		hole_refs = NULL;
+		free(buffer);
+		return NULL;
+	}
+
+	struct file_ref root = { .dir_i = FAT_EOC, .slot = -1 };
+	hole_refs_ready = true;
+	dir_for_each(&root, hole_refs_entry, buffer);
+	free(buffer);
+
+	return hole_refs;
+}
+
+// Gives back the block of an entry of a hole map, which is only freed once no
+// other map shares it. Returns the number of blocks freed
+size_t hole_release(uint32_t entry) {
+	if (!(entry & HOLE_SHARED)) {
+		return free_chain(entry);
+	}
+
+	uint32_t data_index = entry & ~HOLE_SHARED;
+	uint32_t *refs = hole_refs_get();
+	if (!refs || refs[data_index] == 0) {
+		// Users unknown, the block is left in use
+		return 0;
+	}
+
+	if (--refs[data_index] > 0 || hole_refs_partial) {
+		return 0;
+	}
+
+	return free_chain(data_index);
+}
+
+// Frees the data blocks listed in the hole map of a sparse file
+void clear_holes(struct file_entry *file) {
+	int i;
+	uint32_t map_index = file->first_block_i;
+
+	struct hole_map_block *map = (struct hole_map_block*)malloc(sizeof(struct hole_map_block));
+
+	while (map && map_index != FAT_EOC) {
+		if (csum_block_read(layout.data_i + map_index, map) == 0) {
+			for (i = 0; i < (int)HOLE_MAP_SIZE; i++) {
+				if (map->blocks[i]) {
+					hole_release(map->blocks[i]);
+				}
+			}
+		}
+		map_index = fat_next(map_index);
+	}
+
+	free(map);
+}
+
+void clear_blocks(struct file_entry *file) {
+	uint32_t data_index = file->first_block_i;
+
+	if (file->flags & FILE_PACKED) {
+		frag_release(file);
+		return;
+	}
+
+	if (file->flags & FILE_COMPRESSED) {
+		clear_chunks(file);
+	}
+
+	if (file->flags & FILE_SPARSE) {
+		clear_holes(file);
+	}
+
+	uint8_t *empty_buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+
+	while (data_index != FAT_EOC) {
+		csum_block_write(layout.data_i + data_index, empty_buffer);
+		uint32_t old_index = data_index;
+		data_index = fat_next(data_index);
+		fat_set_entry(old_index, 0);
+
+		// The rest of the chain is still owned by a clone, stop here
+		if (data_index != FAT_EOC && fat_ref_add(data_index, -1) > 0) {
+			break;
+		}
+	}
+
+	free(empty_buffer);
+}
+
+int fs_delete(const char *filename)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_DELETE, -1, 0, 0);
+	STAT_NAMES(filename, NULL);
+
+	char name[FS_FILENAME_LEN];
+	struct file_ref dir, ref;
+
+	if (!is_disk_opened()) {
+        fs_print("Disk not opened\n");
+		return -1;
+	}
+
+	if (path_parent(filename, &dir, name) == -1 || dir_find(&dir, name, &ref) == -1) {
+        fs_print("Unable to find file to delete\n");
+		return -1;
+	}
+
+	// Check to see if file is open
+	if (open_file_find(&ref)) {
+        fs_print("Unable to delete open file\n");
+		return -1;
+	}
+
+	if (ref.entry.flags & FILE_DIR) {
+		struct dir_header header;
+		FAILABLE(dir_header_update(ref.entry.first_block_i, &header, 0, 0));
+		if (header.count != 0) {
+	        fs_print("Unable to delete non-empty directory\n");
+			return -1;
+		}
+	}
+
+	clear_blocks(&ref.entry);
+
+	if (chunk_cache && chunk_cache->map_i == ref.entry.first_block_i) {
+		chunk_cache->chunk_i = -1;
+	}
+
+	// Clear file entry
+	FAILABLE(dir_remove(&ref));
+
+	fs_backup();
+
+	return fat_checked(0);
+}
+
+// Allocates a copy of a shared block that points at the same next block, so
+// the rest of the chain gains a reference and gets copied in turn as a write
+// walks on. Returns the index of the copy, or -1 if out of space
+int copy_block(uint32_t data_index, bool copy_data, uint8_t *bounce_buffer) {
+	int new_index = first_free_fat_index();
+	if (new_index == -1) {
+		return -1;
+	}
+
+	if (copy_data) {
+		FAILABLE(csum_block_read(layout.data_i + data_index, bounce_buffer));
+		FAILABLE(csum_block_write(layout.data_i + new_index, bounce_buffer));
+	}
+
+	uint32_t next_index = fat_entry_at_index(data_index);
+	fat_set_entry(new_index, next_index);
+	if (next_index != FAT_EOC) {
+		fat_ref_add(next_index, 1);
+	}
+
+	return new_index;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_CLONE, -1, 0, 0);
+	STAT_NAMES(src, dst);
+
+	char name[FS_FILENAME_LEN];
+	struct file_ref src_ref, dir, existing;
+	struct file_entry dst_file;
+
+	if (!is_disk_opened()) {
+        fs_print("Disk not opened\n");
+		return -1;
+	}
+
+	if (path_lookup(src, &src_ref) == -1 || (src_ref.entry.flags & FILE_DIR)) {
+        fs_print("Unable to find file to clone\n");
+		return -1;
+	}
+
+	if (path_parent(dst, &dir, name) == -1 || dir_find(&dir, name, &existing) == 0) {
+        fs_print("Error cloning file: %s invalid or not unique\n", dst);
+		return -1;
+	}
+
+	struct file_entry *src_file = &src_ref.entry;
+
+	// Chunk chains are referenced from the chunk map and can't be shared,
+	// and neither can the blocks of a hole map
+	if (src_file->flags & (FILE_COMPRESSED | FILE_SPARSE)) {
+        fs_print("Error cloning file: %s is compressed or sparse\n", src);
+		return -1;
+	}
+
+	create_file(&dst_file, name);
+
+	// Packed files are small, the clone gets its own copy in a fragment
+	if (src_file->flags & FILE_PACKED) {
+		uint8_t *data = (uint8_t*)malloc(FRAG_MAX);
+		int ret = -1;
+
+		if (data && frag_read(src_file, data) == 0) {
+			ret = frag_store(&dst_file, data, src_file->fsize);
+		}
+		free(data);
+
+		if (ret == -1) {
+            fs_print("Error cloning file: disk full\n");
+			return -1;
+		}
+	}
+
+	// Chain heads are never shared, so the clone gets its own copy of the
+	// first block and shares everything after it with the source
+	else if (src_file->first_block_i != FAT_EOC) {
+		if (!superblock->clones && fat_refs_start() == -1) {
+            fs_print("Error cloning file: cannot write superblock\n");
+			return -1;
+		}
+
+		uint8_t *bounce_buffer = (uint8_t*)malloc(BLOCK_SIZE);
+		int new_index = copy_block(src_file->first_block_i, true, bounce_buffer);
+		free(bounce_buffer);
+
+		if (new_index == -1) {
+            fs_print("Error cloning file: disk full\n");
+			return -1;
+		}
+
+		dst_file.first_block_i = new_index;
+		open_file_forget_tail(&src_ref);
+	}
+
+	dst_file.fsize = src_file->fsize;
+
+	if (dir_add(&dir, &dst_file) == -1) {
+        fs_print("Error cloning file: directory full\n");
+		clear_blocks(&dst_file);
+		return -1;
+	}
+
+	fs_backup();
+
+	return fat_checked(0);
+}
+
+int fs_compress(const char *filename)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_COMPRESS, -1, 0, 0);
+	STAT_NAMES(filename, NULL);
+
+	struct file_ref ref;
+
+	if (!is_disk_opened()) {
+        fs_print("Disk not opened\n");
+		return -1;
+	}
+
+	if (path_lookup(filename, &ref) == -1 || (ref.entry.flags & FILE_DIR)) {
+        fs_print("Unable to find file to compress\n");
+		return -1;
+	}
+
+	if (ref.entry.fsize != 0 || (ref.entry.flags & FILE_SPARSE)) {
+        fs_print("Unable to compress non-empty file\n");
+		return -1;
+	}
+
+	ref.entry.flags |= FILE_COMPRESSED;
+	FAILABLE(file_ref_store(&ref));
+
+	fs_backup();
+
+	return fat_checked(0);
+}
+
+void ls_print(const struct file_entry *entry) {
+	uint32_t first_block_i = entry->first_block_i;
+	if (!layout.fat32 && first_block_i == FAT_EOC) {
+		first_block_i = FAT16_EOC;
+	}
+	printf("%s: %s, size: %" PRIu64 ", data_blk: %" PRIu32 "\n",
+		   (entry->flags & FILE_DIR) ? "dir" : "file", entry->fname, entry->fsize, first_block_i);
+}
+
+// Looks up the directory at dirname for fs_ls_dir() and fs_readdir()
+int dir_open(const char *dirname, struct file_ref *ref) {
+	if (!is_disk_opened()) {
+        fs_print("fs not opened\n");
+		return -1;
+	}
+
+	if (path_lookup(dirname, ref) == -1 || !(ref->entry.flags & FILE_DIR)) {
+        fs_print("No directory %s\n", dirname);
+		return -1;
+	}
+
+	return 0;
+}
+
+void ls_print_entry(const struct file_entry *entry, void *arg) {
+	(void)arg;
+	ls_print(entry);
+}
+
+int fs_ls_dir(const char *dirname)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_LS, -1, 0, 0);
+	STAT_NAMES(dirname, NULL);
+
+	struct file_ref ref;
+
+	FAILABLE(dir_open(dirname, &ref));
+
+    printf("FS Ls:\n");
+	return fat_checked(dir_for_each(&ref, ls_print_entry, NULL));
+}
+
+struct readdir_arg {
+	void (*func)(const char *name, int is_dir, void *arg);
+	void *arg;
+};
+
+void readdir_entry(const struct file_entry *entry, void *arg) {
+	struct readdir_arg *readdir = arg;
+	readdir->func((const char*)entry->fname, (entry->flags & FILE_DIR) != 0, readdir->arg);
+}
+
+int fs_readdir(const char *dirname, void (*func)(const char *name, int is_dir, void *arg), void *arg)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_LS, -1, 0, 0);
+	STAT_NAMES(dirname, NULL);
+
+	struct readdir_arg readdir = { func, arg };
+	struct file_ref ref;
+
+	if (!func) {
+		return -1;
+	}
+
+	FAILABLE(dir_open(dirname, &ref));
+
+	return fat_checked(dir_for_each(&ref, readdir_entry, &readdir));
+}
+
+int fs_ls(void)
+{
+	return fs_ls_dir("/");
+}
+
+// Returns -1 if max number of files are open
+int first_open_fd_i() {
+	if ((size_t)fd_open_count >= fd_open_max) {
+		return -1;
+	}
+
+	if (fd_free == -1 && fd_table_grow() == -1) {
+		return -1;
+	}
+
+	return fd_free;
+}
+
+int fs_open(const char *filename)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_OPEN, -1, 0, 0);
+	STAT_NAMES(filename, NULL);
+
+	struct file_ref ref;
+
+	int fd = first_open_fd_i();
+	if (fd == -1) {
+        fs_print("Unable to open file: max num files opened\n");
+		return -1;
+	}
+
+	if (path_lookup(filename, &ref) == -1 || (ref.entry.flags & FILE_DIR)) {
+        fs_print("Unable to open file: file not found\n");
+		return -1;
+	}
+
+	// Descriptors of the same file share its entry
+	struct open_file *file = open_file_find(&ref);
+	if (!file) {
+		file = (struct open_file*)malloc(sizeof(struct open_file));
+		if (!file) {
+			return -1;
+		}
+		file->ref = ref;
+		file->open_count = 0;
+		file->tail_i = FAT_EOC;
+		file->write_error = false;
+		if (open_file_add(file) == -1) {
+			free(file);
+			return -1;
+		}
+	}
+	file->open_count++;
+
+	fd_free = fd_table[fd].next_free;
+	fd_open_count++;
+
+	fd_table[fd].file = file;
+	fd_table[fd].offset = 0;
+
+	// Recordings need the descriptor to match the calls that use it
+	stat_timer.fd = fd;
+	return fd;
+}
+
+int verify_fd(int fd) {
+	if (fd < 0 || fd >= fd_table_size) {
+        fs_print("fd out of bounds\n");
+		return -1;
+	}
+
+	if (fd_table[fd].file == NULL) {
+        fs_print("fd not open\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Turns a plain file into a sparse one, moving the blocks of its chain into a
+// hole map. Returns -1, leaving the file as it was, if the chain is shared
+// with a clone or if there is no room for the map
+int sparse_convert(struct file_entry *file) {
+	size_t i, num_blocks = 0;
+	uint32_t data_index;
+
+	for (data_index = file->first_block_i; data_index != FAT_EOC; data_index = fat_next(data_index)) {
+		if (fat_ref_count(data_index) > 1) {
+			return -1;
+		}
+		num_blocks++;
+	}
+
+	size_t num_maps = (num_blocks + HOLE_MAP_SIZE - 1) / HOLE_MAP_SIZE;
+	if (!has_free_blocks(num_maps)) {
+		return -1;
+	}
+
+	struct hole_map_block *map = (struct hole_map_block*)malloc(sizeof(struct hole_map_block));
+	if (!map) {
+		return -1;
+	}
+
+	// Write the whole map before touching the chain
+	struct file_entry sparse = *file;
+	sparse.first_block_i = FAT_EOC;
+	uint32_t prev_index = FAT_EOC;
+	data_index = file->first_block_i;
+	for (i = 0; i < num_maps; ++i) {
+		int map_index = first_free_fat_index();
+		fat_set_entry(map_index, FAT_EOC);
+		link_block(&sparse, prev_index, map_index);
+		prev_index = map_index;
+
+		memset(map, 0, sizeof(struct hole_map_block));
+		size_t j;
+		for (j = 0; j < HOLE_MAP_SIZE && data_index != FAT_EOC; ++j) {
+			map->blocks[j] = data_index;
+			data_index = fat_next(data_index);
+		}
+
+		if (csum_block_write(layout.data_i + map_index, map) == -1) {
+			if (sparse.first_block_i != FAT_EOC) {
+				free_chain(sparse.first_block_i);
+			}
+			free(map);
+			return -1;
+		}
+	}
+	free(map);
+
+	// Every block becomes a chain of its own, referenced from the map
+	data_index = file->first_block_i;
+	while (data_index != FAT_EOC) {
+		uint32_t next_index = fat_next(data_index);
+		fat_set_entry(data_index, FAT_EOC);
+		if (next_index != FAT_EOC) {
+			fat_ref_add(next_index, -1);
+		}
+		data_index = next_index;
+	}
+
+	file->first_block_i = sparse.first_block_i;
+	file->flags |= FILE_SPARSE;
+
+	return 0;
+}
+
+// Returns the data index of block map_i of the chain of a compressed or sparse
+// file, extending the chain with blocks zeroed through the buffer if create is
+// set. Returns -1 if the block doesn't exist
+int map_block_index(struct file_entry *file, size_t map_i, bool create, void *buffer) {
+	size_t i;
+	uint32_t prev_index = FAT_EOC;
+	uint32_t map_index = file->first_block_i;
+
+	for (i = 0; i <= map_i; ++i) {
+		if (map_index == FAT_EOC) {
+			if (!create) {
+				return -1;
+			}
+
+			int new_index = first_free_fat_index();
+			if (new_index == -1) {
+				return -1;
+			}
+
+			memset(buffer, 0, BLOCK_SIZE);
+			FAILABLE(csum_block_write(layout.data_i + new_index, buffer));
+
+			fat_set_entry(new_index, FAT_EOC);
+			link_block(file, prev_index, new_index);
+			map_index = new_index;
+		}
+
+		prev_index = map_index;
+		map_index = fat_next(map_index);
+	}
+
+	return prev_index;
+}
+
+// Returns the data index of the chunk map block holding the entry of a chunk
+int chunk_map_index(struct file_entry *file, int chunk_i, bool create) {
+	return map_block_index(file, chunk_i / CHUNK_MAP_SIZE, create, &chunk_cache->map);
+}
+
+int chunk_cache_create() {
+	if (!chunk_cache) {
+		chunk_cache = (struct chunk_cache*)malloc(sizeof(struct chunk_cache));
+		if (!chunk_cache) {
+			return -1;
+		}
+		chunk_cache->chunk_i = -1;
+		chunk_cache->owner = NULL;
+	}
+
+	return 0;
+}
+
+bool chunk_cached(const struct file_entry *file, int chunk_i) {
+	return chunk_cache->map_i == file->first_block_i && chunk_cache->chunk_i == chunk_i;
+}
+
+// Compresses the first len bytes of the chunk cache into the chain of its
+// chunk, reusing the blocks the chunk already had
+int chunk_store(struct file_entry *file, size_t len) {
+	int i;
+	int chunk_i = chunk_cache->chunk_i;
+
+	uint32_t flags = 0;
+	size_t clen = lz_compress(chunk_cache->data, len, chunk_cache->packed, len - 1);
+	if (clen == 0) {
+		// Incompressible, store it as is
+		memcpy(chunk_cache->packed, chunk_cache->data, len);
+		clen = len;
+		flags = CHUNK_RAW;
+	}
+	int num_blocks = (clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	int map_index = chunk_map_index(file, chunk_i, true);
+	FAILABLE(map_index);
+	FAILABLE(csum_block_read(layout.data_i + map_index, &chunk_cache->map));
+	struct chunk_entry *entry = chunk_cache->map.entries + chunk_i % CHUNK_MAP_SIZE;
+
+	// Make sure the chunk can't run out of space half way through
+	int old_blocks = 0;
+	uint32_t data_index = entry->clen ? entry->first_block_i : FAT_EOC;
+	while (data_index != FAT_EOC) {
+		old_blocks++;
+		data_index = fat_next(data_index);
+	}
+	if (num_blocks > old_blocks && !has_free_blocks(num_blocks - old_blocks)) {
+        fs_print("Disk space unavailable\n");
+		return -1;
+	}
+
+	uint32_t prev_index = FAT_EOC;
+	data_index = entry->clen ? entry->first_block_i : FAT_EOC;
+	for (i = 0; i < num_blocks; ++i) {
+		if (data_index == FAT_EOC) {
+			data_index = first_free_fat_index();
+			fat_set_entry(data_index, FAT_EOC);
+
+			if (prev_index == FAT_EOC) {
+				entry->first_block_i = data_index;
+			} else {
+				fat_set_entry(prev_index, data_index);
+				fat_ref_add(data_index, 1);
+			}
+		}
+
+		FAILABLE(csum_block_write(layout.data_i + data_index, chunk_cache->packed + i * BLOCK_SIZE));
+
+		prev_index = data_index;
+		data_index = fat_next(data_index);
+	}
+
+	// The chunk shrank, free the blocks it no longer needs
+	if (data_index != FAT_EOC) {
+		fat_set_entry(prev_index, FAT_EOC);
+		fat_ref_add(data_index, -1);
+		free_chain(data_index);
+	}
+
+	entry->clen = clen | flags;
+
+	// The chunk map may have just been created
+	chunk_cache->map_i = file->first_block_i;
+
+	return csum_block_write(layout.data_i + map_index, &chunk_cache->map);
+}
+
+// Stores the chunk that writes were buffered in. A chunk that can't be stored
+// is dropped, and the error left for its file to report
+int chunk_flush() {
+	if (!chunk_cache || !chunk_cache->owner) {
+		return 0;
+	}
+
+	struct open_file *open = chunk_cache->owner;
+	chunk_cache->owner = NULL;
+	if (chunk_store(&open->ref.entry, chunk_cache->len) == -1) {
+		chunk_cache->chunk_i = -1;
+		open->write_error = true;
+		return -1;
+	}
+
+	file_ref_store(&open->ref);
+	fs_backup();
+
+	return 0;
+}
+
+// Decompresses a chunk of a file into the chunk cache
+int chunk_load(struct file_entry *file, int chunk_i) {
+	int i;
+
+	if (chunk_cached(file, chunk_i)) {
+		return 0;
+	}
+
+	chunk_flush();
+	chunk_cache->chunk_i = -1;
+	memset(chunk_cache->data, 0, CHUNK_SIZE);
+
+	int map_index = chunk_map_index(file, chunk_i, false);
+	if (map_index != -1) {
+		FAILABLE(csum_block_read(layout.data_i + map_index, &chunk_cache->map));
+		struct chunk_entry entry = chunk_cache->map.entries[chunk_i % CHUNK_MAP_SIZE];
+
+		uint32_t clen = entry.clen & ~CHUNK_RAW;
+		uint32_t data_index = entry.first_block_i;
+		for (i = 0; i * BLOCK_SIZE < (int)clen; ++i) {
+			if (data_index == FAT_EOC) {
+				return -1;
+			}
+			FAILABLE(csum_block_read(layout.data_i + data_index, chunk_cache->packed + i * BLOCK_SIZE));
+			data_index = fat_next(data_index);
+		}
+
+		if (entry.clen & CHUNK_RAW) {
+			memcpy(chunk_cache->data, chunk_cache->packed, clen);
+		} else if (clen) {
+			FAILABLE(lz_decompress(chunk_cache->packed, clen, chunk_cache->data, CHUNK_SIZE));
+		}
+	}
+
+	chunk_cache->map_i = file->first_block_i;
+	chunk_cache->chunk_i = chunk_i;
+
+	return 0;
+}
+
+int compressed_read(struct file_entry *file, size_t offset, uint8_t *buf, size_t count) {
+	FAILABLE(chunk_cache_create());
+
+	if (offset >= file->fsize) {
+		return 0;
+	}
+	if (count > file->fsize - offset) {
+		count = file->fsize - offset;
+	}
+
+	size_t total_bytes_read = 0;
+	while (total_bytes_read < count) {
+		size_t pos = offset + total_bytes_read;
+		size_t chunk_offset = pos % CHUNK_SIZE;
+		size_t n = count - total_bytes_read;
+		if (n > CHUNK_SIZE - chunk_offset) {
+			n = CHUNK_SIZE - chunk_offset;
+		}
+
+		FAILABLE(chunk_load(file, pos / CHUNK_SIZE));
+		memcpy(buf + total_bytes_read, chunk_cache->data + chunk_offset, n);
+
+		total_bytes_read += n;
+	}
+
+	return total_bytes_read;
+}
+
+// Writes into the chunk cache, which holds on to the chunk until the writes
+// move on to another chunk or the file is synced or closed, so that small
+// writes don't compress and store the whole chunk each time
+int compressed_write(struct open_file *open, size_t offset, const uint8_t *buf, size_t count) {
+	struct file_entry *file = &open->ref.entry;
+	FAILABLE(chunk_cache_create());
+
+	size_t total_bytes_written = 0;
+	while (total_bytes_written < count) {
+		size_t pos = offset + total_bytes_written;
+		int chunk_i = pos / CHUNK_SIZE;
+		size_t chunk_offset = pos % CHUNK_SIZE;
+		size_t n = count - total_bytes_written;
+		if (n > CHUNK_SIZE - chunk_offset) {
+			n = CHUNK_SIZE - chunk_offset;
+		}
+
+		size_t chunk_start = (size_t)chunk_i * CHUNK_SIZE;
+		size_t chunk_len = 0;
+		if (file->fsize > chunk_start) {
+			chunk_len = file->fsize - chunk_start < CHUNK_SIZE ? file->fsize - chunk_start : CHUNK_SIZE;
+		}
+
+		// The map block of the chunk is created first, so that the file has
+		// the first block of its map to be told apart by in the cache
+		if (chunk_map_index(file, chunk_i, true) == -1) {
+            fs_print("Disk space unavailable\n");
+			break;
+		}
+
+		if (!chunk_cached(file, chunk_i)) {
+			// The chunk written before is stored first, only failing this
+			// write if it was this file's
+			struct open_file *owner = chunk_cache->owner;
+			if (chunk_flush() == -1 && owner == open) {
+				break;
+			}
+
+			if (chunk_offset == 0 && n >= chunk_len) {
+				// The whole chunk is overwritten, no need to decompress it
+				memset(chunk_cache->data, 0, CHUNK_SIZE);
+				chunk_cache->map_i = file->first_block_i;
+				chunk_cache->chunk_i = chunk_i;
+			} else if (chunk_load(file, chunk_i) == -1) {
+				break;
+			}
+			chunk_cache->through = !has_free_blocks(CHUNK_BLOCKS);
+		}
+
+		memcpy(chunk_cache->data + chunk_offset, buf + total_bytes_written, n);
+		if (chunk_offset + n > chunk_len) {
+			chunk_len = chunk_offset + n;
+		}
+		chunk_cache->owner = open;
+		chunk_cache->len = chunk_len;
+		if (chunk_cache->through && chunk_flush() == -1) {
+			open->write_error = false;
+			break;
+		}
+
+		total_bytes_written += n;
+		if (pos + n > file->fsize) {
+			file->fsize = pos + n;
+		}
+	}
+
+	return total_bytes_written;
+}
+
+// Offset of a file descriptor, for the trace
+size_t fd_offset(int fd) {
+	return fd >= 0 && fd < fd_table_size && fd_table[fd].file ? fd_table[fd].offset : 0;
+}
+
+int fs_close(int fd)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_CLOSE, fd, 0, 0);
+
+	FAILABLE(verify_fd(fd));
+
+	// The descriptor would be reused by the next fs_open() under the requests
+	if (async_pending_fd(fd) != 0) {
+        fs_print("Cannot close, asynchronous requests pending\n");
+		return -1;
+	}
+
+	struct open_file *file = fd_table[fd].file;
+	fd_table[fd].file = NULL;
+	fd_table[fd].next_free = fd_free;
+	fd_free = fd;
+	fd_open_count--;
+
+	int ret = 0;
+	if (--file->open_count == 0) {
+		// Writes buffered in the chunk cache are stored before the file goes
+		if (chunk_cache && chunk_cache->owner == file) {
+			chunk_flush();
+		}
+		if (file->write_error) {
+            fs_print("Unable to store compressed data\n");
+			ret = -1;
+		}
+
+		open_file_remove(file);
+		free(file);
+	}
+
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_STAT, fd, 0, 0);
+
+	FAILABLE(verify_fd(fd));
+
+	// Sparse files can be larger than an int can hold, see fs_stat64()
+	uint64_t size = fd_table[fd].file->ref.entry.fsize;
+	if (size > INT32_MAX) {
+		return -1;
+	}
+
+	return size;
+}
+
+int fs_stat64(int fd, uint64_t *size)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_STAT, fd, 0, 0);
+
+	FAILABLE(verify_fd(fd));
+	*size = fd_table[fd].file->ref.entry.fsize;
+
+	return 0;
+}
+
+// Largest size that a directory entry can record
+uint64_t file_size_max() {
+	return layout.fat32 ? (uint64_t)INT32_MAX * BLOCK_SIZE : UINT32_MAX;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_LSEEK, fd, offset, 0);
+
+	FAILABLE(verify_fd(fd));
+
+	// Seeking past the end of the file is fine, writing there leaves a hole
+	if (offset > file_size_max()) {
+		return -1;
+	}
+
+	fd_table[fd].offset = offset;
+	
+	return 0;
+}
+
+// Loads the hole map block covering block map_i * HOLE_MAP_SIZE of a sparse
+// file, following on from map_index when it held the previous one. The map
+// block is created if create is set, or else reads as all holes. Returns the
+// new map_index, FAT_EOC if there is none, or -1
+int64_t hole_map_load(struct file_entry *file, size_t map_i, int64_t map_index,
+		      bool next, bool create, struct hole_map_block *map) {
+	if (next && map_index != FAT_EOC) {
+		map_index = fat_next(map_index);
+	} else {
+		map_index = chain_index_at(file->first_block_i, map_i);
+	}
+
+	if (map_index == FAT_EOC && create) {
+		map_index = map_block_index(file, map_i, true, map);
+		FAILABLE(map_index);
+	}
+
+	if (map_index == FAT_EOC) {
+		memset(map, 0, sizeof(struct hole_map_block));
+		return FAT_EOC;
+	}
+
+	FAILABLE(csum_block_read(layout.data_i + map_index, map));
+	return map_index;
+}
+
+int sparse_read(struct file_entry *file, size_t offset, uint8_t *buf, size_t count) {
+	if (offset >= file->fsize) {
+		return 0;
+	}
+	if (count > file->fsize - offset) {
+		count = file->fsize - offset;
+	}
+
+	struct hole_map_block *map = (struct hole_map_block*)malloc(sizeof(struct hole_map_block));
+	uint8_t *bounce_buffer = (uint8_t*)malloc(BLOCK_SIZE);
+	if (!map || !bounce_buffer) {
+		free(map);
+		free(bounce_buffer);
+		return -1;
+	}
+
+	int64_t map_index = FAT_EOC;
+	size_t map_i = 0;
+	bool loaded = false;
+	int ret = 0;
+	size_t total_bytes_read = 0;
+	while (total_bytes_read < count) {
+		size_t pos = offset + total_bytes_read;
+		size_t block_i = pos / BLOCK_SIZE;
+		size_t block_offset = pos % BLOCK_SIZE;
+		size_t n = count - total_bytes_read;
+		if (n > BLOCK_SIZE - block_offset) {
+			n = BLOCK_SIZE - block_offset;
+		}
+
+		if (!loaded || block_i / HOLE_MAP_SIZE != map_i) {
+			map_index = hole_map_load(file, block_i / HOLE_MAP_SIZE, map_index, loaded, false, map);
+			if (map_index == -1) {
+				ret = -1;
+				break;
+			}
+			map_i = block_i / HOLE_MAP_SIZE;
+			loaded = true;
+		}
+
+		uint32_t data_index = map->blocks[block_i % HOLE_MAP_SIZE] & ~HOLE_SHARED;
+		if (data_index == 0) {
+			// A hole, nothing to read
+			memset(buf + total_bytes_read, 0, n);
+		} else if (n == BLOCK_SIZE) {
+			stat_add(STAT_DIRECT_READS, 1);
+			if (csum_block_read(layout.data_i + data_index, buf + total_bytes_read) == -1) {
+				ret = -1;
+				break;
+			}
+		} else {
+			stat_add(STAT_BOUNCE_READS, 1);
+			if (csum_block_read(layout.data_i + data_index, bounce_buffer) == -1) {
+				ret = -1;
+				break;
+			}
+			memcpy(buf + total_bytes_read, bounce_buffer + block_offset, n);
+		}
+
+		total_bytes_read += n;
+	}
+
+	free(map);
+	free(bounce_buffer);
+
+	return ret == -1 ? -1 : (int)total_bytes_read;
+}
+
+// Makes the block of a shared entry of a hole map the file's own before it is
+// written to, taking it back if no other file uses it or else copying it, its
+// content too if keep is set. Returns -1 if out of space
+int hole_own(uint32_t *entry, bool keep, uint8_t *bounce_buffer) {
+	uint32_t data_index = *entry & ~HOLE_SHARED;
+	uint32_t *refs = hole_refs_get();
+	if (!refs) {
+		return -1;
+	}
+
+	if (refs[data_index] <= 1 && !hole_refs_partial) {
+		refs[data_index] = 0;
+		if (dedup_keys) {
+			dedup_keys[data_index] = 0;
+		}
+		*entry = data_index;
+		return 0;
+	}
+
+	int new_index = copy_block(data_index, keep, bounce_buffer);
+	FAILABLE(new_index);
+
+	if (refs[data_index] > 0) {
+		refs[data_index]--;
+	}
+	*entry = new_index;
+
+	return 0;
+}
+
+// Zeroes the bytes past the end of a sparse file in its last block, before a
+// write past the end makes them part of the file
+int sparse_zero_tail(struct file_entry *file, struct hole_map_block *map, uint8_t *bounce_buffer) {
+	size_t block_i = file->fsize / BLOCK_SIZE;
+	size_t tail = file->fsize % BLOCK_SIZE;
+
+	if (tail == 0) {
+		return 0;
+	}
+
+	int64_t map_index = hole_map_load(file, block_i / HOLE_MAP_SIZE, FAT_EOC, false, false, map);
+	FAILABLE(map_index);
+
+	uint32_t *data_index = map->blocks + block_i % HOLE_MAP_SIZE;
+	if (*data_index == 0) {
+		return 0;
+	}
+
+	if (*data_index & HOLE_SHARED) {
+		FAILABLE(hole_own(data_index, true, bounce_buffer));
+		FAILABLE(csum_block_write(layout.data_i + map_index, map));
+	}
+
+	FAILABLE(csum_block_read(layout.data_i + *data_index, bounce_buffer));
+	memset(bounce_buffer + tail, 0, BLOCK_SIZE - tail);
+	return csum_block_write(layout.data_i + *data_index, bounce_buffer);
+}
+
+// Points an entry of a hole map at the indexed block identical to a whole
+// block about to be written, leaving its old block in *released for the
+// caller to give back once the map is written. Returns 1 if the block needn't
+// be written, or else 0 with the key to index it under in *key, 0 if none
+int dedup_share(uint32_t *entry, const uint8_t *block, uint8_t *bounce_buffer,
+		uint64_t *key, uint32_t *released) {
+	uint32_t *refs = hole_refs_get();
+	*key = 0;
+	if (!refs) {
+		return 0;
+	}
+
+	*key = dedup_mix(DEDUP_SEED, crc32c(0, block, BLOCK_SIZE));
+	uint32_t match = dedup_lookup(*key);
+	if (match == FAT_EOC || refs[match] == 0 ||
+		csum_block_read(layout.data_i + match, bounce_buffer) == -1 ||
+		memcmp(block, bounce_buffer, BLOCK_SIZE) != 0) {
+		return 0;
+	}
+
+	// Already shared, the block holds what is being written
+	if (match == (*entry & ~HOLE_SHARED)) {
+		return (*entry & HOLE_SHARED) ? 1 : 0;
+	}
+
+	*released = *entry;
+	*entry = match | HOLE_SHARED;
+	refs[match]++;
+	stat_add(STAT_DEDUP_BLOCKS, 1);
+
+	return 1;
+}
+
+// Writes back a hole map block, then gives back the blocks deduplication moved
+// its entries off. If the map can't be written, its shared blocks are taken
+// out of the index instead, as the map on disk may not flag them
+int hole_map_write(int64_t map_index, struct hole_map_block *map, uint32_t *released) {
+	size_t i;
+	int ret = csum_block_write(layout.data_i + map_index, map);
+
+	for (i = 0; released && i < HOLE_MAP_SIZE; i++) {
+		if (ret == -1 && (map->blocks[i] & HOLE_SHARED)) {
+			dedup_keys[map->blocks[i] & ~HOLE_SHARED] = 0;
+		} else if (ret == 0 && released[i]) {
+			hole_release(released[i]);
+		}
+		released[i] = 0;
+	}
+
+	return ret;
+}
+
+int sparse_write(struct file_entry *file, size_t offset, const uint8_t *buf, size_t count) {
+	struct hole_map_block *map = (struct hole_map_block*)malloc(sizeof(struct hole_map_block));
+	uint8_t *bounce_buffer = (uint8_t*)malloc(BLOCK_SIZE);
+	// Old entries of the map replaced by shared blocks, with dedup on
+	uint32_t *released = dedup_keys ? (uint32_t*)calloc(HOLE_MAP_SIZE, sizeof(uint32_t)) : NULL;
+	if (!map || !bounce_buffer || (dedup_keys && !released) ||
+		(offset > file->fsize && sparse_zero_tail(file, map, bounce_buffer) == -1)) {
+		free(map);
+		free(bounce_buffer);
+		free(released);
+		return -1;
+	}
+
+	int64_t map_index = FAT_EOC;
+	size_t map_i = 0;
+	bool loaded = false, dirty = false;
+	size_t total_bytes_written = 0;
+	while (total_bytes_written < count) {
+		size_t pos = offset + total_bytes_written;
+		size_t block_i = pos / BLOCK_SIZE;
+		size_t block_offset = pos % BLOCK_SIZE;
+		size_t n = count - total_bytes_written;
+		if (n > BLOCK_SIZE - block_offset) {
+			n = BLOCK_SIZE - block_offset;
+		}
+
+		if (!loaded || block_i / HOLE_MAP_SIZE != map_i) {
+			if (dirty && hole_map_write(map_index, map, released) == -1) {
+				break;
+			}
+			dirty = false;
+
+			map_index = hole_map_load(file, block_i / HOLE_MAP_SIZE, map_index, loaded, true, map);
+			if (map_index == -1) {
+                fs_print("Disk space unavailable\n");
+				loaded = false;
+				break;
+			}
+			map_i = block_i / HOLE_MAP_SIZE;
+			loaded = true;
+		}
+
+		uint32_t *data_index = map->blocks + block_i % HOLE_MAP_SIZE;
+		uint64_t key = 0;
+		int status;
+		if (dedup_keys && n == BLOCK_SIZE) {
+			// Whole blocks identical to an indexed one share it instead
+			uint32_t entry = *data_index;
+			if (dedup_share(data_index, buf + total_bytes_written, bounce_buffer, &key,
+					released + block_i % HOLE_MAP_SIZE) == 1) {
+				dirty = dirty || *data_index != entry;
+				total_bytes_written += n;
+				continue;
+			}
+		}
+		if (*data_index & HOLE_SHARED) {
+			// Other files may share the block, a partial write keeps the rest
+			if (hole_own(data_index, n != BLOCK_SIZE, bounce_buffer) == -1) {
+                fs_print("Disk space unavailable\n");
+				break;
+			}
+			dirty = true;
+		}
+		if (*data_index == 0) {
+			int new_index = first_free_fat_index();
+			if (new_index == -1) {
+                fs_print("Disk space unavailable\n");
+				break;
+			}
+			fat_set_entry(new_index, FAT_EOC);
+			*data_index = new_index;
+			dirty = true;
+
+			// The rest of a new block is a hole
+			memset(bounce_buffer, 0, BLOCK_SIZE);
+			memcpy(bounce_buffer + block_offset, buf + total_bytes_written, n);
+			status = csum_block_write(layout.data_i + *data_index, bounce_buffer);
+		} else if (n == BLOCK_SIZE) {
+			stat_add(STAT_DIRECT_WRITES, 1);
+			status = csum_block_write(layout.data_i + *data_index, buf + total_bytes_written);
+		} else {
+			stat_add(STAT_BOUNCE_WRITES, 1);
+			status = csum_block_read(layout.data_i + *data_index, bounce_buffer);
+			if (status == 0) {
+				memcpy(bounce_buffer + block_offset, buf + total_bytes_written, n);
+				status = csum_block_write(layout.data_i + *data_index, bounce_buffer);
+			}
+		}
+		if (status == -1) {
+			break;
+		}
+
+		// And are indexed otherwise, for the next ones to share
+		if (key) {
+			*data_index |= HOLE_SHARED;
+			hole_refs[*data_index & ~HOLE_SHARED] = 1;
+			dedup_insert(key, *data_index & ~HOLE_SHARED);
+			dirty = true;
+		}
+
+		total_bytes_written += n;
+	}
+
+	int ret = 0;
+	if (dirty && loaded) {
+		ret = hole_map_write(map_index, map, released);
+	}
+
+	free(map);
+	free(bounce_buffer);
+	free(released);
+
+	return ret == -1 ? -1 : (int)total_bytes_written;
+}
+
+// Writes to a file that is small enough to be kept packed in a fragment
+int packed_write(struct file_entry *file, size_t offset, const uint8_t *buf, size_t count) {
+	uint8_t *data = (uint8_t*)malloc(FRAG_MAX);
+	if (!data) {
+		return -1;
+	}
+
+	size_t len = file->fsize;
+	if ((file->flags & FILE_PACKED) && frag_read(file, data) == -1) {
+		free(data);
+		return -1;
+	}
+
+	// Bytes skipped past the end of the file read as zeros
+	if (offset > len) {
+		memset(data + len, 0, offset - len);
+	}
+	memcpy(data + offset, buf, count);
+	if (offset + count > len) {
+		len = offset + count;
+	}
+
+	if (frag_store(file, data, len) == -1) {
+		// Out of space, nothing was written
+		count = 0;
+	} else {
+		file->fsize = len;
+	}
+
+	free(data);
+	return count;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_WRITE, fd, fd_offset(fd), count);
+
+	FAILABLE(verify_fd(fd));
+
+    struct file_ref *ref = &fd_table[fd].file->ref;
+    struct file_entry *file = &ref->entry;
+
+    if (fd_table[fd].offset >= file_size_max()) {
+        return 0;
+    }
+    if (count > file_size_max() - fd_table[fd].offset) {
+        count = file_size_max() - fd_table[fd].offset;
+    }
+
+    size_t end = fd_table[fd].offset + count;
+    bool packable = (file->flags & FILE_PACKED) ||
+        (file->first_block_i == FAT_EOC && !(file->flags & FILE_SPARSE));
+
+    if (!(file->flags & FILE_COMPRESSED) && packable && count > 0 && end <= FRAG_MAX) {
+        int written = packed_write(file, fd_table[fd].offset, buf, count);
+        FAILABLE(written);
+
+        file_ref_store(ref);
+        fs_backup();
+
+        fd_table[fd].offset += written;
+        return fat_checked(written);
+    }
+
+    // The file outgrows its fragment
+    if ((file->flags & FILE_PACKED) && frag_unpack(file) == -1) {
+        fs_print("Disk space unavailable\n");
+        return 0;
+    }
+    file_ref_store(ref);
+
+    if (file->flags & FILE_COMPRESSED) {
+        int written = compressed_write(fd_table[fd].file, fd_table[fd].offset, buf, count);
+        FAILABLE(written);
+
+        file_ref_store(ref);
+        fs_backup();
+
+        fd_table[fd].offset += written;
+        return fat_checked(written);
+    }
+
+    // Skipping whole blocks past the end of the file turns it into a sparse
+    // file, so that they take no space. So does writing whole blocks with
+    // dedup on, so that they can be shared. Files sharing blocks with a
+    // clone stay as they are and get zeroed blocks instead
+    size_t num_blocks = (file->fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t end_blocks = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    bool shareable = dedup_keys && end / BLOCK_SIZE > (fd_table[fd].offset + BLOCK_SIZE - 1) / BLOCK_SIZE &&
+        (end_blocks > num_blocks ? end_blocks : num_blocks) >= dedup_min;
+    if (!(file->flags & FILE_SPARSE) && (fd_table[fd].offset / BLOCK_SIZE > num_blocks || shareable) &&
+        sparse_convert(file) == 0) {
+        file_ref_store(ref);
+    }
+
+    if (file->flags & FILE_SPARSE) {
+        int written = sparse_write(file, fd_table[fd].offset, buf, count);
+        FAILABLE(written);
+
+        if (written > 0 && fd_table[fd].offset + written > file->fsize) {
+            file->fsize = fd_table[fd].offset + written;
+        }
+        file_ref_store(ref);
+        fs_backup();
+
+        fd_table[fd].offset += written;
+        return fat_checked(written);
+    }
+    struct open_file *open = fd_table[fd].file;
+    uint32_t data_index = file->first_block_i;
+    uint32_t prev_index = FAT_EOC;
+
+    size_t startingByte = fd_table[fd].offset;
+    size_t finalByte = startingByte + count - 1;
+
+    uint8_t *bounce_buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+
+    size_t blocksIteratedOver = 0;
+    size_t total_bytes_written = 0;
+
+    // Writes from the last block on, appends in particular, start there
+    // rather than at the head. Nothing before it needs copying, so the link
+    // to it is never needed
+    if (open->tail_i != FAT_EOC && file->fsize > 0 &&
+        open->tail_block == (file->fsize - 1) / BLOCK_SIZE &&
+        startingByte >= open->tail_block * BLOCK_SIZE) {
+        data_index = open->tail_i;
+        blocksIteratedOver = open->tail_block;
+    }
+
+    // Large writes only allocate and link blocks here, leaving the whole
+    // blocks for io_job_run() to write in parallel
+    struct io_job job = { .write = true };
+    if (count >= IO_PARALLEL_MIN * BLOCK_SIZE) {
+        job.blocks = (uint32_t*)malloc((count / BLOCK_SIZE) * sizeof(uint32_t));
+    }
+
+    uint32_t last_index = FAT_EOC;
+    size_t last_block = 0;
+    bool failed = false;
+    while (total_bytes_written < count) {
+        size_t blockLowerBound = blocksIteratedOver * BLOCK_SIZE;
+        size_t blockUpperBound = ((blocksIteratedOver + 1) * BLOCK_SIZE) - 1;
+        bool fresh = false;
+
+		// Allocate block if we are out of room
+		if (data_index == FAT_EOC){
+            // now we allocate new space, and then update the data index to point to the new space.
+			int new_index = first_free_fat_index();
+
+			// Check to see if out of space
+			if (new_index == -1) {
+                fs_print("Disk space unavailable\n");
+				break;
+			}
+
+			fat_set_entry(new_index, FAT_EOC);
+			link_block(file, prev_index, new_index);
+			data_index = new_index;
+			fresh = true;
+        } else if (fat_ref_count(data_index) > 1) {
+            // The block is shared with a clone, so give this file its own
+            // copy before touching it or anything after it
+            bool overwritten = blockLowerBound >= startingByte && blockUpperBound <= finalByte;
+            int new_index = copy_block(data_index, !overwritten, bounce_buffer);
+
+            if (new_index == -1) {
+                fs_print("Disk space unavailable\n");
+                break;
+            }
+
+            fat_ref_add(data_index, -1);
+            link_block(file, prev_index, new_index);
+            data_index = new_index;
+        }
+
+        // Bytes skipped past the end of the file must read as zeros, whether
+        // in a new block or in the old last block
+        if (blockUpperBound < startingByte && (fresh || blockUpperBound >= file->fsize)) {
+            size_t keep = fresh || blockLowerBound >= file->fsize ? 0 : file->fsize - blockLowerBound;
+
+            if (keep && csum_block_read(layout.data_i + data_index, bounce_buffer) == -1) {
+                failed = true;
+                break;
+            }
+            memset(bounce_buffer + keep, 0, BLOCK_SIZE - keep);
+            if (csum_block_write(layout.data_i + data_index, bounce_buffer) == -1) {
+                failed = true;
+                break;
+            }
+        }
+
+        // If byte upper bound is greater than starting byte, we know that
+        // this block intersects with the bytes that we are trying to read
+        if (blockUpperBound >= startingByte) {
+            int start_write, end_write;
+
+            if (blockLowerBound < startingByte) {
+                // The start of the section to read is in the middle of the block
+                start_write = startingByte - blockLowerBound;
+            } else {
+                start_write = 0;
+            }
+
+            if (blockUpperBound > finalByte) {
+                // The end of the section to read is in the middle of the block
+                end_write = finalByte - blockLowerBound;
+            } else {
+                end_write = BLOCK_SIZE - 1;
+            }
+
+			int block_bytes_written = end_write - start_write + 1;
+			last_index = data_index;
+			last_block = blocksIteratedOver;
+
+            if (start_write == 0 && end_write == BLOCK_SIZE - 1) {
+                fs_print("Direct write\n");
+                stat_add(STAT_DIRECT_WRITES, 1);
+                // Perfect case
+                if (job.blocks) {
+                    if (job.num_blocks == 0) {
+                        job.buf = (uint8_t*)buf + total_bytes_written;
+                    }
+                    job.blocks[job.num_blocks++] = data_index;
+                } else if (csum_block_write(layout.data_i + data_index, buf + total_bytes_written) == -1) {
+                    failed = true;
+                    break;
+                }
+            } else {
+                fs_print("Bounce write\n");
+                stat_add(STAT_BOUNCE_WRITES, 1);
+                // We're don't need the whole block so we use a bounce buffer
+                if (fresh) {
+                    memset(bounce_buffer, 0, BLOCK_SIZE);
+                } else if (csum_block_read(layout.data_i + data_index, bounce_buffer) == -1) {
+                    failed = true;
+                    break;
+                }
+                if (startingByte > file->fsize && file->fsize > blockLowerBound) {
+                    // The write starts past the end of the file in its last block
+                    memset(bounce_buffer + (file->fsize - blockLowerBound), 0,
+                           startingByte - file->fsize);
+                }
+                memcpy(bounce_buffer + start_write, buf + total_bytes_written, block_bytes_written);
+                if (csum_block_write(layout.data_i + data_index, bounce_buffer) == -1) {
+                    failed = true;
+                    break;
+                }
+                }
+
+            total_bytes_written += block_bytes_written;
+            if (blockUpperBound >= finalByte) { // If we have done the correct amount of writing, we terminate.
+                break;
+            }
+        }
+
+        prev_index = data_index;
+        data_index = fat_next(data_index);
+        blocksIteratedOver++;
+    }
+
+    free(bounce_buffer);
+
+    // Blocks before the first one that failed are written, so the write
+    // ends there. The blocks are linked already, so the file is updated
+    // either way
+    if (job.num_blocks > 0 && io_job_run(&job) == -1) {
+        size_t done = (job.buf - (uint8_t*)buf) + job.first_failed * BLOCK_SIZE;
+        if (done < total_bytes_written) {
+            total_bytes_written = done;
+        }
+        failed = true;
+    }
+    free(job.blocks);
+
+    // Out of space or failing before the end of the write, give back the
+    // blocks added past what was written, such as those for skipped bytes
+    if (total_bytes_written < count) {
+        size_t size = file->fsize;
+        if (total_bytes_written > 0 && startingByte + total_bytes_written > size) {
+            size = startingByte + total_bytes_written;
+        }
+        chain_truncate(file, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+
+	// Increment offset in fd_table
+	fd_table[fd].offset += total_bytes_written;
+	if (total_bytes_written > 0 && startingByte + total_bytes_written > file->fsize) {
+		file->fsize = startingByte + total_bytes_written;
+	}
+
+	// Every block up to the last one written was made this file's own on
+	// the way, so if that is the last block, appends can start from it
+	if (last_index != FAT_EOC && last_block == (file->fsize - 1) / BLOCK_SIZE) {
+		open->tail_i = last_index;
+		open->tail_block = last_block;
+	}
+
+	file_ref_store(ref);
+	fs_backup();
+
+	return fat_checked(failed && total_bytes_written == 0 ? -1 : (int)total_bytes_written);
+}
+
+int fs_append(int fd, void *buf, size_t count)
+{
+	FS_LOCKED();
+
+	FAILABLE(verify_fd(fd));
+
+	// Timed and recorded as the write it amounts to
+	fd_table[fd].offset = fd_table[fd].file->ref.entry.fsize;
+	return fs_write(fd, buf, count);
+}
+
+// Marks the FAT blocks of a chain that file_sync() needs to write, copying its
+// entries into the copies of the blocks as last written
+void chain_sync(uint32_t data_index, uint8_t *sync) {
+	while (data_index != FAT_EOC) {
+		int fat_i = fat_block_of(data_index);
+		if (fat_dirty[fat_i] && (!fat_shadowed[fat_i] || fat_shadow_entry(data_index))) {
+			sync[fat_i] = 1;
+		}
+		data_index = fat_next(data_index);
+	}
+}
+
+// Same for the chain of a file and, for compressed and sparse files, the
+// chains listed in the maps it holds
+int file_chains_sync(struct file_entry *file, uint8_t *sync) {
+	int i;
+	uint32_t map_index = file->first_block_i;
+
+	chain_sync(map_index, sync);
+	if (!(file->flags & (FILE_COMPRESSED | FILE_SPARSE))) {
+		return 0;
+	}
+
+	// Both maps are arrays of entries starting with the chain's first block
+	uint32_t *map = (uint32_t*)malloc(BLOCK_SIZE);
+	if (!map) {
+		return -1;
+	}
+
+	for (; map_index != FAT_EOC; map_index = fat_next(map_index)) {
+		if (csum_block_read(layout.data_i + map_index, map) == -1) {
+			free(map);
+			return -1;
+		}
+
+		if (file->flags & FILE_SPARSE) {
+			for (i = 0; i < (int)HOLE_MAP_SIZE; i++) {
+				if (map[i]) {
+					chain_sync(map[i] & ~HOLE_SHARED, sync);
+				}
+			}
+		} else {
+			struct chunk_entry *chunks = (struct chunk_entry*)map;
+			for (i = 0; i < (int)CHUNK_MAP_SIZE; i++) {
+				if (chunks[i].clen) {
+					chain_sync(chunks[i].first_block_i, sync);
+				}
+			}
+		}
+	}
+
+	free(map);
+	return 0;
+}
+
+// Makes the data of an open file durable, then the metadata needed to find it
+int file_sync(int fd) {
+	int i;
+	bool wrote = false;
+
+	struct open_file *open = fd_table[fd].file;
+	struct file_entry *file = &open->ref.entry;
+
+	// Writes buffered in the chunk cache are stored first, the error of any
+	// that couldn't be is reported once
+	if (chunk_cache && chunk_cache->owner == open) {
+		chunk_flush();
+	}
+	if (open->write_error) {
+		open->write_error = false;
+        fs_print("Unable to store compressed data\n");
+		return -1;
+	}
+
+	// Data blocks and the directory blocks of subdirectories are written as
+	// soon as they change, so the first barrier is all they need. Their
+	// checksums go along with them
+	csum_flush();
+	FAILABLE(block_disk_sync());
+
+	// FAT blocks are only left unwritten inside a batch. Only this file's
+	// entries are written, into the blocks as they were last written, as the
+	// others may point to data that isn't on disk yet. Blocks changed before
+	// the batch started have no such copy and are written whole
+	if (fat_dirty_count > 0) {
+		uint8_t *sync = (uint8_t*)calloc(layout.num_fat, sizeof(uint8_t));
+		if (!sync || file_chains_sync(file, sync) == -1) {
+			free(sync);
+			return -1;
+		}
+
+		for (i = 0; i < layout.num_fat; i++) {
+			if (!sync[i]) {
+				continue;
+			}
+
+			int ret = fat_shadowed[i] ?
+				csum_block_write(1 + i, fat_shadow[i]) : fat_block_write(i);
+			if (ret == -1) {
+				free(sync);
+				return -1;
+			}
+			wrote = true;
+		}
+		free(sync);
+	}
+
+	// And so is the root directory, for the same reason
+	if (open->ref.dir_i == FAT_EOC && root_entry_dirty(open->ref.slot)) {
+		FAILABLE(root_dir_write(open->ref.slot));
+		wrote = true;
+	}
+
+	if (!wrote) {
+		return fat_checked(0);
+	}
+
+	// Then the metadata, once the data it points to is on disk
+	csum_flush();
+	return fat_checked(block_disk_sync());
+}
+
+int fs_fsync(int fd)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_FSYNC, fd, 0, 0);
+
+	FAILABLE(verify_fd(fd));
+	return file_sync(fd);
+}
+
+int fs_fdatasync(int fd)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_FDATASYNC, fd, 0, 0);
+
+	FAILABLE(verify_fd(fd));
+
+	// Entries have no metadata besides what is needed to read the data back,
+	// such as times, so there is nothing less to write than fs_fsync() does
+	return file_sync(fd);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_READ, fd, fd_offset(fd), count);
+
+	FAILABLE(verify_fd(fd));
+
+	struct file_entry *file = &fd_table[fd].file->ref.entry;
+
+	if (file->flags & FILE_COMPRESSED) {
+		int read = compressed_read(file, fd_table[fd].offset, buf, count);
+		FAILABLE(read);
+
+		fd_table[fd].offset += read;
+		return fat_checked(read);
+	}
+
+	if (file->flags & FILE_SPARSE) {
+		int read = sparse_read(file, fd_table[fd].offset, buf, count);
+		FAILABLE(read);
+
+		fd_table[fd].offset += read;
+		return fat_checked(read);
+	}
+
+	if (file->flags & FILE_PACKED) {
+		size_t offset = fd_table[fd].offset;
+
+		if (offset >= file->fsize) {
+			return 0;
+		}
+		if (count > file->fsize - offset) {
+			count = file->fsize - offset;
+		}
+
+		uint8_t *block = frag_block_get(file->first_block_i, false);
+		if (!block) {
+			return -1;
+		}
+		memcpy(buf, block + file->frag_slot * FRAG_SLOT_SIZE + offset, count);
+
+		fd_table[fd].offset += count;
+		return fat_checked(count);
+	}
+
+   	uint32_t data_index = file->first_block_i;
+
+    size_t startingByte = fd_table[fd].offset;
+    size_t finalByte = startingByte + count - 1;
+
+
+	if (finalByte > file->fsize - 1) {
+        finalByte = file->fsize - 1;
+    }
+
+	uint8_t *bounce_buffer = (uint8_t*)calloc(BLOCK_SIZE, sizeof(uint8_t));
+
+	// Large reads only follow the chain here, leaving the whole blocks for
+	// io_job_run() to read in parallel
+	struct io_job job = { 0 };
+	if (count >= IO_PARALLEL_MIN * BLOCK_SIZE) {
+		job.blocks = (uint32_t*)malloc((count / BLOCK_SIZE) * sizeof(uint32_t));
+	}
+
+    int status = 0;
+    size_t blocksIteratedOver = 0;
+    size_t total_bytes_read = 0;
+	while (data_index != FAT_EOC) {
+        size_t blockLowerBound = blocksIteratedOver * BLOCK_SIZE;
+        size_t blockUpperBound = ((blocksIteratedOver + 1) * BLOCK_SIZE) - 1;
+
+		// If byte upper bound is greater than starting byte, we know that
+		// this block intersects with the bytes that we are trying to read
+		if (blockUpperBound >= startingByte) {
+            int start_read, end_read;
+
+			if (blockLowerBound < startingByte) {
+				// The start of the section to read is in the middle of the block
+				start_read = startingByte - blockLowerBound;
+			} else {
+				start_read = 0;
+			}
+
+			if (blockUpperBound > finalByte) {
+				// The end of the section to read is in the middle of the block
+				end_read = finalByte - blockLowerBound;
+			} else {
+				end_read = BLOCK_SIZE - 1;
+			}
+
+			if (start_read == 0 && end_read == BLOCK_SIZE - 1) {
+                fs_print("Direct read\n");
+				stat_add(STAT_DIRECT_READS, 1);
+				// Perfect case
+				if (job.blocks) {
+					if (job.num_blocks == 0) {
+						job.buf = (uint8_t*)buf + total_bytes_read;
+					}
+					job.blocks[job.num_blocks++] = data_index;
+				} else if (csum_block_read(layout.data_i + data_index, buf + total_bytes_read) == -1) {
+					status = -1;
+					break;
+				}
+			} else {
+                fs_print("Bounce read\n");
+				stat_add(STAT_BOUNCE_READS, 1);
+				// We're don't need the whole block so we use a bounce buffer
+				if (csum_block_read(layout.data_i + data_index, bounce_buffer) == -1) {
+					status = -1;
+					break;
+				}
+				memcpy(buf + total_bytes_read, bounce_buffer + start_read, end_read - start_read + 1);
+			}
+
+			total_bytes_read += end_read - start_read + 1;
+
+			// Stop at the block holding the last byte, even when the read
+			// ends exactly on its boundary
+			if (blockUpperBound >= finalByte) {
+				break;
+			}
+		}
+
+		data_index = fat_next(data_index);
+		blocksIteratedOver++;
+	}
+
+	free(bounce_buffer);
+
+	if (status == 0 && job.num_blocks > 0) {
+		status = io_job_run(&job);
+	}
+	free(job.blocks);
+	FAILABLE(status);
+
+	// Increment offset in fd_table
+	fd_table[fd].offset += total_bytes_read;
+
+	return fat_checked(total_bytes_read);
+}
+// Progress of one fs_defrag() call against its budget
+struct defrag_state {
+	const struct fs_defrag_options *options;
+	struct fs_defrag_report *report;
+	uint64_t start_ns;
+	uint8_t *bounce_buffer;
+	bool stopped;
+};
+
+// Counts the blocks of a chain and its extents, the runs of consecutive
+// blocks. Returns false if some block is shared with a clone
+bool chain_extents(uint32_t data_index, int *num_blocks, int *num_extents) {
+	bool shared = false;
+
+	*num_blocks = 0;
+	*num_extents = 0;
+	while (data_index != FAT_EOC) {
+		uint32_t next_index = fat_next(data_index);
+
+		shared = shared || fat_ref_count(data_index) > 1;
+		*num_blocks += 1;
+		if (next_index != data_index + 1) {
+			*num_extents += 1;
+		}
+		data_index = next_index;
+	}
+
+	return !shared;
+}
+
+// Returns the first block of a run of count free blocks, or -1
+int first_free_run(int count) {
+	int i, run = 0;
+
+	stat_add(STAT_ALLOC_SCANS, 1);
+	for (i = 1; i < layout.num_data; ++i) {
+		run = fat_entry_at_index(i) == 0 ? run + 1 : 0;
+		if (run == count) {
+			stat_add(STAT_ALLOC_SCAN_ENTRIES, i + 1);
+			return i - count + 1;
+		}
+	}
+
+	stat_add(STAT_ALLOC_SCAN_ENTRIES, layout.num_data);
+	return -1;
+}
+
+bool defrag_over_budget(struct defrag_state *state, int num_blocks) {
+	const struct fs_defrag_options *options = state->options;
+
+	// The first file of a call is always moved, so that even a file larger
+	// than the budget gets defragmented eventually
+	if (!options || state->report->blocks_moved == 0) {
+		return false;
+	}
+
+	if (options->max_blocks && state->report->blocks_moved + num_blocks > options->max_blocks) {
+		return true;
+	}
+
+	return options->max_ns && stat_now() - state->start_ns >= options->max_ns;
+}
+
+// Moves a fragmented file into a run of free blocks. The copy is complete and
+// on disk before the entry points at it, and the old chain is only freed
+// afterwards, so that a crash at worst leaves blocks for fs_check to free
+int defrag_file(struct defrag_state *state, struct file_ref *ref) {
+	int i, num_blocks, num_extents;
+	struct file_entry *file = &ref->entry;
+
+	// Use the entry of the open file if any, which is the one that changes
+	struct open_file *open = open_file_find(ref);
+	if (open) {
+		ref = &open->ref;
+		file = &ref->entry;
+		open->tail_i = FAT_EOC;
+	}
+
+	// Directories, compressed, packed and sparse files keep their blocks
+	if (file->flags & (FILE_DIR | FILE_COMPRESSED | FILE_PACKED | FILE_SPARSE)) {
+		return 0;
+	}
+
+	state->report->files++;
+	if (file->first_block_i == FAT_EOC) {
+		return 0;
+	}
+
+	bool movable = chain_extents(file->first_block_i, &num_blocks, &num_extents);
+	state->report->extents += num_extents;
+	if (num_extents <= 1) {
+		return 0;
+	}
+	state->report->fragmented++;
+
+	// Clones would lose the blocks they share
+	if (!movable) {
+		return 0;
+	}
+
+	if (defrag_over_budget(state, num_blocks)) {
+		state->stopped = true;
+		return 0;
+	}
+
+	int run = first_free_run(num_blocks);
+	if (run == -1) {
+		return 0;
+	}
+
+	uint32_t data_index = file->first_block_i;
+	for (i = 0; i < num_blocks; ++i) {
+		FAILABLE(csum_block_read(layout.data_i + data_index, state->bounce_buffer));
+		FAILABLE(csum_block_write(layout.data_i + run + i, state->bounce_buffer));
+		data_index = fat_next(data_index);
+	}
+
+	struct file_entry moved = *file;
+	uint32_t prev_index = FAT_EOC;
+	for (i = 0; i < num_blocks; ++i) {
+		fat_set_entry(run + i, FAT_EOC);
+		link_block(&moved, prev_index, run + i);
+		prev_index = run + i;
+	}
+	fs_backup();
+
+	// The entry is on disk before the old chain is freed, root directory
+	// entries only being written by fs_backup()
+	uint32_t old_index = file->first_block_i;
+	file->first_block_i = moved.first_block_i;
+	FAILABLE(file_ref_store(ref));
+	fs_backup();
+	free_chain(old_index);
+	fs_backup();
+
+	state->report->blocks_moved += num_blocks;
+	state->report->extents -= num_extents - 1;
+	state->report->fragmented--;
+
+	return 0;
+}
+
+int defrag_dir(struct defrag_state *state, uint32_t dir_i) {
+	int i;
+
+	struct dir_block *block = (struct dir_block*)malloc(sizeof(struct dir_block));
+	if (!block) {
+		return -1;
+	}
+
+	int slot = 0;
+	uint32_t data_index = dir_i;
+	while (data_index != FAT_EOC && !state->stopped) {
+		if (csum_block_read(layout.data_i + data_index, block) == -1) {
+			free(block);
+			return -1;
+		}
+
+		for (i = 0; i < (int)DIR_SLOTS && !state->stopped; ++i, ++slot) {
+			if (block->entries[i].fname[0] == '\0') {
+				continue;
+			}
+
+			struct file_ref ref;
+			file_entry_load(&ref.entry, block->entries + i);
+			ref.dir_i = dir_i;
+			ref.slot = slot;
+
+			int ret = ref.entry.flags & FILE_DIR ? defrag_dir(state, ref.entry.first_block_i) : defrag_file(state, &ref);
+			if (ret == -1) {
+				free(block);
+				return -1;
+			}
+		}
+
+		data_index = fat_next(data_index);
+	}
+
+	free(block);
+	return 0;
+}
+
+int fs_defrag(const struct fs_defrag_options *options, struct fs_defrag_report *report)
+{
+	FS_LOCKED();
+	STAT_TIMED(FS_OP_DEFRAG, -1, options ? options->max_blocks : 0, options ? options->max_ns : 0);
+
+	int i, ret = 0;
+	struct defrag_state state;
+
+	if (!is_disk_opened() || !report) {
+        fs_print("fs not opened\n");
+		return -1;
+	}
+
+	memset(report, 0, sizeof(struct fs_defrag_report));
+	state.options = options;
+	state.report = report;
+	state.start_ns = stat_now();
+	state.stopped = false;
+	state.bounce_buffer = (uint8_t*)malloc(BLOCK_SIZE);
+	if (!state.bounce_buffer) {
+		return -1;
+	}
+
+	// Files that are already contiguous cost nothing but a walk of their
+	// chain, so every call simply starts over from the root directory
+	for (i = 0; i < FS_FILE_MAX_COUNT && ret == 0 && !state.stopped; ++i) {
+		if (root_dir->entries[i].fname[0] == '\0') {
+			continue;
+		}
+
+		struct file_ref ref;
+		ref.entry = root_dir->entries[i];
+		ref.dir_i = FAT_EOC;
+		ref.slot = i;
+
+		if (ref.entry.flags & FILE_DIR) {
+			ret = defrag_dir(&state, ref.entry.first_block_i);
+		} else {
+			ret = defrag_file(&state, &ref);
+		}
+	}
+
+	free(state.bounce_buffer);
+	FAILABLE(ret);
+
+	return fat_checked(state.stopped ? 1 : 0);
+}
+
+// Owners of data blocks, as claimed by fs_check. Only regular file chains may
+// share blocks (the suffixes shared by clones), fragment blocks are shared by
+// the packed files in their slots, and the blocks of hole map entries flagged
+// HOLE_SHARED by the sparse files pointing at them
+enum check_owner {
+	OWNER_NONE,
+	OWNER_HEAD,
+	OWNER_DATA,
+	OWNER_DIR,
+	OWNER_MAP,
+	OWNER_CHUNK,
+	OWNER_SPARSE,
+	OWNER_FRAG,
+	OWNER_SHARED
+};
+
+// Repairs found by the check workers, applied once the scan is over
+enum check_fix_kind {
+	FIX_SET_EOC,
+	FIX_CUT_LOOP,
+	FIX_SET_SIZE,
+	FIX_FRAG_HEADER,
+	FIX_DIR_HEADER,
+	FIX_FREE,
+	FIX_CLONES
+};
+
+struct check_fix {
+	enum check_fix_kind kind;
+	uint32_t block;
+	uint64_t value;
+	uint64_t value2;
+	struct file_ref ref;
+};
+
+struct check_state {
+	int flags;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// Entries waiting to be checked, and entries being checked
+	struct file_ref *queue;
+	size_t queue_len;
+	size_t queue_cap;
+	int busy;
+
+	struct check_fix *fixes;
+	size_t fixes_len;
+	size_t fixes_cap;
+
+	// Set when a repair changed chains that were not walked to their end
+	bool rescan;
+	// Set when some file or directory could not be walked, its blocks and
+	// fragment slots then look unused but must not be freed
+	bool partial;
+	// Set when the FAT or root directory doesn't match its checksums, nothing
+	// found is then trusted enough to be repaired
+	bool bad_metadata;
+
+	// Per data block: the owner, the number of FAT entries pointing at it,
+	// and the fragment slots used by packed files
+	uint8_t *owner;
+	uint32_t *refs;
+	uint32_t *frag_used;
+
+	struct fs_check_report *report;
+};
+
+void check_problem(struct check_state *state, const char *fmt, ...) {
+	va_list args;
+
+	__atomic_fetch_add(&state->report->errors, 1, __ATOMIC_RELAXED);
+
+	if (state->flags & FS_CHECK_VERBOSE) {
+		pthread_mutex_lock(&state->lock);
+		va_start(args, fmt);
+		printf("fs_check: ");
+		vprintf(fmt, args);
+		printf("\n");
+		va_end(args);
+		pthread_mutex_unlock(&state->lock);
+	}
+}
+
+void check_add_fix(struct check_state *state, enum check_fix_kind kind, uint32_t block,
+		   uint64_t value, uint64_t value2, const struct file_ref *ref) {
+	pthread_mutex_lock(&state->lock);
+	if (state->fixes_len == state->fixes_cap) {
+		size_t cap = state->fixes_cap ? 2 * state->fixes_cap : 64;
+		struct check_fix *fixes = (struct check_fix*)realloc(state->fixes, cap * sizeof(struct check_fix));
+		if (!fixes) {
+			pthread_mutex_unlock(&state->lock);
+			return;
+		}
+		state->fixes = fixes;
+		state->fixes_cap = cap;
+	}
+
+	struct check_fix *fix = state->fixes + state->fixes_len++;
+	fix->kind = kind;
+	fix->block = block;
+	fix->value = value;
+	fix->value2 = value2;
+	if (ref) {
+		fix->ref = *ref;
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+void check_push(struct check_state *state, const struct file_ref *ref) {
+	pthread_mutex_lock(&state->lock);
+	if (state->queue_len == state->queue_cap) {
+		size_t cap = state->queue_cap ? 2 * state->queue_cap : 256;
+		struct file_ref *queue = (struct file_ref*)realloc(state->queue, cap * sizeof(struct file_ref));
+		if (!queue) {
+			pthread_mutex_unlock(&state->lock);
+			return;
+		}
+		state->queue = queue;
+		state->queue_cap = cap;
+	}
+
+	state->queue[state->queue_len++] = *ref;
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+}
+
+// Claims a block for an owner. Returns false if the block is out of range or
+// already owned by someone it can't be shared with
+bool check_claim(struct check_state *state, uint32_t data_index, enum check_owner kind) {
+	uint8_t expected = OWNER_NONE;
+
+	if (data_index == 0 || data_index >= (uint32_t)layout.num_data) {
+		return false;
+	}
+
+	if (__atomic_compare_exchange_n(state->owner + data_index, &expected, kind, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return true;
+	}
+
+	return expected == kind && (kind == OWNER_DATA || kind == OWNER_FRAG || kind == OWNER_SHARED);
+}
+
+// Walks and claims a chain whose head has already been claimed. Returns its
+// length, stopping at the first broken link, which gets marked as the end of
+// the chain. If limit is set, links past limit blocks are cut when not shared
+size_t check_chain(struct check_state *state, const char *name, uint32_t data_index,
+		   enum check_owner kind, size_t limit) {
+	size_t len = 0;
+	bool shared = false;
+
+	while (data_index != FAT_EOC) {
+		len++;
+		shared = shared || state->refs[data_index] > 1;
+
+		uint32_t next_index = fat_next(data_index);
+		if (next_index == 0) {
+			check_problem(state, "%s: block %" PRIu32 " is marked free", name, data_index);
+			check_add_fix(state, FIX_SET_EOC, data_index, 0, 0, NULL);
+			break;
+		}
+		if (next_index == FAT_EOC) {
+			break;
+		}
+
+		// Blocks past the size of a file can only be cut if no other file
+		// uses them, shared blocks are left to the other files
+		if (limit && len == limit && !shared) {
+			check_problem(state, "%s: chain longer than its size", name);
+			check_add_fix(state, FIX_SET_EOC, data_index, 0, 0, NULL);
+			break;
+		}
+
+		if (len > (size_t)layout.num_data) {
+			check_problem(state, "%s: chain loops", name);
+			check_add_fix(state, FIX_CUT_LOOP, data_index, 0, 0, NULL);
+			break;
+		}
+
+		if (next_index >= (uint32_t)layout.num_data) {
+			check_problem(state, "%s: block %" PRIu32 " links out of the disk", name, data_index);
+			check_add_fix(state, FIX_SET_EOC, data_index, 0, 0, NULL);
+			break;
+		}
+
+		if (!check_claim(state, next_index, kind)) {
+			check_problem(state, "%s: block %" PRIu32 " is cross-linked", name, next_index);
+			break;
+		}
+
+		data_index = next_index;
+	}
+
+	return len;
+}
+
+// Claims the head of a chain, which no other chain may link to
+bool check_head(struct check_state *state, const char *name, uint32_t data_index, enum check_owner kind) {
+	if (data_index == 0 || data_index >= (uint32_t)layout.num_data) {
+		check_problem(state, "%s: first block %" PRIu32 " out of the disk", name, data_index);
+		return false;
+	}
+
+	if (state->refs[data_index] > 0 || !check_claim(state, data_index, kind)) {
+		check_problem(state, "%s: first block %" PRIu32 " is cross-linked", name, data_index);
+		state->partial = true;
+		return false;
+	}
+
+	return true;
+}
+
+void check_packed(struct check_state *state, const struct file_ref *ref) {
+	const struct file_entry *file = &ref->entry;
+	const char *name = (const char*)file->fname;
+	uint32_t data_index = file->first_block_i;
+
+	if (file->frag_slot < 1 || file->frag_count < 1 || file->frag_slot + file->frag_count > FRAG_SLOTS ||
+		file->fsize > (uint64_t)file->frag_count * FRAG_SLOT_SIZE) {
+		check_problem(state, "%s: invalid fragment slots", name);
+		return;
+	}
+
+	if (data_index == 0 || data_index >= (uint32_t)layout.num_data ||
+		state->refs[data_index] > 0 || !check_claim(state, data_index, OWNER_FRAG)) {
+		check_problem(state, "%s: fragment block %" PRIu32 " is cross-linked", name, data_index);
+		return;
+	}
+
+	if (fat_entry_at_index(data_index) != FAT_EOC) {
+		check_problem(state, "%s: fragment block %" PRIu32 " not marked as used", name, data_index);
+		check_add_fix(state, FIX_SET_EOC, data_index, 0, 0, NULL);
+	}
+
+	uint32_t mask = frag_mask(file->frag_slot, file->frag_count);
+	if (__atomic_fetch_or(state->frag_used + data_index, mask, __ATOMIC_RELAXED) & mask) {
+		check_problem(state, "%s: fragment slots are cross-linked", name);
+	}
+}
+
+void check_compressed(struct check_state *state, const struct file_ref *ref) {
+	int i;
+	const char *name = (const char*)ref->entry.fname;
+	uint32_t map_index = ref->entry.first_block_i;
+
+	if (map_index == FAT_EOC || !check_head(state, name, map_index, OWNER_MAP)) {
+		return;
+	}
+	check_chain(state, name, map_index, OWNER_MAP, 0);
+
+	struct chunk_map_block *map = (struct chunk_map_block*)malloc(sizeof(struct chunk_map_block));
+	if (!map) {
+		return;
+	}
+
+	while (map_index != FAT_EOC && map_index < (uint32_t)layout.num_data && map_index != 0) {
+		if (csum_block_read(layout.data_i + map_index, map) == -1) {
+			check_problem(state, "%s: cannot read chunk map", name);
+			state->partial = true;
+			break;
+		}
+
+		for (i = 0; i < (int)CHUNK_MAP_SIZE; i++) {
+			uint32_t clen = map->entries[i].clen & ~CHUNK_RAW;
+			if (!map->entries[i].clen) {
+				continue;
+			}
+			if (!check_head(state, name, map->entries[i].first_block_i, OWNER_CHUNK)) {
+				continue;
+			}
+
+			size_t len = check_chain(state, name, map->entries[i].first_block_i, OWNER_CHUNK, 0);
+			if (len != (clen + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+				check_problem(state, "%s: chunk %d has %zu blocks for %" PRIu32 " bytes", name, i, len, clen);
+			}
+		}
+
+		map_index = fat_entry_at_index(map_index);
+	}
+
+	free(map);
+}
+
+void check_sparse(struct check_state *state, const struct file_ref *ref) {
+	int i;
+	const char *name = (const char*)ref->entry.fname;
+	uint32_t map_index = ref->entry.first_block_i;
+	size_t block_i = 0;
+	size_t needed = (ref->entry.fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (map_index == FAT_EOC || !check_head(state, name, map_index, OWNER_MAP)) {
+		return;
+	}
+	check_chain(state, name, map_index, OWNER_MAP, 0);
+
+	struct hole_map_block *map = (struct hole_map_block*)malloc(sizeof(struct hole_map_block));
+	if (!map) {
+		return;
+	}
+
+	while (map_index != FAT_EOC && map_index < (uint32_t)layout.num_data && map_index != 0) {
+		if (csum_block_read(layout.data_i + map_index, map) == -1) {
+			check_problem(state, "%s: cannot read hole map", name);
+			state->partial = true;
+			break;
+		}
+
+		for (i = 0; i < (int)HOLE_MAP_SIZE; i++, block_i++) {
+			uint32_t data_index = map->blocks[i] & ~HOLE_SHARED;
+			if (!map->blocks[i]) {
+				continue;
+			}
+			if (block_i >= needed) {
+				check_problem(state, "%s: block %zu past the end of the file", name, block_i);
+			}
+
+			if (map->blocks[i] & HOLE_SHARED) {
+				// Other maps may point at it, but no chain may link to it
+				if (data_index == 0 || data_index >= (uint32_t)layout.num_data ||
+					state->refs[data_index] > 0 || !check_claim(state, data_index, OWNER_SHARED)) {
+					check_problem(state, "%s: shared block %" PRIu32 " is cross-linked", name, data_index);
+					continue;
+				}
+				check_chain(state, name, data_index, OWNER_SHARED, 1);
+				continue;
+			}
+			if (!check_head(state, name, data_index, OWNER_SPARSE)) {
+				continue;
+			}
+
+			// Each block is a chain of its own, links past it get cut
+			check_chain(state, name, data_index, OWNER_SPARSE, 1);
+		}
+
+		map_index = fat_entry_at_index(map_index);
+	}
+
+	free(map);
+}
+
+void check_dir(struct check_state *state, const struct file_ref *ref) {
+	int i;
+	const struct file_entry *dir = &ref->entry;
+	const char *name = (const char*)dir->fname;
+
+	if (!check_head(state, name, dir->first_block_i, OWNER_DIR)) {
+		return;
+	}
+
+	size_t len = check_chain(state, name, dir->first_block_i, OWNER_DIR, 0);
+	if (dir->fsize == 0 || dir->fsize != (uint64_t)len * BLOCK_SIZE) {
+		check_problem(state, "%s: directory size doesn't match its %zu blocks", name, len);
+		state->partial = true;
+		return;
+	}
+
+	int num_slots = len * DIR_SLOTS;
+	struct dir_entry *table = (struct dir_entry*)malloc(len * BLOCK_SIZE);
+	if (!table) {
+		state->partial = true;
+		return;
+	}
+
+	uint32_t data_index = dir->first_block_i;
+	for (i = 0; i < (int)len; i++) {
+		if (csum_block_read(layout.data_i + data_index, table + i * DIR_SLOTS) == -1) {
+			check_problem(state, "%s: cannot read directory", name);
+			state->partial = true;
+			free(table);
+			return;
+		}
+		data_index = fat_entry_at_index(data_index);
+	}
+
+	uint32_t count = 0, tombstones = 0;
+	for (i = 1; i < num_slots; i++) {
+		if (table[i].fname[0] == '\0') {
+			tombstones += (table[i].flags & FILE_DELETED) != 0;
+			continue;
+		}
+		count++;
+
+		// The entry must be reachable by probing from its first slot
+		char fname[FS_FILENAME_LEN];
+		memcpy(fname, table[i].fname, FS_FILENAME_LEN);
+		fname[FS_FILENAME_LEN - 1] = '\0';
+
+		int slot = dir_first_slot(fname, num_slots);
+		while (slot != i && (table[slot].fname[0] != '\0' || (table[slot].flags & FILE_DELETED))) {
+			slot = slot + 1 < num_slots ? slot + 1 : 1;
+		}
+		if (slot != i) {
+			check_problem(state, "%s: entry %s can't be found by lookups", name, fname);
+		}
+
+		struct file_ref child;
+		file_entry_load(&child.entry, table + i);
+		child.dir_i = dir->first_block_i;
+		child.slot = i;
+		check_push(state, &child);
+	}
+
+	struct dir_header *header = (struct dir_header*)table;
+	if (header->count != count || header->tombstones != tombstones) {
+		check_problem(state, "%s: directory header counts are wrong", name);
+		check_add_fix(state, FIX_DIR_HEADER, dir->first_block_i, count, tombstones, NULL);
+	}
+
+	free(table);
+}
+
+void check_entry(struct check_state *state, const struct file_ref *ref) {
+	const struct file_entry *file = &ref->entry;
+	const char *name = (const char*)file->fname;
+
+	if (file->flags & FILE_DIR) {
+		__atomic_fetch_add(&state->report->dirs, 1, __ATOMIC_RELAXED);
+		check_dir(state, ref);
+		return;
+	}
+
+	__atomic_fetch_add(&state->report->files, 1, __ATOMIC_RELAXED);
+
+	if (file->flags & FILE_PACKED) {
+		check_packed(state, ref);
+		return;
+	}
+
+	if (file->flags & FILE_COMPRESSED) {
+		check_compressed(state, ref);
+		return;
+	}
+
+	if (file->flags & FILE_SPARSE) {
+		check_sparse(state, ref);
+		return;
+	}
+
+	size_t needed = (file->fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t len = 0;
+	if (file->first_block_i != FAT_EOC) {
+		if (!check_head(state, name, file->first_block_i, OWNER_HEAD)) {
+			return;
+		}
+		len = check_chain(state, name, file->first_block_i, OWNER_DATA, needed);
+	}
+
+	if (len < needed) {
+		check_problem(state, "%s: %zu blocks for %" PRIu64 " bytes", name, len, file->fsize);
+		check_add_fix(state, FIX_SET_SIZE, 0, (uint64_t)len * BLOCK_SIZE, 0, ref);
+	}
+}
+
+void* check_worker(void *arg) {
+	struct check_state *state = (struct check_state*)arg;
+
+	pthread_mutex_lock(&state->lock);
+	while (true) {
+		while (state->queue_len == 0 && state->busy > 0) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		if (state->queue_len == 0) {
+			break;
+		}
+
+		struct file_ref ref = state->queue[--state->queue_len];
+		state->busy++;
+		pthread_mutex_unlock(&state->lock);
+
+		check_entry(state, &ref);
+
+		pthread_mutex_lock(&state->lock);
+		if (--state->busy == 0 && state->queue_len == 0) {
+			pthread_cond_broadcast(&state->cond);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+// Cuts the link that closes a loop in a chain
+void check_cut_loop(uint32_t data_index) {
+	uint8_t *visited = (uint8_t*)calloc(layout.num_data, sizeof(uint8_t));
+	if (!visited) {
+		return;
+	}
+
+	// Walking on from any block of the loop gets back to it
+	while (!visited[data_index]) {
+		visited[data_index] = 1;
+		uint32_t next_index = fat_entry_at_index(data_index);
+		if (visited[next_index]) {
+			fat_set_entry(data_index, FAT_EOC);
+			break;
+		}
+		data_index = next_index;
+	}
+
+	free(visited);
+}
+
+int check_apply(struct check_state *state, struct check_fix *fix) {
+	uint8_t *block;
+
+	switch (fix->kind) {
+	case FIX_SET_EOC:
+		fat_set_entry(fix->block, FAT_EOC);
+		return 0;
+	case FIX_CUT_LOOP:
+		check_cut_loop(fix->block);
+		state->rescan = true;
+		return 0;
+	case FIX_SET_SIZE:
+		fix->ref.entry.fsize = fix->value;
+		return file_ref_store(&fix->ref);
+	case FIX_FREE:
+		fat_set_entry(fix->block, 0);
+		return 0;
+	case FIX_CLONES:
+		superblock->clones = 1;
+		return superblock_write();
+	case FIX_FRAG_HEADER:
+	case FIX_DIR_HEADER:
+		block = (uint8_t*)malloc(BLOCK_SIZE);
+		if (!block || csum_block_read(layout.data_i + fix->block, block) == -1) {
+			free(block);
+			return -1;
+		}
+		if (fix->kind == FIX_FRAG_HEADER) {
+			((struct frag_header*)block)->used = fix->value;
+		} else {
+			((struct dir_header*)block)->count = fix->value;
+			((struct dir_header*)block)->tombstones = fix->value2;
+		}
+		int ret = csum_block_write(layout.data_i + fix->block, block);
+		free(block);
+		return ret;
+	}
+
+	return -1;
+}
+
+// Compares the blocks in use with their checksums. Mismatches are only
+// reported, since nothing tells whether the block or its checksum is wrong
+void check_csums(struct check_state *state) {
+	int i;
+
+	uint8_t *block = (uint8_t*)malloc(BLOCK_SIZE);
+	if (!block) {
+		return;
+	}
+
+	for (i = 1; i < layout.data_i + layout.num_data; i++) {
+		if (!csum_covers(i) || (i >= layout.data_i && state->owner[i - layout.data_i] == OWNER_NONE)) {
+			continue;
+		}
+
+		uint32_t *sum = csum_entry(i);
+		if (block_read(i, block) == -1 || !sum) {
+			check_problem(state, "cannot read block %d or its checksum", i);
+		} else if (*sum != crc32c(0, block, BLOCK_SIZE)) {
+			check_problem(state, "block %d doesn't match its checksum", i);
+			state->bad_metadata = state->bad_metadata || i < layout.data_i;
+		}
+	}
+
+	free(block);
+}
+
+int check_run(struct check_state *state, int threads) {
+	int i;
+
+	for (i = 1; i < layout.num_data; i++) {
+		uint32_t next = fat_entry_at_index(i);
+		if (next != 0 && next != FAT_EOC && next < (uint32_t)layout.num_data) {
+			state->refs[next]++;
+		}
+	}
+
+	// Shared blocks are only counted on disks marked as having clones, and
+	// would be freed along with either file otherwise
+	for (i = 1; i < layout.num_data && !superblock->clones; i++) {
+		if (state->refs[i] > 1) {
+			check_problem(state, "shared blocks but no clones in the superblock");
+			check_add_fix(state, FIX_CLONES, 0, 0, 0, NULL);
+			break;
+		}
+	}
+
+	if (fat_entry_at_index(0) != FAT_EOC) {
+		check_problem(state, "reserved block 0 is not marked as used");
+		check_add_fix(state, FIX_SET_EOC, 0, 0, 0, NULL);
+	}
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (root_dir->entries[i].fname[0] != '\0') {
+			struct file_ref ref;
+			ref.entry = root_dir->entries[i];
+			ref.dir_i = FAT_EOC;
+			ref.slot = i;
+			check_push(state, &ref);
+		}
+	}
+
+	// Every worker takes entries from the queue, directories adding theirs
+	pthread_t *workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+	if (!workers) {
+		return -1;
+	}
+	int started = 0;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(workers + i, NULL, check_worker, state) == 0) {
+			started++;
+		}
+	}
+	if (started == 0) {
+		check_worker(state);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+
+	struct frag_header *header = (struct frag_header*)malloc(BLOCK_SIZE);
+	for (i = 1; i < layout.num_data; i++) {
+		uint32_t entry = fat_entry_at_index(i);
+		if (state->owner[i] != OWNER_NONE) {
+			state->report->blocks_used++;
+		} else if (entry != 0) {
+			check_problem(state, "block %d is not used by any file", i);
+			if (!state->partial) {
+				check_add_fix(state, FIX_FREE, i, 0, 0, NULL);
+			}
+		}
+
+		if (state->owner[i] == OWNER_FRAG && header && csum_block_read(layout.data_i + i, header) == 0 &&
+			header->used != (state->frag_used[i] | 1)) {
+			check_problem(state, "fragment block %d has a wrong header", i);
+			if (!state->partial) {
+				check_add_fix(state, FIX_FRAG_HEADER, i, state->frag_used[i] | 1, 0, NULL);
+			}
+		}
+	}
+	free(header);
+
+	if (layout.csum_flags) {
+		check_csums(state);
+	}
+
+	if (!(state->flags & FS_CHECK_REPAIR) || state->fixes_len == 0 || state->bad_metadata) {
+		return 0;
+	}
+
+	for (i = 0; i < (int)state->fixes_len; i++) {
+		if (check_apply(state, state->fixes + i) == 0) {
+			state->report->repaired++;
+		}
+	}
+	fs_backup();
+	csum_settle();
+
+	return 0;
+}
+
+int fs_check(const char *diskname, int flags, int threads, struct fs_check_report *report)
+{
+	FS_LOCKED();
+
+	struct check_state state;
+	int pass, ret = -1;
+
+	if (is_disk_opened() || !report) {
+        fs_print("Cannot check while mounted\n");
+		return -1;
+	}
+
+	memset(report, 0, sizeof(struct fs_check_report));
+	FAILABLE(block_disk_open(diskname));
+
+	// Checksums are compared by check_csums(), reads must not fail on them
+	csum_verify = false;
+
+	if (superblock_read() == -1 || fat_read() == -1 || root_dir_read() == -1) {
+		csum_verify = true;
+		fs_release();
+		block_disk_close();
+		return -1;
+	}
+
+	memset(&state, 0, sizeof(struct check_state));
+	state.flags = flags;
+	state.report = report;
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	state.owner = (uint8_t*)calloc(layout.num_data, sizeof(uint8_t));
+	state.refs = (uint32_t*)calloc(layout.num_data, sizeof(uint32_t));
+	state.frag_used = (uint32_t*)calloc(layout.num_data, sizeof(uint32_t));
+
+	// A loop only gets its length once it is cut, so that the files with
+	// loops are checked again
+	for (pass = 0; pass < 2 && state.owner && state.refs && state.frag_used; pass++) {
+		state.rescan = false;
+		state.partial = false;
+		state.bad_metadata = false;
+		state.fixes_len = 0;
+		memset(state.owner, 0, layout.num_data * sizeof(uint8_t));
+		memset(state.refs, 0, layout.num_data * sizeof(uint32_t));
+		memset(state.frag_used, 0, layout.num_data * sizeof(uint32_t));
+
+		ret = check_run(&state, threads > 0 ? threads : 1);
+		if (ret == -1 || !state.rescan) {
+			break;
+		}
+
+		report->files = 0;
+		report->dirs = 0;
+		report->blocks_used = 0;
+	}
+
+	free(state.owner);
+	free(state.refs);
+	free(state.frag_used);
+	free(state.queue);
+	free(state.fixes);
+	pthread_mutex_destroy(&state.lock);
+	pthread_cond_destroy(&state.cond);
+
+	csum_verify = true;
+	fs_release();
+	block_disk_close();
+
+	return ret;
+}
@@ -2,16 +2,65 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
-/** Maximum filename length (including the NULL character) */
+/** Maximum length of a filename or of a path component (including the NULL
+ * character) */
 #define FS_FILENAME_LEN 16
 
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Default maximum number of open files, see fs_set_open_max() */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Checksums kept by a file system, see struct fs_format_options */
+#define FS_CSUM_METADATA	0x01	/* Superblock, FAT and root directory */
+#define FS_CSUM_DATA		0x02	/* Data blocks, implies the above */
+
+/** Options for fs_format() */
+struct fs_format_options {
+	/* Width of FAT entries, 16 or 32 bits. 0 picks the 16-bit format when the
+	 * disk is small enough for it */
+	int fat_bits;
+	/* FS_CSUM_* flags, 0 for no checksums */
+	int checksums;
+	/* Allocate host storage for the whole disk instead of leaving the blocks
+	 * that are still zero as holes of a sparse file */
+	int preallocate;
+};
+
+/**
+ * fs_format - Create a new file system
+ * @diskname: Name of the virtual disk file to create
+ * @data_blocks: Number of data blocks
+ * @options: Format options, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname with an empty file system of @data_blocks
+ * data blocks. Disks of up to 65535 blocks in total can use the original
+ * format with 16-bit FAT entries. Larger disks, and files larger than 4 GiB,
+ * need the format with 32-bit FAT entries. fs_mount() accepts both.
+ *
+ * Only the superblock, the first FAT block and the checksum region are
+ * written, the rest of the virtual disk file is left sparse. Formatting takes
+ * the same time whatever the number of data blocks, and the disk only takes
+ * host storage as it fills up.
+ *
+ * With checksums, a CRC32C of every covered block is kept in a region after the
+ * data blocks. Blocks are verified each time they are read and their
+ * checksum is updated when they are written, and a block that
+ * doesn't match its checksum makes the operation reading it fail. The
+ * superblock records which parts of the region may be out of date until the
+ * disk is unmounted, and their checksums are recomputed when mounting after a
+ * crash.
+ *
+ * Return: -1 if @data_blocks or @options are invalid, if a file system is
+ * currently mounted, or if the virtual disk file cannot be created. 0
+ * otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks,
+	      const struct fs_format_options *options);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -32,10 +81,36 @@ int fs_mount(const char *diskname);
  * disk file.
  *
  * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
- * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+ * cannot be closed, if there are still open file descriptors, or if requests
+ * submitted with fs_read_async() or fs_write_async() are pending. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_batch_begin - Start a batch of changes
+ *
+ * Every call that changes the file system writes the FAT and root directory
+ * back to the disk before returning. Between fs_batch_begin() and the matching
+ * fs_batch_end(), they are only written back once, by fs_batch_end(), which
+ * makes creating and writing many files cheaper. Until then, the changes of the
+ * batch can be lost if the program stops. Batches can be nested, and an
+ * unfinished batch ends with fs_umount().
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_batch_begin(void);
+
+/**
+ * fs_batch_end - End a batch of changes
+ *
+ * End the batch started by the matching fs_batch_begin(). Ending the outermost
+ * batch writes back the metadata changed by the batch, if any.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if no batch was
+ * started. 0 otherwise.
+ */
+int fs_batch_end(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -49,29 +124,88 @@ int fs_info(void);
  * fs_create - Create a new file
  * @filename: File name
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file named @filename in the mounted file system.
+ * String @filename must be NULL-terminated. It is either the name of a file in
+ * the root directory, or a path such as "dir/sub/file" naming a file in a
+ * directory created with fs_mkdir(), with an optional leading '/'. Each
+ * component of the path cannot exceed %FS_FILENAME_LEN characters (including
+ * the NULL character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if a component of @filename is too long, or if the root directory already
+ * contains %FS_FILE_MAX_COUNT files. 0 otherwise.
  */
 int fs_create(const char *filename);
 
+/**
+ * fs_mkdir - Create a new directory
+ * @dirname: Directory name
+ *
+ * Create a new and empty directory named @dirname, following the same rules as
+ * the filename given to fs_create(). Directories are stored as files holding a
+ * hash table of entries, which grows as needed, so that they are not limited to
+ * %FS_FILE_MAX_COUNT entries and finding an entry takes a single block read.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @dirname is invalid
+ * or already exists, or if there is no space left. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
 /**
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file named @filename from the mounted file system. @filename can
+ * also name an empty directory.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete, if file @filename is currently open, or if it is a directory that is
+ * not empty. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content as
+ * file @src. Apart from its first block, the clone shares the data blocks of
+ * @src until either file is written to, at which point the blocks being
+ * modified are copied (copy-on-write). String @dst follows the same rules as
+ * the filename given to fs_create().
+ *
+ * Shared blocks are reference counted, which takes a walk of the whole FAT. The
+ * first clone marks the disk in its superblock, and disks without a clone never
+ * pay for the walk.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is no file
+ * named @src, if @dst is invalid or already exists, if there is no space
+ * left for the clone, or if the superblock cannot be written. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_compress - Turn on compression for a file
+ * @filename: File name
+ *
+ * Switch the empty file named @filename to compressed mode. The content of a
+ * compressed file is split into chunks that are transparently compressed by
+ * fs_write() and decompressed by fs_read(), so that compressible data takes up
+ * fewer blocks on disk. Compressed files cannot be cloned with fs_clone().
+ *
+ * fs_write() buffers the chunk it writes to in memory, and compresses and
+ * stores it once writes move on to another chunk, or when the file is synced
+ * with fs_fsync() or its last file descriptor is closed. Running out of space
+ * then shows as an error from fs_fsync() or fs_close(), except when the disk
+ * is already short of room for the chunk, in which case fs_write() stores it
+ * right away and fails itself.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is no file
+ * named @filename, or if the file is not empty. 0 otherwise.
+ */
+int fs_compress(const char *filename);
+
 /**
  * fs_ls - List files on file system
  *
@@ -81,6 +215,103 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_ls_dir - List files in a directory
+ * @dirname: Directory name, "/" for the root directory
+ *
+ * List information about the files located in directory @dirname.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if there is no
+ * directory named @dirname. 0 otherwise.
+ */
+int fs_ls_dir(const char *dirname);
+
+/**
+ * fs_readdir - Iterate over the files in a directory
+ * @dirname: Directory name, "/" for the root directory
+ * @func: Function called with the name of each file of the directory, and
+ *        whether the file is itself a directory
+ * @arg: Argument passed to @func
+ *
+ * Unlike fs_ls_dir(), which prints the content of @dirname, hand each file of
+ * @dirname to @func, in no particular order. @func must not create or delete
+ * files in @dirname.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @func is NULL, if
+ * there is no directory named @dirname, or if it cannot be read. 0 otherwise.
+ */
+int fs_readdir(const char *dirname,
+	       void (*func)(const char *name, int is_dir, void *arg), void *arg);
+
+/**
+ * fs_set_open_max - Set the maximum number of open files
+ * @max: Maximum number of file descriptors open at the same time
+ *
+ * Change the maximum number of file descriptors that fs_open() hands out
+ * simultaneously, %FS_OPEN_MAX_COUNT by default. The descriptor table grows as
+ * needed, so a large maximum costs nothing until descriptors are actually
+ * open. Lowering the maximum doesn't close any file descriptor.
+ *
+ * Return: -1 if @max is 0 or too large. 0 otherwise.
+ */
+int fs_set_open_max(size_t max);
+
+/**
+ * fs_set_fat_prefetch - Prefetch the FAT in the background
+ * @enable: Whether to prefetch
+ *
+ * fs_mount() doesn't read the FAT, each of its blocks is read the first time
+ * an entry of the block is needed, so that mounting takes the same time
+ * whatever the size of the disk. With @enable set, the following mounts also
+ * start a thread that reads all the FAT blocks in the background, so that
+ * later operations don't have to wait for them. It is stopped by fs_umount().
+ */
+void fs_set_fat_prefetch(int enable);
+
+/**
+ * fs_set_io_threads - Set the threads sharing large reads and writes
+ * @threads: Number of threads besides the caller, or -1 for the default
+ *
+ * fs_read() and fs_write() calls covering many whole blocks first follow the
+ * file's chain of blocks, then read or write the blocks in ranges taken in
+ * turn by the calling thread and a pool of @threads threads, so that a single
+ * large call keeps several block reads or writes in flight. The pool is
+ * started by the first such call after mounting and stopped by fs_umount().
+ * By default, there is one thread per processor besides the caller, up to 16.
+ * With @threads set to 0, blocks are read and written one after the other.
+ */
+void fs_set_io_threads(int threads);
+
+/**
+ * fs_set_dedup - Share identical blocks between files
+ * @enable: Whether to deduplicate
+ *
+ * With @enable set, the following mounts hash each whole block written by
+ * fs_write() with CRC32C. A block identical to a block of another
+ * deduplicated file isn't written: the file points at the other file's block
+ * instead, and the block it held before is given back. Candidates are compared
+ * byte for byte before being shared. Deduplicated files are kept as sparse
+ * files, whose hole map takes one block per 1024 blocks of data, so a plain
+ * file is only turned into one by a write of whole blocks leaving it with at
+ * least the number of blocks set by fs_set_dedup_min(), 1 by default.
+ * Compressed and packed files are left as they are, as are the blocks of a
+ * file written before dedup was enabled until they are written again. A
+ * shared block is copied before either file writes part of it. The index of
+ * shared blocks is rebuilt from the hole maps the first time it is needed
+ * after mounting, from the checksums if the file system keeps them.
+ */
+void fs_set_dedup(int enable);
+
+/**
+ * fs_set_dedup_min - Set the smallest file worth deduplicating
+ * @blocks: Number of blocks, 1 at least
+ *
+ * Plain files are only turned into sparse files for deduplication once they
+ * reach @blocks blocks, see fs_set_dedup(). Raising it spares small files the
+ * block of a hole map when they are unlikely to share any.
+ */
+void fs_set_dedup_min(int blocks);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -90,12 +321,12 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. By default, a maximum of %FS_OPEN_MAX_COUNT files can be
+ * open simultaneously, see fs_set_open_max().
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * if @filename is a directory, or if the maximum number of files are already
+ * currently open. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -106,7 +337,10 @@ int fs_open(const char *filename);
  * Close file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if requests submitted on @fd with fs_read_async() or
+ * fs_write_async() are still queued or running. Also -1, although the file is
+ * closed, if data written to a compressed file could not be stored (see
+ * fs_compress()). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -117,10 +351,23 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the current size of file.
+ * open), or if the size of the file doesn't fit in an int, which sparse files
+ * can exceed (see fs_stat64()). Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_stat64 - Get file status of any size
+ * @fd: File descriptor
+ * @size: Where to store the size of the file
+ *
+ * Same as fs_stat(), for files of any size that the file system can record.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). 0 otherwise.
+ */
+int fs_stat64(int fd, uint64_t *size);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -128,11 +375,16 @@ int fs_stat(int fd);
  *
  * Set the file offset (used for read and write operations) associated with file
  * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * fs_stat64(fd, &size) then fs_lseek(fd, size);
+ *
+ * @offset can be past the end of the file. Writing there leaves a hole between
+ * the end of the file and @offset, which reads as zeros. Holes covering whole
+ * blocks make the file sparse: they take no data blocks, and reading them
+ * involves no block I/O. Sparse files cannot be cloned with fs_clone().
  *
  * Return: -1 if file descriptor @fd is invalid (i.e., out of bounds, or not
- * currently open), or if @offset is larger than the current file size. 0
- * otherwise.
+ * currently open), or if @offset is larger than the largest file size that
+ * the file system can record. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -147,16 +399,69 @@ int fs_lseek(int fd, size_t offset);
  * least @count bytes.
  *
  * When the function attempts to write past the end of the file, the file is
- * automatically extended to hold the additional bytes. If the underlying disk
+ * automatically extended to hold the additional bytes, leaving a hole if the
+ * file offset was past the end of the file (see fs_lseek()). If the underlying disk
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually written.
+ * open), or if a FAT block needed by the write cannot be read, in which case
+ * part of the data may have been written. Otherwise return the number of bytes
+ * actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_append - Append to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Move the file offset of @fd to the end of the file, then write to it as
+ * fs_write() does. The last block of an open file is remembered once it has
+ * been written, so that appends take the same time however long the file
+ * grows, rather than following its whole chain of blocks.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually written.
+ */
+int fs_append(int fd, void *buf, size_t count);
+
+/**
+ * fs_fsync - Make a file durable
+ * @fd: File descriptor
+ *
+ * Flush the data written to the file referenced by file descriptor @fd to
+ * stable storage, then the metadata that the file's data depends on: the FAT
+ * entries of its blocks and its directory entry. The data is durable before the
+ * metadata pointing to it is written. Metadata is normally written back
+ * after every operation, so only inside a batch (see fs_batch_begin()) is
+ * there metadata left for fs_fsync() to write. The FAT and directory entries
+ * of other files that changed in the batch stay pending until the batch ends,
+ * and so do the blocks that the file freed, which a crash leaves allocated
+ * until fs_check() repairs the disk.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if the disk cannot be flushed, or if data written to a compressed
+ * file could not be stored since the last call (see fs_compress()). 0
+ * otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_fdatasync - Make a file's data durable
+ * @fd: File descriptor
+ *
+ * Same as fs_fsync(). Directory entries hold no metadata besides what is needed
+ * to read the file's data back, such as times, so there is nothing that
+ * fs_fdatasync() could leave out.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or if the disk cannot be flushed. 0 otherwise.
+ */
+int fs_fdatasync(int fd);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -173,8 +478,404 @@ int fs_write(int fd, void *buf, size_t count);
  * implicitly incremented by the number of bytes that were actually read.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+ * open), or if a block of the file or a FAT block needed to find it cannot be
+ * read. Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * typedef fs_async_cb - Completion callback of an asynchronous request
+ * @result: What fs_read() or fs_write() returned for the request
+ * @arg: Argument given when submitting the request
+ */
+typedef void (*fs_async_cb)(int result, void *arg);
+
+/**
+ * struct fs_async_completion - Completed asynchronous request
+ * @result: What fs_read() or fs_write() returned for the request
+ * @arg: Argument given when submitting the request
+ */
+struct fs_async_completion {
+	int result;
+	void *arg;
+};
+
+/**
+ * fs_read_async - Read from a file without waiting
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @cb: Function called once the read is done, may be NULL
+ * @arg: Argument passed along with the result
+ *
+ * Queue a call to fs_read() and return at once. Requests run one at a time on
+ * an I/O thread of the library, in the order they were submitted, so requests
+ * on the same file descriptor see each other's offset updates as synchronous
+ * calls would. @buf must stay valid until the request completes.
+ *
+ * Once the read is done, @cb is called on the I/O thread with its result and
+ * @arg. @cb may submit more requests and call the other fs_*() functions, but
+ * must not wait with fs_async_wait(). If @cb is NULL, the completion is instead
+ * queued for fs_async_reap(), and the eventfd returned by fs_async_eventfd() is
+ * signalled.
+ *
+ * Every fs_*() call holds a lock of the file system, so the other calls can be
+ * made from any thread while requests are pending, such as an event loop
+ * reaping completions. They run between requests, and calls on a file
+ * descriptor with requests pending see the offset that the requests run so far
+ * left. fs_close() fails on a file descriptor until its requests have run,
+ * although their callbacks may close it, and fs_umount() fails until every
+ * request has completed.
+ *
+ * Return: -1 if the request cannot be queued. 0 otherwise.
+ */
+int fs_read_async(int fd, void *buf, size_t count, fs_async_cb cb, void *arg);
+
+/**
+ * fs_write_async - Write to a file without waiting
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @cb: Function called once the write is done, may be NULL
+ * @arg: Argument passed along with the result
+ *
+ * Queue a call to fs_write() and return at once, see fs_read_async().
+ *
+ * Return: -1 if the request cannot be queued. 0 otherwise.
+ */
+int fs_write_async(int fd, void *buf, size_t count, fs_async_cb cb, void *arg);
+
+/**
+ * fs_async_eventfd - Get the completion eventfd
+ *
+ * Get an eventfd, created on first use, whose counter is incremented for each
+ * request completed without a callback. An event loop can wait for it to be
+ * readable, read it to reset the counter, then collect the completions with
+ * fs_async_reap().
+ *
+ * Return: -1 if the eventfd cannot be created. The eventfd otherwise.
+ */
+int fs_async_eventfd(void);
+
+/**
+ * fs_async_reap - Collect completed requests
+ * @completions: Array to fill with completions
+ * @max: Number of entries of @completions
+ *
+ * Take up to @max completions of requests submitted without a callback, oldest
+ * first, without waiting.
+ *
+ * Return: -1 if @completions is NULL or @max is negative. Otherwise the number
+ * of completions taken.
+ */
+int fs_async_reap(struct fs_async_completion *completions, int max);
+
+/**
+ * fs_async_wait - Wait for pending requests
+ *
+ * Wait until every request submitted so far has completed and its callback
+ * returned.
+ */
+void fs_async_wait(void);
+
+/** Budget of one fs_defrag() call, 0 for no limit */
+struct fs_defrag_options {
+	/* Number of blocks to move */
+	size_t max_blocks;
+	/* Time to spend, in nanoseconds */
+	uint64_t max_ns;
+};
+
+/**
+ * struct fs_defrag_report - Outcome of fs_defrag()
+ * @files: Number of regular files seen
+ * @fragmented: Number of files still split into more than one extent
+ * @extents: Total number of extents of the files, once moved
+ * @blocks_moved: Number of blocks moved
+ */
+struct fs_defrag_report {
+	uint64_t files;
+	uint64_t fragmented;
+	uint64_t extents;
+	uint64_t blocks_moved;
+};
+
+/**
+ * fs_defrag - Defragment files
+ * @options: Budget of the call, or NULL to defragment everything
+ * @report: Outcome of the call
+ *
+ * Move the blocks of every regular file whose chain is split into several
+ * extents (runs of consecutive blocks) into a single run of free blocks, so
+ * that the file can be read sequentially. A file is copied before its entry
+ * is switched to the copy, and its old blocks are freed last. Files that share
+ * blocks with a clone, compressed and packed files, and directories are left
+ * in place, as are files for which no run of free blocks is large enough.
+ *
+ * The file system stays mounted and files may be open. With @options, the call
+ * stops before exceeding its budget (though it always moves at least one file)
+ * and later calls pick up where it stopped.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if an I/O error
+ * occurs. 1 if the call stopped because of its budget, 0 otherwise.
+ */
+int fs_defrag(const struct fs_defrag_options *options,
+	      struct fs_defrag_report *report);
+
+/** Counters filled by fs_get_stats(), all cumulative since the last
+ * fs_reset_stats() */
+struct fs_stats {
+	/* Calls to block_read() and block_write(), and bytes transferred */
+	uint64_t block_reads;
+	uint64_t block_read_bytes;
+	uint64_t block_writes;
+	uint64_t block_write_bytes;
+	/* Blocks transferred by fs_read() and fs_write() straight between the
+	 * disk and the caller's buffer, or through a bounce buffer because only
+	 * part of the block was needed */
+	uint64_t direct_reads;
+	uint64_t bounce_reads;
+	uint64_t direct_writes;
+	uint64_t bounce_writes;
+	/* FAT entries followed while walking chains */
+	uint64_t fat_hops;
+	/* Searches for a free block, and FAT entries they examined */
+	uint64_t alloc_scans;
+	uint64_t alloc_scan_entries;
+	/* Writes of the metadata (FAT and root directory) to disk, and blocks
+	 * they wrote */
+	uint64_t backups;
+	uint64_t backup_blocks;
+	/* FAT blocks read from disk, each on first use or by the prefetcher */
+	uint64_t fat_loads;
+	/* Blocks that didn't match their checksum when read */
+	uint64_t csum_errors;
+	/* Blocks written by sharing an identical block instead, see
+	 * fs_set_dedup() */
+	uint64_t dedup_blocks;
+};
+
+/** Operations timed by the library, see fs_get_latency() */
+enum fs_op {
+	FS_OP_FORMAT,
+	FS_OP_MOUNT,
+	FS_OP_UMOUNT,
+	FS_OP_INFO,
+	FS_OP_CREATE,
+	FS_OP_MKDIR,
+	FS_OP_DELETE,
+	FS_OP_CLONE,
+	FS_OP_COMPRESS,
+	FS_OP_LS,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_WRITE,
+	FS_OP_READ,
+	FS_OP_DEFRAG,
+	FS_OP_BATCH_BEGIN,
+	FS_OP_BATCH_END,
+	FS_OP_FSYNC,
+	FS_OP_FDATASYNC,
+	/* Writing the metadata to disk after a change */
+	FS_OP_BACKUP,
+	FS_OP_BLOCK_READ,
+	FS_OP_BLOCK_WRITE,
+	FS_OP_COUNT
+};
+
+/** Latency summary of an operation, filled by fs_get_latency() */
+struct fs_latency {
+	uint64_t count;
+	uint64_t total_ns;
+	/* Percentiles and maximum, rounded up to the histogram's resolution of
+	 * a quarter of a power of two */
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+};
+
+/**
+ * fs_get_stats - Get I/O and metadata counters
+ * @stats: Counters to fill
+ *
+ * Fill @stats with the library's counters. Counters are kept whether or not a
+ * file system is mounted and are cheap enough to be always on. They are
+ * updated without locks by each thread, so a snapshot taken while other
+ * threads use the library may be slightly inconsistent.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_reset_stats - Reset I/O and metadata counters
+ *
+ * Set all the counters returned by fs_get_stats() back to 0, and empty the
+ * latency histograms of fs_get_latency().
+ */
+void fs_reset_stats(void);
+
+/**
+ * fs_get_latency - Get the latency of an operation
+ * @op: Operation, one of enum fs_op
+ * @latency: Summary to fill
+ *
+ * Every public fs_*() call, every write of the metadata and every block_read()
+ * and block_write() call is timed into a histogram of its operation, with
+ * log-scale buckets. Fill @latency with the number of calls to @op, their
+ * total time and percentiles of their latency.
+ *
+ * Return: -1 if @op or @latency is invalid. 0 otherwise.
+ */
+int fs_get_latency(int op, struct fs_latency *latency);
+
+/**
+ * fs_op_name - Get the name of an operation
+ * @op: Operation, one of enum fs_op
+ *
+ * Return: NULL if @op is invalid. Otherwise the name of @op, such as "read".
+ */
+const char *fs_op_name(int op);
+
+/**
+ * fs_trace_start - Start tracing calls
+ * @events: Number of calls to keep
+ *
+ * Record the calls timed for fs_get_latency() into a ring buffer holding the
+ * last @events ones, discarding any previous trace. Each event holds the
+ * operation, the file descriptor (-1 if none), the offset (in the file, or on
+ * disk for block operations), the length asked for and the duration.
+ *
+ * Return: -1 if @events is 0 or the buffer cannot be allocated. 0 otherwise.
+ */
+int fs_trace_start(size_t events);
+
+/**
+ * fs_trace_stop - Stop tracing calls
+ *
+ * Stop recording calls. The trace is kept until the next fs_trace_start() so
+ * that it can still be dumped.
+ */
+void fs_trace_stop(void);
+
+/**
+ * fs_trace_dump - Write the trace to a file
+ * @filename: Name of the file to write, on the host
+ *
+ * Write the events of the trace to file @filename as CSV, oldest first, with
+ * a header line naming the columns. Times are in nanoseconds, event start
+ * times are relative to the fs_trace_start() call.
+ *
+ * Return: -1 if no trace was started or if @filename cannot be written. 0
+ * otherwise.
+ */
+int fs_trace_dump(const char *filename);
+
+/** Magic number at the start of a recording, before its first record */
+#define FS_RECORD_MAGIC "FSREC001"
+
+/**
+ * struct fs_record - One call of a recording
+ * @start_ns: Start of the call, relative to the fs_record_start() call
+ * @offset: Offset in the file
+ * @length: Number of bytes asked for
+ * @duration_ns: Duration of the call, saturated at UINT32_MAX
+ * @fd: File descriptor, the one returned for fs_open(), or -1
+ * @name_len: Length of the first file name, which follows the record
+ * @name2_len: Length of the second file name, which follows the first one
+ * @op: Operation, one of enum fs_op
+ *
+ * File names are stored without their terminating NULL character. Only the
+ * destination of fs_clone() is a second file name. fs_defrag() records its
+ * budget of blocks as @offset and of nanoseconds as @length.
+ */
+struct fs_record {
+	uint64_t start_ns;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t duration_ns;
+	int32_t fd;
+	uint16_t name_len;
+	uint16_t name2_len;
+	uint8_t op;
+	uint8_t padding[3];
+};
+
+/**
+ * fs_record_start - Start recording calls to a file
+ * @filename: Name of the file to write, on the host
+ *
+ * Unlike the trace of fs_trace_start(), which keeps the last calls in memory,
+ * write every public fs_*() call timed from now on to file @filename, as
+ * %FS_RECORD_MAGIC followed by a struct fs_record per call, so that the
+ * workload can be replayed later. The data read and written is not recorded.
+ * Any recording already going on is stopped first.
+ *
+ * Return: -1 if @filename cannot be created. 0 otherwise.
+ */
+int fs_record_start(const char *filename);
+
+/**
+ * fs_record_stop - Stop recording calls
+ *
+ * Stop the recording started by fs_record_start() and close its file.
+ *
+ * Return: -1 if no recording was started or if the file could not be fully
+ * written. 0 otherwise.
+ */
+int fs_record_stop(void);
+
+/** Flags of fs_check() */
+#define FS_CHECK_REPAIR		0x01	/* Repair the problems that can be */
+#define FS_CHECK_VERBOSE	0x02	/* Print every problem found */
+
+/**
+ * struct fs_check_report - Outcome of fs_check()
+ * @files: Number of files checked
+ * @dirs: Number of directories checked, not counting the root directory
+ * @blocks_used: Number of data blocks used by files and directories
+ * @errors: Number of problems found
+ * @repaired: Number of repairs written to the disk
+ */
+struct fs_check_report {
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t blocks_used;
+	uint64_t errors;
+	uint64_t repaired;
+};
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of %FS_CHECK_REPAIR and %FS_CHECK_VERBOSE
+ * @threads: Number of threads walking the files
+ * @report: Outcome of the check
+ *
+ * Check the file system contained in virtual disk @diskname, which must not be
+ * mounted. Every FAT chain must end with the end-of-chain marker, no block may
+ * belong to two files (except the blocks that clones share) or to none, and
+ * the length of every chain must match the size of its file. The files are
+ * divided among @threads threads, that claim the blocks they walk in a shared
+ * table to find cross-linked blocks.
+ *
+ * With %FS_CHECK_REPAIR, the problems that have a single solution are repaired:
+ * chains are truncated at their first broken link or loop and to the size of
+ * their file, files are shrunk to the length of their chain, blocks used by no
+ * file are freed, fragment and directory headers are rewritten, and disks with
+ * shared blocks are marked as holding clones in the superblock. Cross-links
+ * are only reported. On disks with checksums, blocks that don't match their
+ * checksum are reported, and nothing is repaired if the FAT or the root
+ * directory doesn't match.
+ *
+ * Return: -1 if a virtual disk is already mounted, or if @diskname cannot be
+ * opened or doesn't contain a file system. 0 otherwise, and @report is filled.
+ */
+int fs_check(const char *diskname, int flags, int threads,
+	     struct fs_check_report *report);
+
 #endif /* _FS_H */
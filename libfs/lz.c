@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * The encoding is a sequence of:
+ *
+ *   token | [literal length bytes] | literals | offset | [match length bytes]
+ *
+ * The high nibble of the token is the number of literals and the low nibble
+ * the match length minus LZ_MIN_MATCH. A nibble of 15 is continued by extra
+ * length bytes that are added up until one is smaller than 255. The offset is
+ * a little-endian 16-bit distance back into the output. The last sequence only
+ * holds literals and ends with the input.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t seq)
+{
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the extra bytes of a length whose nibble overflowed */
+static int put_length(uint8_t *dst, size_t cap, size_t *op, size_t n)
+{
+	while (n >= 255) {
+		if (*op >= cap)
+			return -1;
+		dst[(*op)++] = 255;
+		n -= 255;
+	}
+	if (*op >= cap)
+		return -1;
+	dst[(*op)++] = n;
+	return 0;
+}
+
+static int put_sequence(uint8_t *dst, size_t cap, size_t *op,
+			const uint8_t *lit, size_t nlit,
+			size_t offset, size_t mlen)
+{
+	size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+	if (*op >= cap)
+		return -1;
+	dst[(*op)++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+
+	if (nlit >= 15 && put_length(dst, cap, op, nlit - 15))
+		return -1;
+
+	if (*op + nlit > cap)
+		return -1;
+	memcpy(dst + *op, lit, nlit);
+	*op += nlit;
+
+	/* Final sequence, literals only */
+	if (!mlen)
+		return 0;
+
+	if (*op + 2 > cap)
+		return -1;
+	dst[(*op)++] = offset & 0xFF;
+	dst[(*op)++] = offset >> 8;
+
+	if (mcode >= 15 && put_length(dst, cap, op, mcode - 15))
+		return -1;
+
+	return 0;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	/* Last position + 1 at which each hashed 4-byte sequence was seen */
+	uint32_t table[1 << LZ_HASH_BITS];
+	size_t ip = 0, anchor = 0, op = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= len) {
+		uint32_t seq = read32(src + ip);
+		uint32_t h = lz_hash(seq);
+		size_t candidate = table[h];
+
+		table[h] = ip + 1;
+
+		if (!candidate || ip - (candidate - 1) > LZ_MAX_OFFSET ||
+		    read32(src + candidate - 1) != seq) {
+			ip++;
+			continue;
+		}
+
+		size_t ref = candidate - 1;
+		size_t mlen = LZ_MIN_MATCH;
+		while (ip + mlen < len && src[ref + mlen] == src[ip + mlen])
+			mlen++;
+
+		if (put_sequence(dst, cap, &op, src + anchor, ip - anchor,
+				 ip - ref, mlen))
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	if (put_sequence(dst, cap, &op, src + anchor, len - anchor, 0, 0))
+		return 0;
+
+	return op;
+}
+
+/* Reads the extra bytes of a length whose nibble overflowed */
+static int get_length(const uint8_t *src, size_t len, size_t *ip, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= len)
+			return -1;
+		b = src[(*ip)++];
+		*n += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	size_t ip = 0, op = 0;
+
+	while (ip < len) {
+		uint8_t token = src[ip++];
+		size_t nlit = token >> 4;
+		size_t mlen = token & 0xF;
+		size_t offset;
+
+		if (nlit == 15 && get_length(src, len, &ip, &nlit))
+			return -1;
+
+		if (ip + nlit > len || op + nlit > cap)
+			return -1;
+		memcpy(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		/* Final sequence, literals only */
+		if (ip == len)
+			break;
+
+		if (ip + 2 > len)
+			return -1;
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+
+		if (mlen == 15 && get_length(src, len, &ip, &mlen))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+
+		if (!offset || offset > op || op + mlen > cap)
+			return -1;
+
+		/* Byte by byte, since the match may overlap its own output */
+		while (mlen--) {
+			dst[op] = dst[op - offset];
+			op++;
+		}
+	}
+
+	return op;
+}
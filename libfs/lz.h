@@ -0,0 +1,35 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Number of bytes in @src
+ * @dst: Buffer to be filled with the compressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Compress @len bytes of @src into @dst using a byte-oriented LZ77 encoding
+ * (literal runs and back-references of up to 64 KiB). Callers that only want
+ * to keep data that actually shrinks can pass a @cap smaller than @len.
+ *
+ * Return: 0 if the compressed data does not fit in @cap bytes. Otherwise the
+ * number of bytes written to @dst.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data produced by lz_compress()
+ * @len: Number of bytes in @src
+ * @dst: Buffer to be filled with the decompressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Return: -1 if @src is corrupted or decompresses to more than @cap bytes.
+ * Otherwise the number of bytes written to @dst.
+ */
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif /* _LZ_H */
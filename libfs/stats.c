@@ -0,0 +1,411 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+#include "stats.h"
+
+struct stat_shard stat_shards[STAT_SHARDS];
+__thread int stat_shard_i = -1;
+
+/* Threads are handed the least used shard, and give it back when they exit */
+static pthread_mutex_t stat_shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stat_shard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stat_shard_key;
+
+static const char *op_names[FS_OP_COUNT] = {
+	[FS_OP_FORMAT] = "format",
+	[FS_OP_MOUNT] = "mount",
+	[FS_OP_UMOUNT] = "umount",
+	[FS_OP_INFO] = "info",
+	[FS_OP_CREATE] = "create",
+	[FS_OP_MKDIR] = "mkdir",
+	[FS_OP_DELETE] = "delete",
+	[FS_OP_CLONE] = "clone",
+	[FS_OP_COMPRESS] = "compress",
+	[FS_OP_LS] = "ls",
+	[FS_OP_OPEN] = "open",
+	[FS_OP_CLOSE] = "close",
+	[FS_OP_STAT] = "stat",
+	[FS_OP_LSEEK] = "lseek",
+	[FS_OP_WRITE] = "write",
+	[FS_OP_READ] = "read",
+	[FS_OP_DEFRAG] = "defrag",
+	[FS_OP_BATCH_BEGIN] = "batch_begin",
+	[FS_OP_BATCH_END] = "batch_end",
+	[FS_OP_FSYNC] = "fsync",
+	[FS_OP_FDATASYNC] = "fdatasync",
+	[FS_OP_BACKUP] = "backup",
+	[FS_OP_BLOCK_READ] = "block_read",
+	[FS_OP_BLOCK_WRITE] = "block_write",
+};
+
+/* One call as recorded in the trace */
+struct stat_event {
+	uint64_t start;
+	uint64_t duration;
+	uint64_t offset;
+	uint64_t length;
+	int32_t fd;
+	int32_t op;
+};
+
+/* Ring buffer of the last trace_len calls, trace_next counting them all.
+ * trace_writers counts the calls adding an event, which fs_trace_start()
+ * waits for before replacing the buffer */
+static struct stat_event *trace;
+static size_t trace_len;
+static uint64_t trace_next;
+static uint64_t trace_epoch;
+static bool trace_on;
+static int trace_writers;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Recording of the public calls, written as they end */
+static FILE *record_file;
+static uint64_t record_epoch;
+static bool record_on;
+static bool record_failed;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(sizeof(struct fs_record) == 40,
+	       "struct fs_record is part of the recording format");
+
+_Static_assert(sizeof(struct fs_stats) == STAT_COUNT * sizeof(uint64_t),
+	       "struct fs_stats must match enum stat_counter");
+
+static void stat_shard_release(void *shard)
+{
+	pthread_mutex_lock(&stat_shard_lock);
+	__atomic_fetch_sub(&stat_shards[(intptr_t)shard - 1].users, 1,
+			   __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stat_shard_lock);
+}
+
+static void stat_shard_key_create(void)
+{
+	pthread_key_create(&stat_shard_key, stat_shard_release);
+}
+
+int stat_shard_assign(void)
+{
+	int i, best = 0;
+
+	pthread_once(&stat_shard_once, stat_shard_key_create);
+
+	pthread_mutex_lock(&stat_shard_lock);
+	for (i = 1; i < STAT_SHARDS; i++)
+		if (stat_shards[i].users < stat_shards[best].users)
+			best = i;
+	__atomic_fetch_add(&stat_shards[best].users, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stat_shard_lock);
+
+	/* The key's destructor gives the shard back when the thread exits */
+	pthread_setspecific(stat_shard_key, (void *)(intptr_t)(best + 1));
+	stat_shard_i = best;
+
+	return best;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	int msb, sub, bucket;
+
+	if (ns < STAT_HIST_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	sub = (ns >> (msb - 2)) & (STAT_HIST_SUB - 1);
+	bucket = (msb - 1) * STAT_HIST_SUB + sub;
+
+	return bucket < STAT_HIST_BUCKETS ? bucket : STAT_HIST_BUCKETS - 1;
+}
+
+/* Largest latency that falls into a bucket */
+static uint64_t hist_bucket_max(int bucket)
+{
+	int msb = bucket / STAT_HIST_SUB + 1;
+	int sub = bucket % STAT_HIST_SUB;
+
+	if (bucket < STAT_HIST_SUB)
+		return bucket;
+	if (bucket == STAT_HIST_BUCKETS - 1)
+		return UINT64_MAX;
+
+	return ((uint64_t)(STAT_HIST_SUB + sub + 1) << (msb - 2)) - 1;
+}
+
+static size_t record_name_len(const char *name)
+{
+	return name ? strnlen(name, UINT16_MAX) : 0;
+}
+
+static void record_call(struct stat_timer *timer, uint64_t duration)
+{
+	struct fs_record record = { 0 };
+
+	record.start_ns = timer->start > record_epoch ?
+		timer->start - record_epoch : 0;
+	record.offset = timer->offset;
+	record.length = timer->length;
+	record.duration_ns = duration < UINT32_MAX ? duration : UINT32_MAX;
+	record.fd = timer->fd;
+	record.name_len = record_name_len(timer->name);
+	record.name2_len = record_name_len(timer->name2);
+	record.op = timer->op;
+
+	pthread_mutex_lock(&record_lock);
+	if (record_file &&
+	    (fwrite(&record, sizeof(record), 1, record_file) != 1 ||
+	     fwrite(timer->name ? timer->name : "", 1, record.name_len,
+		    record_file) != record.name_len ||
+	     fwrite(timer->name2 ? timer->name2 : "", 1, record.name2_len,
+		    record_file) != record.name2_len))
+		record_failed = true;
+	pthread_mutex_unlock(&record_lock);
+}
+
+void stat_timer_end(struct stat_timer *timer)
+{
+	uint64_t duration = stat_now() - timer->start;
+	int i = stat_shard_i;
+
+	if (i < 0)
+		i = stat_shard_assign();
+
+	stat_shard_add(&stat_shards[i], &stat_shards[i].latency_total[timer->op],
+		       duration);
+	stat_shard_add(&stat_shards[i],
+		       &stat_shards[i].latency_hist[timer->op][hist_bucket(duration)],
+		       1);
+
+	/* Either fs_trace_start() sees this call among the writers, or the
+	 * call sees the trace stopped */
+	if (__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&trace_writers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&trace_on, __ATOMIC_SEQ_CST)) {
+			uint64_t n = __atomic_fetch_add(&trace_next, 1,
+							__ATOMIC_RELAXED);
+			struct stat_event *event = trace + n % trace_len;
+
+			event->start = timer->start - trace_epoch;
+			event->duration = duration;
+			event->offset = timer->offset;
+			event->length = timer->length;
+			event->fd = timer->fd;
+			event->op = timer->op;
+		}
+		__atomic_fetch_sub(&trace_writers, 1, __ATOMIC_RELEASE);
+	}
+
+	/* Internal operations are not part of the workload */
+	if (timer->op < FS_OP_BACKUP &&
+	    __atomic_load_n(&record_on, __ATOMIC_RELAXED))
+		record_call(timer, duration);
+}
+
+int fs_get_stats(struct fs_stats *stats)
+{
+	uint64_t sums[STAT_COUNT] = { 0 };
+	int i, j;
+
+	if (!stats)
+		return -1;
+
+	for (i = 0; i < STAT_SHARDS; i++)
+		for (j = 0; j < STAT_COUNT; j++)
+			sums[j] += __atomic_load_n(&stat_shards[i].counters[j],
+						   __ATOMIC_RELAXED);
+
+	memcpy(stats, sums, sizeof(sums));
+
+	return 0;
+}
+
+void fs_reset_stats(void)
+{
+	int i, j, k;
+
+	for (i = 0; i < STAT_SHARDS; i++) {
+		for (j = 0; j < STAT_COUNT; j++)
+			__atomic_store_n(&stat_shards[i].counters[j], 0,
+					 __ATOMIC_RELAXED);
+		for (j = 0; j < FS_OP_COUNT; j++) {
+			__atomic_store_n(&stat_shards[i].latency_total[j], 0,
+					 __ATOMIC_RELAXED);
+			for (k = 0; k < STAT_HIST_BUCKETS; k++)
+				__atomic_store_n(&stat_shards[i].latency_hist[j][k],
+						 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+const char *fs_op_name(int op)
+{
+	if (op < 0 || op >= FS_OP_COUNT)
+		return NULL;
+
+	return op_names[op];
+}
+
+int fs_get_latency(int op, struct fs_latency *latency)
+{
+	uint64_t hist[STAT_HIST_BUCKETS] = { 0 };
+	uint64_t *percentiles[] = { &latency->p50_ns, &latency->p90_ns,
+				    &latency->p99_ns, &latency->p999_ns };
+	const uint64_t permille[] = { 500, 900, 990, 999 };
+	uint64_t seen = 0;
+	size_t p = 0;
+	int i, j;
+
+	if (op < 0 || op >= FS_OP_COUNT || !latency)
+		return -1;
+
+	memset(latency, 0, sizeof(struct fs_latency));
+	for (i = 0; i < STAT_SHARDS; i++) {
+		latency->total_ns += __atomic_load_n(&stat_shards[i].latency_total[op],
+						     __ATOMIC_RELAXED);
+		for (j = 0; j < STAT_HIST_BUCKETS; j++)
+			hist[j] += __atomic_load_n(&stat_shards[i].latency_hist[op][j],
+						   __ATOMIC_RELAXED);
+	}
+
+	for (j = 0; j < STAT_HIST_BUCKETS; j++)
+		latency->count += hist[j];
+
+	/* Percentiles are reported as the upper bound of their bucket */
+	for (j = 0; j < STAT_HIST_BUCKETS; j++) {
+		if (!hist[j])
+			continue;
+		seen += hist[j];
+		while (p < 4 && seen * 1000 >= latency->count * permille[p])
+			*percentiles[p++] = hist_bucket_max(j);
+		latency->max_ns = hist_bucket_max(j);
+	}
+
+	return 0;
+}
+
+int fs_trace_start(size_t events)
+{
+	struct stat_event *buffer;
+
+	if (events == 0)
+		return -1;
+
+	pthread_mutex_lock(&trace_lock);
+	__atomic_store_n(&trace_on, false, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&trace_writers, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	buffer = realloc(trace, events * sizeof(struct stat_event));
+	if (!buffer) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	trace = buffer;
+	trace_len = events;
+	trace_next = 0;
+	trace_epoch = stat_now();
+	__atomic_store_n(&trace_on, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+
+	return 0;
+}
+
+void fs_trace_stop(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	__atomic_store_n(&trace_on, false, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&trace_writers, __ATOMIC_ACQUIRE))
+		sched_yield();
+	pthread_mutex_unlock(&trace_lock);
+}
+
+int fs_trace_dump(const char *filename)
+{
+	uint64_t n, i;
+	FILE *file;
+
+	if (!filename)
+		return -1;
+
+	/* The buffer stays in place while the lock is held */
+	pthread_mutex_lock(&trace_lock);
+	if (!trace) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	file = fopen(filename, "w");
+	if (!file) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	/* Oldest event first */
+	n = trace_next < trace_len ? trace_next : trace_len;
+	fprintf(file, "start_ns,op,fd,offset,length,duration_ns\n");
+	for (i = trace_next - n; i < trace_next; i++) {
+		struct stat_event *event = trace + i % trace_len;
+
+		fprintf(file, "%" PRIu64 ",%s,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+			event->start, fs_op_name(event->op), event->fd,
+			event->offset, event->length, event->duration);
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	return fclose(file) ? -1 : 0;
+}
+
+int fs_record_start(const char *filename)
+{
+	FILE *file;
+
+	if (!filename)
+		return -1;
+
+	fs_record_stop();
+
+	file = fopen(filename, "wb");
+	if (!file)
+		return -1;
+	setvbuf(file, NULL, _IOFBF, 1 << 20);
+	if (fwrite(FS_RECORD_MAGIC, 1, 8, file) != 8) {
+		fclose(file);
+		return -1;
+	}
+
+	pthread_mutex_lock(&record_lock);
+	record_file = file;
+	record_failed = false;
+	record_epoch = stat_now();
+	pthread_mutex_unlock(&record_lock);
+	__atomic_store_n(&record_on, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int fs_record_stop(void)
+{
+	int ret;
+
+	__atomic_store_n(&record_on, false, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&record_lock);
+	if (!record_file) {
+		pthread_mutex_unlock(&record_lock);
+		return -1;
+	}
+	ret = fclose(record_file) || record_failed ? -1 : 0;
+	record_file = NULL;
+	pthread_mutex_unlock(&record_lock);
+
+	return ret;
+}
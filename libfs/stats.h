@@ -0,0 +1,128 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "fs.h"
+
+/* Counters, in the same order as the fields of struct fs_stats */
+enum stat_counter {
+	STAT_BLOCK_READS,
+	STAT_BLOCK_READ_BYTES,
+	STAT_BLOCK_WRITES,
+	STAT_BLOCK_WRITE_BYTES,
+	STAT_DIRECT_READS,
+	STAT_BOUNCE_READS,
+	STAT_DIRECT_WRITES,
+	STAT_BOUNCE_WRITES,
+	STAT_FAT_HOPS,
+	STAT_ALLOC_SCANS,
+	STAT_ALLOC_SCAN_ENTRIES,
+	STAT_BACKUPS,
+	STAT_BACKUP_BLOCKS,
+	STAT_FAT_LOADS,
+	STAT_CSUM_ERRORS,
+	STAT_DEDUP_BLOCKS,
+	STAT_COUNT
+};
+
+/* Counters are spread over shards, each thread updating its own */
+#define STAT_SHARDS 64
+
+/* Latencies are counted in log-scale buckets of nanoseconds: 4 buckets per
+ * power of two, up to 2^37 ns (over two minutes) */
+#define STAT_HIST_SUB 4
+#define STAT_HIST_BUCKETS (36 * STAT_HIST_SUB)
+
+struct stat_shard {
+	uint64_t counters[STAT_COUNT];
+	uint64_t latency_total[FS_OP_COUNT];
+	uint64_t latency_hist[FS_OP_COUNT][STAT_HIST_BUCKETS];
+	/* Live threads using the shard */
+	int users;
+} __attribute__((aligned(64)));
+
+extern struct stat_shard stat_shards[STAT_SHARDS];
+extern __thread int stat_shard_i;
+
+int stat_shard_assign(void);
+
+/**
+ * stat_shard_add - Add to a counter of a shard
+ * @shard: Shard of the calling thread
+ * @counter: Counter to update, in @shard
+ * @n: Amount to add
+ *
+ * Cheap enough to call on every FAT hop: the calling thread's shard is
+ * updated with a relaxed atomic load and store, no locked instruction. The
+ * shards of exited threads are handed to new ones, so a shard is only shared
+ * while more than %STAT_SHARDS threads are alive, and then updated with
+ * atomic adds.
+ */
+static inline void stat_shard_add(struct stat_shard *shard, uint64_t *counter,
+				  uint64_t n)
+{
+	if (__atomic_load_n(&shard->users, __ATOMIC_RELAXED) > 1)
+		__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(counter,
+				 __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+				 __ATOMIC_RELAXED);
+}
+
+static inline void stat_add(enum stat_counter counter, uint64_t n)
+{
+	int i = stat_shard_i;
+
+	if (i < 0)
+		i = stat_shard_assign();
+
+	stat_shard_add(&stat_shards[i], &stat_shards[i].counters[counter], n);
+}
+
+/* A timed call, recorded when the stat_timer goes out of scope */
+struct stat_timer {
+	int op;
+	int fd;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t start;
+	/* File names, only kept by recordings */
+	const char *name;
+	const char *name2;
+};
+
+static inline uint64_t stat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stat_timer_end(struct stat_timer *timer);
+
+/**
+ * STAT_TIMED - Time the rest of the enclosing block
+ * @op: Operation, one of enum fs_op
+ * @fd: File descriptor, or -1
+ * @offset: Offset in the file, or on disk for block operations
+ * @length: Number of bytes asked for
+ *
+ * The call is added to the latency histogram of @op, and to the trace if one
+ * was started with fs_trace_start(), whichever way the block is left.
+ */
+#define STAT_TIMED(op, fd, offset, length)				\
+	struct stat_timer stat_timer __attribute__((cleanup(stat_timer_end))) = \
+		{ (op), (fd), (offset), (length), stat_now(), NULL, NULL }
+
+/**
+ * STAT_NAMES - Name the files of the call timed by STAT_TIMED
+ * @first: File name, or NULL
+ * @second: Second file name, or NULL
+ */
+#define STAT_NAMES(first, second)					\
+	(stat_timer.name = (first), stat_timer.name2 = (second))
+
+#endif /* _STATS_H */